@@ -0,0 +1,406 @@
+#!/usr/bin/env python3
+"""
+Benchmark driver for the timestamping tools.
+
+Every run happens between two private network namespaces joined by a veth
+pair (optionally shaped with netem on the sender side), so results do not
+depend on, or disturb, the host network. A sweep runs each suite over
+message sizes, rates and modes, parses the cumulative histograms the tools
+print and writes a JSON file. With --baseline the results are compared
+against an earlier file and regressions are flagged (exit code 2).
+
+Needs root for ip netns/tc. Build the tools first (make), or use make bench.
+"""
+
+import argparse
+import datetime
+import json
+import os
+import platform
+import re
+import signal
+import subprocess
+import sys
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+TX_ADDR = "10.99.0.1"
+RX_ADDR = "10.99.0.2"
+PORT = 10000
+
+# mode name -> extra arguments, sizes and rates are swept for every mode
+SUITES = {
+    "udp": {
+        "modes": {
+            "recvmsg": [],
+            "recvmmsg": ["-b", "32"],
+            "uring": ["-u", "256"],
+            "tsc": ["-K"],
+        },
+        "sizes": [64, 1400],
+        "rates": [1000, 20000],
+    },
+    "tcp": {
+        "modes": {
+            "copy": [],
+            "zerocopy": ["-z"],
+            "tsc": ["-K"],
+            "busy": ["-e", "busy"],
+            "spin": ["-e", "spin"],
+            "adaptive": ["-e", "adaptive"],
+        },
+        "sizes": [64, 16384],
+        "rates": [1000, 10000],
+    },
+    "pingpong": {
+        "modes": {
+            "default": [],
+        },
+        "sizes": [56, 1400],
+        "rates": [0, 10000],  # 0: closed loop
+    },
+    # udp_sender send time accuracy: user space timers vs SO_TXTIME launch
+    # times, "qdiscs" go on the tx device for their mode instead of netem
+    "pacing": {
+        "modes": {
+            "timerfd": [],
+            "busy": ["-y"],
+            "fq": ["-L", "fq"],
+            "etf": ["-L", "etf"],
+        },
+        "qdiscs": {
+            "fq": ["fq"],
+            "etf": ["etf", "clockid", "CLOCK_TAI", "delta", "200000"],
+        },
+        "sizes": [64, 1400],
+        "rates": [10000, 100000],
+    },
+    "timer": {
+        "modes": {
+            "epoll": ["-m", "epoll"],
+            "read": ["-m", "read"],
+            "nanosleep": ["-m", "nanosleep"],
+        },
+        "sizes": [0],
+        "rates": [1000, 10000],  # wakeups per second
+    },
+}
+
+HIST = re.compile(r"^\s*(?P<label>.*?)\s+total\s*:\s+n (?P<n>\d+) min (?P<min>-?\d+) "
+                  r"p50 (?P<p50>-?\d+) p90 (?P<p90>-?\d+) p99 (?P<p99>-?\d+) "
+                  r"p99\.9 (?P<p999>-?\d+) max (?P<max>-?\d+) ns")
+RATE = re.compile(r"rate: (?P<rate>[\d.]+) (?:pps|rtt/s|replies/s)")
+THROUGHPUT = re.compile(r"throughput: (?P<mbs>[\d.]+) MB/s")
+DROPS = re.compile(r"drops: \d+ \((?P<drops>\d+) total\)")
+LOST = re.compile(r"lost: (?P<lost>\d+)")
+CPU = re.compile(r"cpu: (?:[\d.]+% errqueue of )?(?P<cpu>[\d.]+)%")
+LATE = re.compile(r"late ticks: (?P<late>\d+)")
+MISSED = re.compile(r"txtime\s*: missed (?P<missed>\d+)")
+
+
+def sh(*args, check=True):
+    return subprocess.run(args, check=check, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                          universal_newlines=True)
+
+
+class Topology:
+    """tx and rx namespaces, veth in between, netem on the tx end"""
+
+    def __init__(self, delay=None, loss=None):
+        tag = os.getpid() % 100000
+        self.tx = "tsbench-tx-%d" % tag
+        self.rx = "tsbench-rx-%d" % tag
+        self.tx_dev = "tsb%da" % tag
+        self.rx_dev = "tsb%db" % tag
+        self.delay = delay
+        self.loss = loss
+
+    def __enter__(self):
+        try:
+            for ns in (self.tx, self.rx):
+                sh("ip", "netns", "add", ns)
+                sh("ip", "-n", ns, "link", "set", "lo", "up")
+            sh("ip", "-n", self.tx, "link", "add", self.tx_dev, "type", "veth",
+               "peer", "name", self.rx_dev, "netns", self.rx)
+            for ns, dev, addr in ((self.tx, self.tx_dev, TX_ADDR), (self.rx, self.rx_dev, RX_ADDR)):
+                sh("ip", "-n", ns, "addr", "add", addr + "/30", "dev", dev)
+                sh("ip", "-n", ns, "link", "set", dev, "up")
+            error = self.qdisc(None)
+            if error:
+                raise RuntimeError(error)
+        except BaseException:
+            self.__exit__(None, None, None)
+            raise
+        return self
+
+    def __exit__(self, *exc):
+        for ns in (self.tx, self.rx):
+            sh("ip", "netns", "del", ns, check=False)
+
+    def netem(self):
+        if not (self.delay or self.loss):
+            return None
+        netem = ["netem"]
+        if self.delay:
+            netem += ["delay", self.delay]
+        if self.loss:
+            netem += ["loss", self.loss]
+        return netem
+
+    def qdisc(self, args):
+        """tx root qdisc, None for netem or the default; an error message or None"""
+        sh("tc", "-n", self.tx, "qdisc", "del", "dev", self.tx_dev, "root", check=False)
+        args = args or self.netem()
+        if not args:
+            return None
+        out = sh("tc", "-n", self.tx, "qdisc", "add", "dev", self.tx_dev, "root", *args, check=False)
+        if out.returncode != 0:
+            return "%s: %s (is sch_%s available?)" % (args[0], out.stdout.strip(), args[0])
+        return None
+
+    def spawn(self, ns, args):
+        cmd = ["ip", "netns", "exec", ns, "stdbuf", "-oL"] + args
+        return subprocess.Popen(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                                universal_newlines=True, start_new_session=True)
+
+
+def stop(proc):
+    """SIGINT the tool, whatever it printed so far is the result"""
+    if proc.poll() is None:
+        os.killpg(proc.pid, signal.SIGINT)
+        try:
+            return proc.communicate(timeout=5)[0]
+        except subprocess.TimeoutExpired:
+            os.killpg(proc.pid, signal.SIGKILL)
+    return proc.communicate()[0]
+
+
+def parse(output):
+    """last cumulative histogram per label, last rate/throughput/drops/cpu seen"""
+    latency = {}
+    counters = {}
+    for line in output.splitlines():
+        m = HIST.match(line)
+        if m:
+            label = " ".join(m.group("label").split())
+            latency[label] = {k: int(v) for k, v in m.groupdict().items() if k != "label"}
+            continue
+        for regex, key, kind in ((RATE, "rate", float), (THROUGHPUT, "mbs", float),
+                                 (DROPS, "drops", int), (LOST, "lost", int), (CPU, "cpu", float),
+                                 (LATE, "late", int), (MISSED, "missed", int)):
+            m = regex.search(line)
+            if m:
+                counters[key] = kind(m.group(key))
+    return latency, counters
+
+
+def tool(opts, name):
+    return os.path.join(opts.bin, name)
+
+
+def run_case(topo, opts, suite, mode, extra, size, rate):
+    """one point of the sweep: (server, client) started, measured, stopped"""
+    result = {"suite": suite, "mode": mode, "size": size, "rate": rate,
+              "latency": {}, "counters": {}}
+    qdisc = SUITES[suite].get("qdiscs", {}).get(mode)
+    if qdisc:
+        error = topo.qdisc(qdisc)
+        if error:
+            topo.qdisc(None)
+            result["error"] = error
+            return result
+
+    server = None
+    roles = []
+    if suite == "udp":
+        server = topo.spawn(topo.rx, [tool(opts, "udp_timestamping")] + extra)
+        time.sleep(0.5)  # a connected sender dies on ECONNREFUSED
+        client = topo.spawn(topo.tx, [tool(opts, "udp_sender"), "-a", RX_ADDR,
+                                      "-r", str(rate), "-s", str(size)])
+        roles = [("rx", server), ("tx", client)]
+    elif suite == "pacing":
+        server = topo.spawn(topo.rx, [tool(opts, "udp_timestamping")])
+        time.sleep(0.5)
+        client = topo.spawn(topo.tx, [tool(opts, "udp_sender"), "-a", RX_ADDR,
+                                      "-r", str(rate), "-s", str(size), "-w", str(rate)] + extra)
+        roles = [("rx", server), ("tx", client)]
+    elif suite == "tcp":
+        server = topo.spawn(topo.rx, [tool(opts, "tcp_timestamping"), "-l", "-s", str(size),
+                                      "-w", str(max(rate, 1))])
+        time.sleep(0.5)
+        client = topo.spawn(topo.tx, [tool(opts, "tcp_timestamping"), "-a", RX_ADDR,
+                                      "-r", str(rate), "-s", str(size), "-w", str(max(rate, 1))] + extra)
+        roles = [("rx", server), ("tx", client)]
+    elif suite == "pingpong":
+        server = topo.spawn(topo.rx, [tool(opts, "udp_pingpong"), "-S"] + extra)
+        time.sleep(0.2)
+        client = topo.spawn(topo.tx, [tool(opts, "udp_pingpong"), "-a", RX_ADDR,
+                                      "-r", str(rate), "-s", str(size)] + extra)
+        roles = [("tx", client)]
+    elif suite == "timer":
+        client = topo.spawn(topo.tx, [tool(opts, "timer"), "-p", str(1000000000 // rate),
+                                      "-w", str(rate)] + extra)
+        roles = [("tx", client)]
+    else:
+        raise ValueError(suite)
+
+    time.sleep(opts.duration)
+    outputs = {}
+    outputs["tx"] = stop(client)
+    if server is not None:
+        outputs["rx"] = stop(server)
+    if qdisc:
+        topo.qdisc(None)
+
+    for role, _ in roles:
+        latency, counters = parse(outputs[role])
+        for label, hist in latency.items():
+            result["latency"]["%s/%s" % (role, label)] = hist
+        for key, value in counters.items():
+            result["counters"]["%s/%s" % (role, key)] = value
+    if not result["latency"]:
+        # keep the tail of the output, e.g. an unsupported mode on this kernel
+        tail = "\n".join(outputs[role].strip().splitlines()[-1] for role, _ in roles
+                         if outputs[role].strip())
+        result["error"] = tail or "no output"
+    return result
+
+
+def key(result):
+    return "%s/%s/size=%d/rate=%d" % (result["suite"], result["mode"], result["size"], result["rate"])
+
+
+def compare(results, baseline, threshold, floor):
+    """regressions: latency p50/p99 up, rates and throughput down, by more than threshold,
+    and cases or histograms the baseline had but this run did not produce"""
+    old = {key(r): r for r in baseline["results"]}
+    regressions = []
+    for r in results:
+        b = old.get(key(r))
+        if b is None or not b["latency"]:
+            continue
+        if "error" in r or not r["latency"]:
+            regressions.append((key(r), "error", "%d histograms" % len(b["latency"]),
+                                r.get("error", "no histograms")))
+            continue
+        for label, prev in b["latency"].items():
+            hist = r["latency"].get(label)
+            if hist is None:
+                regressions.append((key(r), label, "present", "missing"))
+                continue
+            for q in ("p50", "p99"):
+                if hist[q] > prev[q] * (1 + threshold) and hist[q] - prev[q] > floor:
+                    regressions.append((key(r), "%s %s" % (label, q), prev[q], hist[q]))
+        for name, value in r["counters"].items():
+            prev = b["counters"].get(name)
+            if prev is None or not name.endswith(("/rate", "/mbs")):
+                continue
+            if value < prev * (1 - threshold):
+                regressions.append((key(r), name, prev, value))
+
+    print("Compared against %s (%s, %s)" % (baseline.get("path", "baseline"),
+                                            baseline["meta"].get("kernel"),
+                                            baseline["meta"].get("date")))
+    for case, metric, prev, value in regressions:
+        if isinstance(value, str):
+            print("  REGRESSION %-40s %-36s %12s -> %s" % (case, metric, prev, value.replace("\n", "; ")))
+            continue
+        change = 100.0 * (value - prev) / prev if prev else float("inf")
+        print("  REGRESSION %-40s %-36s %12s -> %-12s (%+.1f%%)" % (case, metric, prev, value, change))
+    if not regressions:
+        print("  no regressions beyond %.0f%%" % (100 * threshold))
+    return regressions
+
+
+def meta(opts):
+    cpu = "unknown"
+    try:
+        with open("/proc/cpuinfo") as f:
+            for line in f:
+                if line.startswith(("model name", "Model")):
+                    cpu = line.split(":", 1)[1].strip()
+                    break
+    except OSError:
+        pass
+    commit = sh("git", "-C", HERE, "describe", "--always", "--dirty", check=False).stdout.strip()
+    return {
+        "date": datetime.datetime.now().isoformat(timespec="seconds"),
+        "kernel": platform.release(),
+        "machine": platform.machine(),
+        "cpu": cpu,
+        "cpus": os.cpu_count(),
+        "commit": commit,
+        "duration": opts.duration,
+        "delay": opts.delay,
+        "loss": opts.loss,
+    }
+
+
+def csv(value, kind=str):
+    return [kind(v) for v in value.split(",") if v]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("-s", "--suites", type=csv, default=list(SUITES),
+                        help="comma separated: %s (default all)" % ",".join(SUITES))
+    parser.add_argument("-m", "--modes", type=csv, help="only these modes, e.g. recvmmsg,copy")
+    parser.add_argument("--sizes", type=lambda v: csv(v, int), help="override per suite message sizes")
+    parser.add_argument("--rates", type=lambda v: csv(v, int), help="override per suite rates")
+    parser.add_argument("-d", "--duration", type=float, default=5, help="seconds per run (default 5)")
+    parser.add_argument("--delay", help="netem delay on the tx side, e.g. 100us")
+    parser.add_argument("--loss", help="netem loss on the tx side, e.g. 0.1%%")
+    parser.add_argument("-o", "--output", help="JSON results (default bench-results/<date>.json)")
+    parser.add_argument("-b", "--baseline", help="JSON results to compare against")
+    parser.add_argument("-t", "--threshold", type=float, default=10,
+                        help="regression threshold in percent (default 10)")
+    parser.add_argument("--floor", type=int, default=1000,
+                        help="ignore latency changes below this many ns (default 1000)")
+    parser.add_argument("--bin", default=HERE, help="directory with the built tools")
+    opts = parser.parse_args()
+
+    if os.geteuid() != 0:
+        parser.error("needs root for network namespaces")
+    for suite in opts.suites:
+        if suite not in SUITES:
+            parser.error("unknown suite: %s" % suite)
+
+    results = []
+    with Topology(opts.delay, opts.loss) as topo:
+        for suite in opts.suites:
+            spec = SUITES[suite]
+            for mode, extra in spec["modes"].items():
+                if opts.modes and mode not in opts.modes:
+                    continue
+                for size in opts.sizes or spec["sizes"]:
+                    for rate in opts.rates or spec["rates"]:
+                        if suite == "timer" and rate <= 0:
+                            continue
+                        result = run_case(topo, opts, suite, mode, extra, size, rate)
+                        results.append(result)
+                        summary = result.get("error", "%d histograms" % len(result["latency"]))
+                        print("%-48s %s" % (key(result), summary.splitlines()[-1]))
+                        sys.stdout.flush()
+
+    report = {"meta": meta(opts), "results": results}
+    output = opts.output
+    if output is None:
+        os.makedirs(os.path.join(HERE, "bench-results"), exist_ok=True)
+        output = os.path.join(HERE, "bench-results",
+                              datetime.datetime.now().strftime("%Y%m%d-%H%M%S.json"))
+    with open(output, "w") as f:
+        json.dump(report, f, indent=1, sort_keys=True)
+    print("Results in %s" % output)
+
+    if opts.baseline:
+        with open(opts.baseline) as f:
+            baseline = json.load(f)
+        baseline["path"] = opts.baseline
+        if compare(results, baseline, opts.threshold / 100.0, opts.floor):
+            return 2
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,160 @@
+#ifndef DGRAM_H
+#define DGRAM_H
+
+/*
+ * Header put by udp_sender at the start of every datagram.
+ *
+ * Fields travel in network byte order. Times are CLOCK_REALTIME ns, so
+ * one-way numbers only make sense on a single host or with PTP synced
+ * clocks. Besides its own send time every datagram carries the kernel TX
+ * timestamp of the latest earlier datagram the sender got one for, which
+ * lets the receiver split one-way latency into sender stack and the rest.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#define DGRAM_MAGIC 0x54535450 /* "TSTP" */
+#define DGRAM_NO_TX UINT64_MAX
+
+struct dgram_header {
+    uint32_t magic;
+    uint32_t session; /* random per sender run */
+    uint64_t seq;
+    uint64_t send_ns; /* right before sendmsg() */
+    uint64_t tx_seq;  /* DGRAM_NO_TX if no TX timestamp is known yet */
+    uint64_t tx_ns;   /* SCM_TIMESTAMPING TX software timestamp of tx_seq */
+} __attribute__((packed));
+
+static inline void dgram_encode(void* buf, const struct dgram_header* h) {
+    struct dgram_header wire;
+    wire.magic = htobe32(h->magic);
+    wire.session = htobe32(h->session);
+    wire.seq = htobe64(h->seq);
+    wire.send_ns = htobe64(h->send_ns);
+    wire.tx_seq = htobe64(h->tx_seq);
+    wire.tx_ns = htobe64(h->tx_ns);
+    memcpy(buf, &wire, sizeof(wire));
+}
+
+/* returns 0 if the payload was not produced by udp_sender */
+static inline int dgram_decode(const void* buf, size_t len, struct dgram_header* h) {
+    if(len < sizeof(*h)) {
+        return 0;
+    }
+    struct dgram_header wire;
+    memcpy(&wire, buf, sizeof(wire));
+    if(be32toh(wire.magic) != DGRAM_MAGIC) {
+        return 0;
+    }
+    h->magic = DGRAM_MAGIC;
+    h->session = be32toh(wire.session);
+    h->seq = be64toh(wire.seq);
+    h->send_ns = be64toh(wire.send_ns);
+    h->tx_seq = be64toh(wire.tx_seq);
+    h->tx_ns = be64toh(wire.tx_ns);
+    return 1;
+}
+
+/*
+ * udp_pingpong reply: the request header echoed with send_ns replaced by the
+ * reflector's time right before its sendmsg() and tx_seq/tx_ns carrying the
+ * kernel TX timestamp of an earlier reply, followed by the reflector's side
+ * of the request. All reflector times are on the reflector's clock.
+ */
+#define PONG_MAGIC 0x474e4f50 /* "PONG" */
+
+struct pong_header {
+    struct dgram_header dgram;
+    uint64_t rx_ns;      /* SCM_TIMESTAMPING RX software timestamp of the request */
+    uint64_t rx_user_ns; /* right after recvmsg() */
+} __attribute__((packed));
+
+static inline void pong_encode(void* buf, const struct pong_header* h) {
+    dgram_encode(buf, &h->dgram);
+    uint64_t wire[2] = { htobe64(h->rx_ns), htobe64(h->rx_user_ns) };
+    memcpy((char*)buf + sizeof(h->dgram), wire, sizeof(wire));
+}
+
+/* returns 0 if the payload is not a udp_pingpong reply */
+static inline int pong_decode(const void* buf, size_t len, struct pong_header* h) {
+    if(len < sizeof(*h)) {
+        return 0;
+    }
+    struct dgram_header wire;
+    memcpy(&wire, buf, sizeof(wire));
+    if(be32toh(wire.magic) != PONG_MAGIC) {
+        return 0;
+    }
+    wire.magic = htobe32(DGRAM_MAGIC);
+    dgram_decode(&wire, sizeof(wire), &h->dgram);
+    h->dgram.magic = PONG_MAGIC;
+    uint64_t rest[2];
+    memcpy(rest, (const char*)buf + sizeof(wire), sizeof(rest));
+    h->rx_ns = be64toh(rest[0]);
+    h->rx_user_ns = be64toh(rest[1]);
+    return 1;
+}
+
+/*
+ * Loss/reordering/duplicate tracker for one sender session.
+ *
+ * A gap is counted as lost right away and given back if the missing
+ * datagram shows up later. Datagrams older than SEQ_WINDOW behind the
+ * highest sequence seen can't be told from duplicates and count as late.
+ */
+#define SEQ_WINDOW 65536
+
+struct sequence {
+    uint32_t session;
+    uint64_t next; /* highest sequence seen + 1 */
+    uint64_t received;
+    uint64_t lost;
+    uint64_t reordered;
+    uint64_t duplicates;
+    uint64_t late;
+    uint64_t seen[SEQ_WINDOW / 64];
+};
+
+static inline int sequence_test_and_set(struct sequence* s, uint64_t seq) {
+    uint64_t bit = 1ull << (seq % 64);
+    uint64_t* word = &s->seen[(seq / 64) % (SEQ_WINDOW / 64)];
+    int set = (*word & bit) != 0;
+    *word |= bit;
+    return set;
+}
+
+static inline void sequence_update(struct sequence* s, uint32_t session, uint64_t seq) {
+    if(s->session != session || s->received == 0) {
+        /* new sender run: counters keep accumulating */
+        s->session = session;
+        s->next = seq;
+        memset(s->seen, 0, sizeof(s->seen));
+    }
+    ++s->received;
+
+    if(seq >= s->next) {
+        s->lost += seq - s->next;
+        uint64_t from = seq - s->next >= SEQ_WINDOW ? seq - SEQ_WINDOW + 1 : s->next;
+        for(uint64_t i = from; i <= seq; ++i) {
+            s->seen[(i / 64) % (SEQ_WINDOW / 64)] &= ~(1ull << (i % 64));
+        }
+        sequence_test_and_set(s, seq);
+        s->next = seq + 1;
+    } else if(s->next - seq > SEQ_WINDOW) {
+        ++s->late;
+        if(s->lost > 0) {
+            --s->lost;
+        }
+    } else if(sequence_test_and_set(s, seq)) {
+        ++s->duplicates;
+    } else {
+        ++s->reordered;
+        if(s->lost > 0) {
+            --s->lost;
+        }
+    }
+}
+
+#endif
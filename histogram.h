@@ -0,0 +1,124 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+/*
+ * Log-bucketed (HDR-style) latency histogram.
+ *
+ * Values are split into power of two groups, each group is divided into
+ * HIST_SUB_COUNT linear sub-buckets, so relative error stays below
+ * 1/HIST_SUB_COUNT across the whole range. Recording is a couple of bit
+ * operations and an increment; the structure has a fixed size and never
+ * allocates. Values above HIST_MAX_BITS are clamped into the last bucket,
+ * negative values into the first one (min/max are always exact).
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#define HIST_SUB_BITS 6
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40 /* ~18 minutes in ns */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct histogram {
+    uint64_t count;
+    int64_t min;
+    int64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+static inline void hist_reset(struct histogram* h) {
+    memset(h, 0, sizeof(*h));
+    h->min = INT64_MAX;
+    h->max = INT64_MIN;
+}
+
+static inline size_t hist_index(int64_t value) {
+    if(value < HIST_SUB_COUNT) {
+        return value < 0 ? 0 : (size_t)value;
+    }
+    if(value >= (int64_t)1 << HIST_MAX_BITS) {
+        return HIST_BUCKETS - 1;
+    }
+    unsigned shift = 63 - __builtin_clzll((uint64_t)value) - HIST_SUB_BITS;
+    return ((size_t)(shift + 1) << HIST_SUB_BITS) +
+           (((uint64_t)value >> shift) & (HIST_SUB_COUNT - 1));
+}
+
+/* lowest value which falls into the bucket */
+static inline int64_t hist_value(size_t index) {
+    size_t group = index >> HIST_SUB_BITS;
+    int64_t sub = index & (HIST_SUB_COUNT - 1);
+    return group == 0 ? sub : (HIST_SUB_COUNT + sub) << (group - 1);
+}
+
+static inline void hist_record(struct histogram* h, int64_t value) {
+    ++h->buckets[hist_index(value)];
+    ++h->count;
+    if(value < h->min) h->min = value;
+    if(value > h->max) h->max = value;
+}
+
+static inline void hist_merge(struct histogram* dst, const struct histogram* src) {
+    if(src->count == 0) {
+        return;
+    }
+    for(size_t i = 0; i < HIST_BUCKETS; ++i) {
+        dst->buckets[i] += src->buckets[i];
+    }
+    dst->count += src->count;
+    if(src->min < dst->min) dst->min = src->min;
+    if(src->max > dst->max) dst->max = src->max;
+}
+
+/* q in [0, 1]; returns the middle of the bucket holding the q-th value */
+static inline int64_t hist_percentile(const struct histogram* h, double q) {
+    if(h->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * h->count + 0.5);
+    if(rank == 0) rank = 1;
+    if(rank > h->count) rank = h->count;
+
+    uint64_t seen = 0;
+    for(size_t i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->buckets[i];
+        if(seen >= rank) {
+            int64_t lo = hist_value(i);
+            int64_t hi = i + 1 < HIST_BUCKETS ? hist_value(i + 1) - 1 : lo;
+            int64_t mid = lo + (hi - lo) / 2;
+            if(mid < h->min) mid = h->min;
+            if(mid > h->max) mid = h->max;
+            return mid;
+        }
+    }
+    return h->max;
+}
+
+static inline void hist_print(const char* label, const struct histogram* h) {
+    if(h->count == 0) {
+        printf("%s: no samples\n", label);
+        return;
+    }
+    printf("%s: n %llu min %lld p50 %lld p90 %lld p99 %lld p99.9 %lld max %lld ns\n",
+           label, (unsigned long long)h->count, (long long)h->min,
+           (long long)hist_percentile(h, 0.5),
+           (long long)hist_percentile(h, 0.9),
+           (long long)hist_percentile(h, 0.99),
+           (long long)hist_percentile(h, 0.999),
+           (long long)h->max);
+}
+
+/* prints the window and the cumulative stats, then folds the window into the total */
+static inline void hist_report(const char* label, struct histogram* window, struct histogram* total) {
+    char buf[128];
+    hist_merge(total, window);
+    snprintf(buf, sizeof(buf), "%s window", label);
+    hist_print(buf, window);
+    snprintf(buf, sizeof(buf), "%s total ", label);
+    hist_print(buf, total);
+    hist_reset(window);
+}
+
+#endif
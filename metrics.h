@@ -0,0 +1,201 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+/*
+ * Live metrics in a shared memory segment (a file in /dev/shm).
+ *
+ * A tool registers named counters and histograms once at startup and
+ * rewrites them at the end of every report window under a seqlock, the
+ * same point where it would printf() anyway, so the receive and send loops
+ * gain no syscalls and no locks. For each histogram the segment keeps the
+ * last window's percentiles and the cumulative buckets. metrics_reader
+ * attaches read-only, copies the segment consistently and prints it or
+ * exports Prometheus text.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+#include "histogram.h"
+#include "seqlock.h"
+
+#define METRICS_MAGIC 0x5254454d /* "METR" */
+#define METRICS_VERSION 1
+#define METRICS_DIR "/dev/shm/"
+#define METRICS_NAME_MAX 48
+#define METRICS_COUNTERS_MAX 32
+#define METRICS_HISTOGRAMS_MAX 16
+#define METRICS_READ_TRIES 1000
+
+struct metrics_counter {
+    char name[METRICS_NAME_MAX];
+    int64_t value;
+};
+
+struct metrics_window {
+    uint64_t count;
+    int64_t min;
+    int64_t p50;
+    int64_t p90;
+    int64_t p99;
+    int64_t p999;
+    int64_t max;
+};
+
+struct metrics_histogram {
+    char name[METRICS_NAME_MAX];
+    struct metrics_window window; /* last report window */
+    struct histogram total;
+};
+
+struct metrics_segment {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t hist_buckets; /* layout check, HIST_BUCKETS of the writer */
+    uint32_t counters;
+    uint32_t histograms;
+    int32_t pid;
+    char tool[32];
+    int64_t started_ns; /* CLOCK_REALTIME */
+    struct seqlock lock;
+    /* protected by lock from here on */
+    int64_t updated_ns;
+    uint64_t windows;
+    struct metrics_counter counter[METRICS_COUNTERS_MAX];
+    struct metrics_histogram histogram[METRICS_HISTOGRAMS_MAX];
+};
+
+struct metrics {
+    int fd;
+    struct metrics_segment* seg;
+};
+
+static inline int64_t metrics_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return 1000000000ll*now.tv_sec + now.tv_nsec;
+}
+
+/* name without a '/' lives in METRICS_DIR */
+static inline void metrics_path(char* path, size_t size, const char* name) {
+    if(strchr(name, '/') != NULL) {
+        snprintf(path, size, "%s", name);
+    } else {
+        snprintf(path, size, METRICS_DIR "%s", name);
+    }
+}
+
+/* creates (or truncates) the segment, 0 or -errno */
+static inline int metrics_open(struct metrics* m, const char* name, const char* tool) {
+    char path[4096];
+    metrics_path(path, sizeof(path), name);
+    memset(m, 0, sizeof(*m));
+    m->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(m->fd < 0) {
+        return -errno;
+    }
+    if(ftruncate(m->fd, sizeof(*m->seg)) < 0) {
+        return -errno;
+    }
+    void* base = mmap(NULL, sizeof(*m->seg), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m->fd, 0);
+    if(base == MAP_FAILED) {
+        return -errno;
+    }
+    m->seg = base;
+    m->seg->version = METRICS_VERSION;
+    m->seg->hist_buckets = HIST_BUCKETS;
+    m->seg->pid = getpid();
+    snprintf(m->seg->tool, sizeof(m->seg->tool), "%s", tool);
+    m->seg->started_ns = metrics_now_ns();
+    for(size_t h = 0; h < METRICS_HISTOGRAMS_MAX; ++h) {
+        hist_reset(&m->seg->histogram[h].total);
+    }
+    /* readers check the magic last */
+    atomic_store_explicit((_Atomic uint32_t*)&m->seg->magic, METRICS_MAGIC, memory_order_release);
+    return 0;
+}
+
+static inline void metrics_close(struct metrics* m) {
+    munmap(m->seg, sizeof(*m->seg));
+    close(m->fd);
+}
+
+/* registration, before the first update: index or -ENOSPC */
+static inline int metrics_add_counter(struct metrics* m, const char* name) {
+    if(m->seg->counters == METRICS_COUNTERS_MAX) {
+        return -ENOSPC;
+    }
+    snprintf(m->seg->counter[m->seg->counters].name, METRICS_NAME_MAX, "%s", name);
+    return m->seg->counters++;
+}
+
+static inline int metrics_add_histogram(struct metrics* m, const char* name) {
+    if(m->seg->histograms == METRICS_HISTOGRAMS_MAX) {
+        return -ENOSPC;
+    }
+    snprintf(m->seg->histogram[m->seg->histograms].name, METRICS_NAME_MAX, "%s", name);
+    return m->seg->histograms++;
+}
+
+/* updates go between begin and end */
+static inline void metrics_begin(struct metrics* m) {
+    seqlock_write_begin(&m->seg->lock);
+}
+
+static inline void metrics_end(struct metrics* m) {
+    m->seg->updated_ns = metrics_now_ns();
+    ++m->seg->windows;
+    seqlock_write_end(&m->seg->lock);
+}
+
+static inline void metrics_set(struct metrics* m, int idx, int64_t value) {
+    m->seg->counter[idx].value = value;
+}
+
+/*
+ * window is the report window just closed; total the cumulative histogram
+ * including it, or NULL to have the window added to the segment's own total.
+ */
+static inline void metrics_set_histogram(struct metrics* m, int idx,
+                                         const struct histogram* window, const struct histogram* total) {
+    struct metrics_histogram* h = &m->seg->histogram[idx];
+    h->window.count = window->count;
+    h->window.min = window->count > 0 ? window->min : 0;
+    h->window.p50 = hist_percentile(window, 0.5);
+    h->window.p90 = hist_percentile(window, 0.9);
+    h->window.p99 = hist_percentile(window, 0.99);
+    h->window.p999 = hist_percentile(window, 0.999);
+    h->window.max = window->count > 0 ? window->max : 0;
+    if(total != NULL) {
+        memcpy(&h->total, total, sizeof(h->total));
+    } else {
+        hist_merge(&h->total, window);
+    }
+}
+
+/*
+ * Consistent copy for readers. Gives up with -EAGAIN rather than spinning
+ * forever on a writer that died inside an update.
+ */
+static inline int metrics_read(const struct metrics_segment* seg, struct metrics_segment* copy) {
+    for(int i = 0; i < METRICS_READ_TRIES; ++i) {
+        uint32_t seq = atomic_load_explicit((_Atomic uint32_t*)&seg->lock.seq, memory_order_acquire);
+        if((seq & 1) == 0) {
+            memcpy(copy, seg, sizeof(*copy));
+            if(!seqlock_read_retry(&seg->lock, seq)) {
+                return 0;
+            }
+        }
+        usleep(100);
+    }
+    return -EAGAIN;
+}
+
+#endif
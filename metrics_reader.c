@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <error.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <ctype.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "metrics.h"
+
+#define ENFORCE(condition, report) \
+    do {                                        \
+        if(!(condition)) {                      \
+            report;                             \
+            exit(1);                            \
+        }                                       \
+    } while(0)                                  \
+
+
+#define ENFORCE_ERRNO(condition, message)       \
+    ENFORCE((condition >= 0), perror(message))  \
+
+#define ENFORCE_CUSTOM(condition, ...)                            \
+    ENFORCE((condition), fprintf(stderr, __VA_ARGS__))            \
+
+static const char* quantiles[] = { "0.5", "0.9", "0.99", "0.999" };
+#define QUANTILES (sizeof(quantiles)/sizeof(quantiles[0]))
+
+static int running(pid_t pid) {
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+/* Prometheus metric names allow [a-zA-Z0-9_] only */
+static void sanitize(char* dst, size_t size, const char* src) {
+    size_t i = 0;
+    for(; src[i] != '\0' && i + 1 < size; ++i) {
+        dst[i] = isalnum((unsigned char)src[i]) ? tolower((unsigned char)src[i]) : '_';
+    }
+    dst[i] = '\0';
+}
+
+/* label values need no escaping beyond what tools put into names */
+static void trim(char* dst, size_t size, const char* src) {
+    snprintf(dst, size, "%s", src);
+    size_t len = strlen(dst);
+    while(len > 0 && dst[len - 1] == ' ') {
+        dst[--len] = '\0';
+    }
+}
+
+static void print_live(const struct metrics_segment* s) {
+    printf("%s pid %d (%s), %llu updates, last %.1f s ago\n",
+           s->tool, s->pid, running(s->pid) ? "running" : "exited",
+           (unsigned long long)s->windows, (metrics_now_ns() - s->updated_ns) / 1e9);
+    for(uint32_t c = 0; c < s->counters; ++c) {
+        printf("  %-24s: %lld\n", s->counter[c].name, (long long)s->counter[c].value);
+    }
+    for(uint32_t h = 0; h < s->histograms; ++h) {
+        const struct metrics_histogram* m = &s->histogram[h];
+        const struct metrics_window* w = &m->window;
+        char label[128];
+        if(w->count == 0) {
+            printf("  %s window: no samples\n", m->name);
+        } else {
+            printf("  %s window: n %llu min %lld p50 %lld p90 %lld p99 %lld p99.9 %lld max %lld ns\n",
+                   m->name, (unsigned long long)w->count, (long long)w->min, (long long)w->p50,
+                   (long long)w->p90, (long long)w->p99, (long long)w->p999, (long long)w->max);
+        }
+        snprintf(label, sizeof(label), "  %s total ", m->name);
+        hist_print(label, &m->total);
+    }
+    fflush(stdout);
+}
+
+static void print_prometheus(FILE* out, const struct metrics_segment* s) {
+    char tool[64];
+    char name[METRICS_NAME_MAX];
+    char series[METRICS_NAME_MAX];
+    sanitize(tool, sizeof(tool), s->tool);
+
+    fprintf(out, "# HELP timestamping_up 1 while the writer process is alive\n");
+    fprintf(out, "# TYPE timestamping_up gauge\n");
+    fprintf(out, "timestamping_up{tool=\"%s\",pid=\"%d\"} %d\n", tool, s->pid, running(s->pid));
+    fprintf(out, "# TYPE timestamping_updates_total counter\n");
+    fprintf(out, "timestamping_updates_total{tool=\"%s\"} %llu\n", tool, (unsigned long long)s->windows);
+    fprintf(out, "# TYPE timestamping_updated_seconds gauge\n");
+    fprintf(out, "timestamping_updated_seconds{tool=\"%s\"} %.3f\n", tool, s->updated_ns / 1e9);
+
+    for(uint32_t c = 0; c < s->counters; ++c) {
+        sanitize(name, sizeof(name), s->counter[c].name);
+        fprintf(out, "# TYPE timestamping_%s untyped\n", name);
+        fprintf(out, "timestamping_%s{tool=\"%s\"} %lld\n", name, tool, (long long)s->counter[c].value);
+    }
+
+    fprintf(out, "# HELP timestamping_window_latency_ns Percentiles of the last report window\n");
+    fprintf(out, "# TYPE timestamping_window_latency_ns gauge\n");
+    for(uint32_t h = 0; h < s->histograms; ++h) {
+        const struct metrics_window* w = &s->histogram[h].window;
+        int64_t values[QUANTILES] = { w->p50, w->p90, w->p99, w->p999 };
+        trim(series, sizeof(series), s->histogram[h].name);
+        for(size_t q = 0; q < QUANTILES; ++q) {
+            fprintf(out, "timestamping_window_latency_ns{tool=\"%s\",series=\"%s\",quantile=\"%s\"} %lld\n",
+                    tool, series, quantiles[q], (long long)values[q]);
+        }
+        fprintf(out, "timestamping_window_latency_ns{tool=\"%s\",series=\"%s\",quantile=\"1\"} %lld\n",
+                tool, series, (long long)w->max);
+    }
+
+    fprintf(out, "# HELP timestamping_latency_ns Percentiles since the start\n");
+    fprintf(out, "# TYPE timestamping_latency_ns summary\n");
+    for(uint32_t h = 0; h < s->histograms; ++h) {
+        const struct histogram* t = &s->histogram[h].total;
+        double qs[QUANTILES] = { 0.5, 0.9, 0.99, 0.999 };
+        trim(series, sizeof(series), s->histogram[h].name);
+        for(size_t q = 0; q < QUANTILES; ++q) {
+            fprintf(out, "timestamping_latency_ns{tool=\"%s\",series=\"%s\",quantile=\"%s\"} %lld\n",
+                    tool, series, quantiles[q], (long long)hist_percentile(t, qs[q]));
+        }
+        fprintf(out, "timestamping_latency_ns_count{tool=\"%s\",series=\"%s\"} %llu\n",
+                tool, series, (unsigned long long)t->count);
+    }
+}
+
+/* scrapers must never see a half written file: write aside, then rename */
+static void export_prometheus(const char* path, const struct metrics_segment* s) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* out = fopen(tmp, "w");
+    ENFORCE_CUSTOM(out != NULL, "%s: %s\n", tmp, strerror(errno));
+    print_prometheus(out, s);
+    ENFORCE_CUSTOM(fclose(out) == 0, "%s: %s\n", tmp, strerror(errno));
+    ENFORCE_ERRNO(rename(tmp, path), "rename");
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,
+            "usage: %s [-i interval] [-n count] [-p file] name\n"
+            "  name         segment given to a tool with -M, in %s unless it has a '/'\n"
+            "  -i interval  seconds between reads (default 1)\n"
+            "  -n count     stop after count reads, 0 runs forever (default 0)\n"
+            "  -p file      write Prometheus text format to file (\"-\" for stdout) instead\n",
+            name, METRICS_DIR);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    double interval = 1;
+    long count = 0;
+    const char* prometheus = NULL;
+
+    int opt;
+    while((opt = getopt(argc, argv, "i:n:p:h")) != -1) {
+        switch(opt) {
+            case 'i':
+                interval = strtod(optarg, NULL);
+                break;
+            case 'n':
+                count = strtol(optarg, NULL, 0);
+                break;
+            case 'p':
+                prometheus = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(optind + 1 != argc) {
+        usage(argv[0]);
+    }
+    ENFORCE_CUSTOM(interval > 0, "invalid interval: %f\n", interval);
+    ENFORCE_CUSTOM(count >= 0, "invalid count: %ld\n", count);
+
+    char path[4096];
+    metrics_path(path, sizeof(path), argv[optind]);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ENFORCE_ERRNO(fd, path);
+    struct stat st;
+    ENFORCE_ERRNO(fstat(fd, &st), "fstat");
+    ENFORCE_CUSTOM((size_t)st.st_size >= sizeof(struct metrics_segment), "%s: too short\n", path);
+
+    /* read-only: attaching can never disturb the writer */
+    const struct metrics_segment* seg = mmap(NULL, sizeof(*seg), PROT_READ, MAP_SHARED, fd, 0);
+    ENFORCE_CUSTOM(seg != MAP_FAILED, "mmap: %s\n", path);
+    ENFORCE_CUSTOM(atomic_load_explicit((_Atomic uint32_t*)&seg->magic, memory_order_acquire) == METRICS_MAGIC,
+                   "%s: not a metrics segment\n", path);
+    ENFORCE_CUSTOM(seg->version == METRICS_VERSION, "%s: unsupported version %u\n", path, seg->version);
+    ENFORCE_CUSTOM(seg->hist_buckets == HIST_BUCKETS, "%s: histogram layout differs (%u buckets)\n",
+                   path, seg->hist_buckets);
+
+    struct metrics_segment* copy = malloc(sizeof(*copy));
+    ENFORCE_CUSTOM(copy != NULL, "unable to allocate segment copy\n");
+    for(long i = 0; count == 0 || i < count; ++i) {
+        if(i > 0) {
+            usleep(interval * 1e6);
+        }
+        int err = metrics_read(seg, copy);
+        ENFORCE_CUSTOM(err == 0, "%s: writer stuck inside an update\n", path);
+        if(prometheus == NULL) {
+            print_live(copy);
+        } else if(strcmp(prometheus, "-") == 0) {
+            print_prometheus(stdout, copy);
+            fflush(stdout);
+        } else {
+            export_prometheus(prometheus, copy);
+        }
+    }
+
+    free(copy);
+    ENFORCE_ERRNO(munmap((void*)seg, sizeof(*seg)), "munmap");
+    ENFORCE_ERRNO(close(fd), "close");
+    return 0;
+}
@@ -0,0 +1,294 @@
+#ifndef PERF_H
+#define PERF_H
+
+/*
+ * Per call hardware counters around syscall hot paths.
+ *
+ * A perf_event_open() group on the calling thread: cycles, instructions
+ * and cache misses, plus a separate context switch counter which is only
+ * read once per report window. Counters are read before and after every
+ * wrapped call; with the group mapped and rdpmc allowed that is a handful
+ * of instructions and no syscall. Without PMU access (VMs, containers,
+ * perf_event_paranoid) the group falls back to the task clock and page
+ * faults software events, which have to be read() and so add two syscalls
+ * per call. A call during which the group was multiplexed off the PMU, or
+ * around which a read failed, is counted but left out of the sums.
+ * Functions return 0 or -errno and never exit.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PERF_RDPMC 1
+#else
+#define PERF_RDPMC 0
+#endif
+
+#define PERF_COUNTERS_MAX 3
+
+enum perf_kind {
+    PERF_NONE,
+    PERF_HARDWARE, /* cycles, instructions, cache misses */
+    PERF_SOFTWARE  /* task clock (ns), page faults */
+};
+
+struct perf_group {
+    enum perf_kind kind;
+    int rdpmc;     /* every counter of the group readable from user space */
+    int user_only; /* perf_event_paranoid kept the kernel part out */
+    size_t count;
+    int fd[PERF_COUNTERS_MAX];
+    struct perf_event_mmap_page* page[PERF_COUNTERS_MAX];
+    int switches;  /* context switches, read per window */
+};
+
+/* one perf_read() */
+struct perf_sample {
+    int err;          /* -EBUSY: a counter was not on the PMU, -errno of read() otherwise */
+    uint64_t stopped; /* time enabled but not running, grows while multiplexed out */
+    uint64_t value[PERF_COUNTERS_MAX];
+};
+
+/* cumulative, reports print the difference between two of them */
+struct perf_totals {
+    enum perf_kind kind;
+    uint64_t calls;       /* in the sums */
+    uint64_t multiplexed; /* not fully on the PMU, left out */
+    uint64_t failed;      /* a read failed, left out */
+    uint64_t sum[PERF_COUNTERS_MAX];
+    uint64_t switches;
+};
+
+static inline int perf_event_open(struct perf_event_attr* attr, int group) {
+    /* this thread, any cpu */
+    return syscall(SYS_perf_event_open, attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+}
+
+static inline int perf_open_counter(uint32_t type, uint64_t config, int group, int user_only) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_kernel = user_only;
+    attr.exclude_hv = 1;
+    int fd = perf_event_open(&attr, group);
+    return fd < 0 ? -errno : fd;
+}
+
+static inline void perf_close(struct perf_group* g) {
+    for(size_t i = 0; i < g->count; ++i) {
+        if(g->page[i] != NULL) {
+            munmap(g->page[i], sysconf(_SC_PAGESIZE));
+        }
+        close(g->fd[i]);
+    }
+    if(g->switches >= 0) {
+        close(g->switches);
+    }
+    g->count = 0;
+    g->switches = -1;
+    g->kind = PERF_NONE;
+}
+
+static inline int perf_open_group(struct perf_group* g, enum perf_kind kind, int user_only) {
+    static const uint64_t hardware[] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES
+    };
+    static const uint64_t software[] = {
+        PERF_COUNT_SW_TASK_CLOCK, PERF_COUNT_SW_PAGE_FAULTS
+    };
+    const uint64_t* configs = kind == PERF_HARDWARE ? hardware : software;
+    size_t count = kind == PERF_HARDWARE ? sizeof(hardware)/sizeof(hardware[0])
+                                         : sizeof(software)/sizeof(software[0]);
+    uint32_t type = kind == PERF_HARDWARE ? PERF_TYPE_HARDWARE : PERF_TYPE_SOFTWARE;
+
+    g->kind = kind;
+    g->user_only = user_only;
+    g->count = 0;
+    g->switches = -1;
+    for(size_t i = 0; i < count; ++i) {
+        int fd = perf_open_counter(type, configs[i], i == 0 ? -1 : g->fd[0], user_only);
+        if(fd < 0) {
+            perf_close(g);
+            return fd;
+        }
+        g->fd[g->count] = fd;
+        g->page[g->count] = NULL;
+        ++g->count;
+    }
+    int fd = perf_open_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, -1, user_only);
+    if(fd < 0) {
+        perf_close(g);
+        return fd;
+    }
+    g->switches = fd;
+
+    /* rdpmc needs the first page of every counter and cap_user_rdpmc */
+    g->rdpmc = PERF_RDPMC && kind == PERF_HARDWARE;
+    for(size_t i = 0; i < g->count && g->rdpmc; ++i) {
+        void* page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, g->fd[i], 0);
+        if(page == MAP_FAILED) {
+            g->rdpmc = 0;
+            break;
+        }
+        g->page[i] = page;
+        g->rdpmc = g->page[i]->cap_user_rdpmc;
+    }
+    return 0;
+}
+
+/* hardware if the PMU lets us, software otherwise; kernel side if allowed */
+static inline int perf_open(struct perf_group* g) {
+    int err = 0;
+    for(enum perf_kind kind = PERF_HARDWARE; kind <= PERF_SOFTWARE; ++kind) {
+        for(int user_only = 0; user_only <= 1; ++user_only) {
+            err = perf_open_group(g, kind, user_only);
+            if(err == 0) {
+                return 0;
+            }
+        }
+    }
+    return err;
+}
+
+#if PERF_RDPMC
+/* 0, or -EBUSY if the counter is not on the PMU (multiplexed out) and only the offset is known */
+static inline int perf_rdpmc(const struct perf_event_mmap_page* pc, uint64_t* count, uint64_t* stopped) {
+    uint32_t seq;
+    uint32_t index;
+    do {
+        seq = pc->lock;
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        index = pc->index;
+        *count = pc->offset;
+        /* updated whenever the counter is scheduled in or out */
+        *stopped = pc->time_enabled - pc->time_running;
+        if(index != 0) {
+            /* the counter is live on this cpu: add its current value */
+            uint64_t pmc = __rdpmc(index - 1);
+            uint16_t width = pc->pmc_width;
+            *count += (int64_t)(pmc << (64 - width)) >> (64 - width);
+        }
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    } while(pc->lock != seq);
+    return index != 0 ? 0 : -EBUSY;
+}
+#endif
+
+/* current values of the group, in the order it was opened; 0 or s->err */
+static inline int perf_read(const struct perf_group* g, struct perf_sample* s) {
+    s->err = 0;
+#if PERF_RDPMC
+    if(g->rdpmc) {
+        for(size_t i = 0; i < g->count; ++i) {
+            uint64_t stopped;
+            int err = perf_rdpmc(g->page[i], &s->value[i], &stopped);
+            if(err < 0) {
+                s->err = err;
+            }
+            if(i == 0) {
+                /* the group is scheduled as a whole, the leader's times stand for all */
+                s->stopped = stopped;
+            }
+        }
+        return s->err;
+    }
+#endif
+    /* nr, time enabled, time running, values */
+    uint64_t buf[3 + PERF_COUNTERS_MAX];
+    ssize_t got = read(g->fd[0], buf, sizeof(buf));
+    if(got < (ssize_t)((3 + g->count) * sizeof(uint64_t))) {
+        s->err = got < 0 ? -errno : -EIO;
+        return s->err;
+    }
+    s->stopped = buf[1] - buf[2];
+    memcpy(s->value, buf + 3, g->count * sizeof(*s->value));
+    return 0;
+}
+
+/* one wrapped call, before and after are perf_read() results */
+static inline void perf_account(struct perf_totals* t, const struct perf_group* g,
+                                const struct perf_sample* before, const struct perf_sample* after) {
+    if((before->err < 0 && before->err != -EBUSY) || (after->err < 0 && after->err != -EBUSY)) {
+        ++t->failed;
+        return;
+    }
+    if(before->err == -EBUSY || after->err == -EBUSY || after->stopped != before->stopped) {
+        /* off the PMU for part of the call, the difference would undercount */
+        ++t->multiplexed;
+        return;
+    }
+    ++t->calls;
+    for(size_t i = 0; i < g->count; ++i) {
+        t->sum[i] += after->value[i] - before->value[i];
+    }
+}
+
+/* at the end of a window: context switches of the thread so far */
+static inline void perf_update(struct perf_totals* t, const struct perf_group* g) {
+    t->kind = g->kind;
+    /* nr, time enabled, time running, value */
+    uint64_t buf[4];
+    if(g->switches >= 0 && read(g->switches, buf, sizeof(buf)) == sizeof(buf)) {
+        t->switches = buf[3];
+    }
+}
+
+static inline void perf_totals_add(struct perf_totals* dst, const struct perf_totals* src) {
+    if(src->kind != PERF_NONE) {
+        dst->kind = src->kind;
+    }
+    dst->calls += src->calls;
+    dst->multiplexed += src->multiplexed;
+    dst->failed += src->failed;
+    for(size_t i = 0; i < PERF_COUNTERS_MAX; ++i) {
+        dst->sum[i] += src->sum[i];
+    }
+    dst->switches += src->switches;
+}
+
+static inline const char* perf_describe(const struct perf_group* g) {
+    if(g->kind == PERF_HARDWARE) {
+        return g->rdpmc ? "hardware counters, rdpmc" : "hardware counters, read()";
+    }
+    return "no PMU access, software counters, read()";
+}
+
+/* per call averages of the window between prev and now */
+static inline void perf_print(const char* label, const struct perf_totals* now, const struct perf_totals* prev) {
+    uint64_t calls = now->calls - prev->calls;
+    double sum[PERF_COUNTERS_MAX];
+    for(size_t i = 0; i < PERF_COUNTERS_MAX; ++i) {
+        sum[i] = calls > 0 ? (double)(now->sum[i] - prev->sum[i]) / calls : 0.0;
+    }
+    unsigned long long switches = now->switches - prev->switches;
+    if(now->kind == PERF_HARDWARE) {
+        printf("%s: %llu calls, per call %.0f cycles %.0f instructions %.2f IPC %.1f cache misses, "
+               "context switches: %llu\n",
+               label, (unsigned long long)calls, sum[0], sum[1], sum[0] > 0 ? sum[1] / sum[0] : 0.0, sum[2],
+               switches);
+    } else if(now->kind == PERF_SOFTWARE) {
+        printf("%s: %llu calls, per call %.0f ns task clock %.2f page faults, context switches: %llu\n",
+               label, (unsigned long long)calls, sum[0], sum[1], switches);
+    }
+    uint64_t multiplexed = now->multiplexed - prev->multiplexed;
+    uint64_t failed = now->failed - prev->failed;
+    if(multiplexed > 0 || failed > 0) {
+        printf("%s: %llu calls left out, %llu multiplexed off the PMU, %llu failed reads\n",
+               label, (unsigned long long)(multiplexed + failed), (unsigned long long)multiplexed,
+               (unsigned long long)failed);
+    }
+}
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+/*
+ * Single writer sequence lock.
+ *
+ * The writer never blocks: it bumps the sequence to an odd value, updates
+ * the protected data and bumps it back to even. Readers copy the data and
+ * retry if the sequence was odd or has changed meanwhile.
+ */
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define CPU_RELAX() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define CPU_RELAX() do {} while(0)
+#endif
+
+struct seqlock {
+    _Atomic uint32_t seq;
+};
+
+static inline void seqlock_write_begin(struct seqlock* l) {
+    uint32_t seq = atomic_load_explicit(&l->seq, memory_order_relaxed);
+    atomic_store_explicit(&l->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void seqlock_write_end(struct seqlock* l) {
+    uint32_t seq = atomic_load_explicit(&l->seq, memory_order_relaxed);
+    atomic_store_explicit(&l->seq, seq + 1, memory_order_release);
+}
+
+static inline uint32_t seqlock_read_begin(const struct seqlock* l) {
+    uint32_t seq;
+    while((seq = atomic_load_explicit((_Atomic uint32_t*)&l->seq, memory_order_acquire)) & 1) {
+        CPU_RELAX();
+    }
+    return seq;
+}
+
+/* non-zero if the data read since seqlock_read_begin() may be torn */
+static inline int seqlock_read_retry(const struct seqlock* l, uint32_t seq) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit((_Atomic uint32_t*)&l->seq, memory_order_relaxed) != seq;
+}
+
+#endif
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <error.h>
 #include <string.h>
@@ -6,19 +8,31 @@
 #include <fcntl.h>
 #include <time.h>
 #include <errno.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include <netinet/in.h>
-#include <netinet/tcp.h>
+#include <linux/tcp.h> /* struct tcp_info with tcpi_data_segs_in */
 #include <arpa/inet.h>
 
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
 #include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
 
 #include <linux/net_tstamp.h>
 #include <linux/errqueue.h>
 
+#include "histogram.h"
+#include "seqlock.h"
+#include "trace.h"
+#include "tsc.h"
+#include "metrics.h"
+#include "perf.h"
+
 
 #define ENFORCE(condition, report) \
     do {                                        \
@@ -40,22 +54,796 @@
 
 #define PORT 10000
 
-#define MESSAGE_MAX_SIZE 65507
-#define MAX_EVENTS 32
+#define MESSAGE_MAX_SIZE (16 << 20)
+#define MAX_EVENTS 1024
 
 #define AVG_WINDOW 60
 
+/*
+ * Sends in flight per connection, must be a power of two. A single
+ * connection gets INFLIGHT_MAX, many share it down to INFLIGHT_MIN each.
+ */
+#define INFLIGHT_MAX 65536
+#define INFLIGHT_MIN 256
+#define BURST_MAX 1024
+#define POOL_DEFAULT 64
+
+/* many-connection mode */
+#define CONNECTIONS_MAX 32768
+#define THREADS_MAX 256
+#define REPORT_INTERVAL 1 /* seconds */
+/* errqueue notifications read per recvmmsg() */
+#define ERRQUEUE_BATCH 16
+#define ERRQUEUE_CONTROL 512
+
+/* -l: receive side */
+#define RECEIVE_MAX_SIZE (1 << 20) /* per recvmsg(), several GRO super-packets */
+#define RECEIVE_CONTROL 256
+/* per peer and wakeup, the level-triggered epoll set comes back for the rest */
+#define RECEIVE_READS_MAX 16
+#define LISTEN_BACKLOG 1024
+
+/* -e busy: epoll busy poll, per epoll set since 6.9 */
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPOLL_IOC_TYPE 0x8A
+#define EPIOCSPARAMS _IOW(EPOLL_IOC_TYPE, 0x01, struct epoll_params)
+#endif
+#define BUSY_POLL_USECS 50
+#define BUSY_POLL_BUDGET 8 /* more than NAPI_POLL_WEIGHT needs CAP_NET_ADMIN */
+
+#define CACHE_LINE 64
+#define ALIGN_UP(value, align) (((value) + (align) - 1) / (align) * (align))
+
 static const char* stages[] = {
     "SCM_TSTAMP_SND", "SCM_TSTAMP_SCHED", "SCM_TSTAMP_ACK"
 };
+#define STAGES (sizeof(stages)/sizeof(stages[0]))
+#define STAGES_ALL ((1 << STAGES) - 1)
+
+/* how an event loop waits in epoll_wait() */
+enum poll_mode {
+    POLL_BLOCK,    /* sleep until an event */
+    POLL_BUSY,     /* EPIOCSPARAMS: the kernel busy polls the NAPI queues before sleeping */
+    POLL_SPIN,     /* never sleep, epoll_wait(..., 0) in a loop */
+    POLL_ADAPTIVE, /* spin for the poll time, then sleep */
+    POLL_MODES
+};
+
+static const char* poll_modes[POLL_MODES] = {
+    "block", "busy", "spin", "adaptive"
+};
+
+/* cumulative, reports take differences between windows */
+struct counters {
+    long messages;
+    long windows;
+    uint64_t bytes;
+    uint64_t eagain;
+    uint64_t timestamps;     /* timestamp notifications off the errqueues */
+    uint64_t errqueue_calls; /* recvmmsg(MSG_ERRQUEUE) calls which returned any */
+    uint64_t errqueue_ns;    /* spent draining and processing errqueues */
+    uint64_t inflight;       /* at the end of the window */
+    uint64_t coalesced;
+    uint64_t unmatched;
+    uint64_t completions;    /* MSG_ZEROCOPY */
+    uint64_t copied;         /* completions where the kernel fell back to copying */
+    uint64_t exhausted;      /* ticks skipped for lack of a free buffer */
+    long long cpu_ns;        /* thread cpu time */
+    uint64_t tsc_corrections;
+    int64_t tsc_drift_ns;    /* error found by the last correction */
+    uint64_t polls;          /* epoll_wait() calls */
+    uint64_t empty_polls;    /* ... which returned nothing */
+    uint64_t sleeps;         /* ... which were allowed to block */
+    struct perf_totals perf; /* -C: around send() */
+};
+
+/* [0] - current window, [1] - cumulative */
+struct totals {
+    struct counters n;
+    struct histogram call[2];
+    struct histogram timestampns[STAGES][2];
+    struct histogram timestamping[STAGES][2];
+    struct histogram connection[STAGES][2]; /* spread of per connection window means */
+    struct histogram completion[2];         /* MSG_ZEROCOPY send to completion */
+    struct histogram wakeup[2];             /* SCM_TSTAMP_ACK to reading it off the errqueue */
+};
+
+/* published by a worker at the end of every window, merged by the reporter */
+struct snapshot {
+    struct seqlock lock;
+    struct totals t;
+};
+
+struct stats {
+    struct totals t;
+    long window;
+    struct counters prev;    /* at the start of the current window */
+    struct timespec started; /* CLOCK_MONOTONIC start of the current window */
+    struct snapshot* snapshot; /* multi-threaded mode: publish instead of print */
+    struct trace* trace; /* raw per-completion records, optional */
+    struct tsc clock;    /* stamps of sends, CLOCK_REALTIME unless -K */
+    struct metrics* metrics; /* live segment, optional */
+    struct perf_group perf;  /* -C, kind PERF_NONE otherwise */
+};
+
+/* single send() waiting for its errqueue completions */
+struct inflight {
+    uint32_t last_byte; /* SOF_TIMESTAMPING_OPT_ID key: offset of the last byte */
+    uint32_t seen;      /* mask of reported stages */
+    uint64_t sent;      /* tsc stamp */
+};
+
+/*
+ * Ring of outstanding sends in send order. Keys are monotonic (modulo
+ * 2^32), so a completion is matched with a binary search over [tail, head).
+ */
+struct correlation {
+    struct inflight* ring;
+    uint64_t mask;
+    uint64_t head;
+    uint64_t tail;
+    uint32_t total_sent;
+    uint64_t coalesced; /* stages never reported, e.g. sends merged into one skb */
+    uint64_t unmatched; /* completions without a matching send */
+};
 
-inline long delta_ns(const struct timespec* lhs, const struct timespec* rhs) {
+/* MSG_ZEROCOPY send waiting for its SO_EE_ORIGIN_ZEROCOPY completion */
+struct zerocopy {
+    uint64_t sent; /* tsc stamp */
+    uint32_t buffer;
+};
+
+struct connection {
+    int tcp;
+    struct correlation c;
+    /*
+     * Zerocopy completions are keyed by the per-socket counter of successful
+     * MSG_ZEROCOPY calls; no more than the pool size are outstanding.
+     */
+    uint32_t zc_id;
+    uint32_t zc_mask;
+    struct zerocopy* pending;
+    /* SCM_TIMESTAMPING latency sums of the current window */
+    long long stage_ns[STAGES];
+    uint32_t stage_count[STAGES];
+};
+
+/*
+ * Send buffers, mmap()ed and locked so the payload never faults. A copying
+ * send() is done with the buffer on return, so copy mode just cycles through
+ * them. With MSG_ZEROCOPY the kernel keeps referencing the pages until it
+ * posts a completion, so a buffer goes back to the free list only then.
+ */
+struct pool {
+    char* base;
+    size_t size;  /* of a single buffer, page aligned */
+    size_t count; /* <= INFLIGHT_MAX */
+    int zerocopy;
+    uint32_t* free;
+    size_t free_count;
+    size_t next; /* copy mode: buffer for the next send */
+};
+
+struct options {
+    const char* host;
+    long rate;
+    size_t size;
+    long window;
+    const char* trace;
+    int zerocopy;
+    size_t buffers;
+    size_t connections;
+    size_t threads;
+    int tsc;
+    const char* metrics; /* shared memory segment name */
+    int listen;          /* receive side instead of the sender */
+    enum poll_mode poll;
+    long poll_usecs;     /* busy: kernel busy poll time, adaptive: spin time */
+    int poll_budget;     /* busy: packets per NAPI poll */
+    int perf;            /* hardware counters around the hot syscalls */
+};
+
+/* epoll set waited on by the -e policy */
+struct poller {
+    int epoll;
+    enum poll_mode mode; /* busy falls back to spin without EPIOCSPARAMS */
+    long spin_ns;
+    uint64_t calls;
+    uint64_t empty;
+    uint64_t sleeps;
+};
+
+/* owns an epoll set, a timer, a pool and a shard of the connections */
+struct worker {
+    pthread_t thread;
+    size_t index;
+    const struct options* opts;
+    struct connection** conns;
+    size_t count;
+    struct stats* st;
+    struct pool* pool;
+    struct snapshot* snapshot;
+    const struct tsc* clock; /* calibrated once, each worker corrects its own copy */
+    struct poller poller;
+};
+
+static inline long delta_ns(const struct timespec* lhs, const struct timespec* rhs) {
     return 1000000000*(lhs->tv_sec - rhs->tv_sec) + (lhs->tv_nsec - rhs->tv_nsec);
 }
 
-int main() {
+static long long thread_cpu_ns(void) {
+    struct timespec cpu;
+    ENFORCE_ERRNO(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu), "clock_gettime: cpu");
+    return trace_ns(&cpu);
+}
+
+static inline struct inflight* inflight_at(struct correlation* c, uint64_t idx) {
+    return &c->ring[idx & c->mask];
+}
+
+static void inflight_retire(struct correlation* c, uint64_t until) {
+    for(; c->tail < until; ++c->tail) {
+        uint32_t missing = STAGES_ALL & ~inflight_at(c, c->tail)->seen;
+        c->coalesced += __builtin_popcount(missing);
+    }
+    while(c->tail < c->head && inflight_at(c, c->tail)->seen == STAGES_ALL) {
+        ++c->tail;
+    }
+}
+
+static void inflight_push(struct correlation* c, size_t sent, uint64_t now) {
+    if(c->head - c->tail == c->mask + 1) {
+        inflight_retire(c, c->tail + 1);
+    }
+    c->total_sent += sent;
+    struct inflight* e = inflight_at(c, c->head++);
+    e->last_byte = c->total_sent - 1;
+    e->seen = 0;
+    e->sent = now;
+}
+
+static uint64_t inflight_find(struct correlation* c, uint32_t key) {
+    uint64_t lo = c->tail;
+    uint64_t hi = c->head;
+    while(lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        int32_t diff = (int32_t)(inflight_at(c, mid)->last_byte - key);
+        if(diff == 0) {
+            return mid;
+        }
+        if(diff < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return c->head;
+}
+
+static void totals_reset(struct totals* t) {
+    memset(&t->n, 0, sizeof(t->n));
+    for(size_t w = 0; w < 2; ++w) {
+        hist_reset(&t->call[w]);
+        hist_reset(&t->completion[w]);
+        hist_reset(&t->wakeup[w]);
+        for(size_t s = 0; s < STAGES; ++s) {
+            hist_reset(&t->timestampns[s][w]);
+            hist_reset(&t->timestamping[s][w]);
+            hist_reset(&t->connection[s][w]);
+        }
+    }
+}
+
+/* window histograms into the cumulative ones */
+static void totals_close_window(struct totals* t) {
+    hist_merge(&t->call[1], &t->call[0]);
+    hist_merge(&t->completion[1], &t->completion[0]);
+    hist_merge(&t->wakeup[1], &t->wakeup[0]);
+    for(size_t s = 0; s < STAGES; ++s) {
+        hist_merge(&t->timestampns[s][1], &t->timestampns[s][0]);
+        hist_merge(&t->timestamping[s][1], &t->timestamping[s][0]);
+        hist_merge(&t->connection[s][1], &t->connection[s][0]);
+    }
+}
+
+static void totals_reset_window(struct totals* t) {
+    hist_reset(&t->call[0]);
+    hist_reset(&t->completion[0]);
+    hist_reset(&t->wakeup[0]);
+    for(size_t s = 0; s < STAGES; ++s) {
+        hist_reset(&t->timestampns[s][0]);
+        hist_reset(&t->timestamping[s][0]);
+        hist_reset(&t->connection[s][0]);
+    }
+}
+
+static void print_pair(const char* label, const struct histogram* h) {
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%s window", label);
+    hist_print(buf, &h[0]);
+    snprintf(buf, sizeof(buf), "%s total ", label);
+    hist_print(buf, &h[1]);
+}
+
+/* everything after the caller's "Window ..." or "Threads ..." prefix */
+static void print_totals(const struct totals* t, const struct counters* prev, double elapsed,
+                         size_t connections, int zerocopy, enum poll_mode poll) {
+    const struct counters* n = &t->n;
+    double rate = elapsed > 0 ? (n->bytes - prev->bytes) / elapsed : 0.0;
+    uint64_t timestamps = n->timestamps - prev->timestamps;
+    uint64_t calls = n->errqueue_calls - prev->errqueue_calls;
+    uint64_t errqueue = n->errqueue_ns - prev->errqueue_ns;
+    printf("connections: %zd, inflight: %llu, coalesced: %llu, unmatched: %llu, eagain: %llu, "
+           "throughput: %.1f MB/s (%.3f Gbit/s)\n",
+           connections,
+           (unsigned long long)n->inflight,
+           (unsigned long long)n->coalesced,
+           (unsigned long long)n->unmatched,
+           (unsigned long long)n->eagain,
+           rate / 1e6, rate * 8 / 1e9);
+    printf("  errqueue: %llu timestamps, %.1f per recvmmsg(), %llu ns/timestamp, "
+           "cpu: %.1f%% errqueue of %.1f%% total\n",
+           (unsigned long long)timestamps,
+           calls > 0 ? (double)timestamps / calls : 0.0,
+           (unsigned long long)(timestamps > 0 ? errqueue / timestamps : 0),
+           elapsed > 0 ? 100.0 * errqueue / 1e9 / elapsed : 0.0,
+           elapsed > 0 ? 100.0 * (n->cpu_ns - prev->cpu_ns) / 1e9 / elapsed : 0.0);
+    for(size_t s = 0; s < STAGES; ++s) {
+        char label[64];
+        snprintf(label, sizeof(label), "  %-16s timestampns ", stages[s]);
+        print_pair(label, t->timestampns[s]);
+        snprintf(label, sizeof(label), "  %-16s timestamping", stages[s]);
+        print_pair(label, t->timestamping[s]);
+        if(connections > 1) {
+            snprintf(label, sizeof(label), "  %-16s connections ", stages[s]);
+            print_pair(label, t->connection[s]);
+        }
+    }
+    uint64_t polls = n->polls - prev->polls;
+    printf("  epoll %s: %llu calls, %.1f%% empty, %llu blocking\n", poll_modes[poll],
+           (unsigned long long)polls,
+           polls > 0 ? 100.0 * (n->empty_polls - prev->empty_polls) / polls : 0.0,
+           (unsigned long long)(n->sleeps - prev->sleeps));
+    print_pair("  ACK to errqueue read", t->wakeup);
+    perf_print(zerocopy ? "  perf send(MSG_ZEROCOPY)" : "  perf send()", &n->perf, &prev->perf);
+    if(n->tsc_corrections > 0) {
+        printf("  tsc: %llu corrections, last drift %lld ns\n",
+               (unsigned long long)n->tsc_corrections, (long long)n->tsc_drift_ns);
+    }
+    print_pair(zerocopy ? "  send(MSG_ZEROCOPY)" : "  send()", t->call);
+    if(zerocopy) {
+        printf("  zerocopy: completions %llu, copied %llu, pool exhausted %llu\n",
+               (unsigned long long)n->completions,
+               (unsigned long long)n->copied,
+               (unsigned long long)n->exhausted);
+        print_pair("  completion", t->completion);
+    }
+}
+
+/* -M segment: every struct counters field, then the histograms of struct totals */
+static struct metrics* metrics_create(const char* name) {
+    static const char* names[] = {
+        "messages", "bytes", "eagain", "timestamps", "errqueue_calls", "errqueue_ns", "inflight",
+        "coalesced", "unmatched", "completions", "copied", "exhausted", "cpu_ns",
+        "polls", "empty_polls", "sleeps"
+    };
+    struct metrics* m = malloc(sizeof(*m));
+    ENFORCE_CUSTOM(m != NULL, "unable to allocate metrics\n");
+    int err = metrics_open(m, name, "tcp_timestamping");
+    ENFORCE_CUSTOM(err == 0, "metrics: %s: %s\n", name, strerror(-err));
+    for(size_t c = 0; c < sizeof(names)/sizeof(names[0]); ++c) {
+        ENFORCE_CUSTOM(metrics_add_counter(m, names[c]) >= 0, "metrics: too many counters\n");
+    }
+    for(size_t s = 0; s < STAGES; ++s) {
+        char label[METRICS_NAME_MAX];
+        snprintf(label, sizeof(label), "%s timestampns", stages[s]);
+        metrics_add_histogram(m, label);
+        snprintf(label, sizeof(label), "%s timestamping", stages[s]);
+        metrics_add_histogram(m, label);
+        snprintf(label, sizeof(label), "%s connections", stages[s]);
+        metrics_add_histogram(m, label);
+    }
+    metrics_add_histogram(m, "send()");
+    metrics_add_histogram(m, "completion");
+    /* registration fails for good once full, checking the last one is enough */
+    ENFORCE_CUSTOM(metrics_add_histogram(m, "ACK to errqueue read") >= 0, "metrics: too many histograms\n");
+    return m;
+}
+
+/* same order as metrics_create(), windows already folded into the totals */
+static void metrics_update(struct metrics* m, const struct totals* t) {
+    const struct counters* n = &t->n;
+    int64_t values[] = {
+        n->messages, n->bytes, n->eagain, n->timestamps, n->errqueue_calls, n->errqueue_ns, n->inflight,
+        n->coalesced, n->unmatched, n->completions, n->copied, n->exhausted, n->cpu_ns,
+        n->polls, n->empty_polls, n->sleeps
+    };
+    metrics_begin(m);
+    for(size_t c = 0; c < sizeof(values)/sizeof(values[0]); ++c) {
+        metrics_set(m, c, values[c]);
+    }
+    int h = 0;
+    for(size_t s = 0; s < STAGES; ++s) {
+        metrics_set_histogram(m, h++, &t->timestampns[s][0], &t->timestampns[s][1]);
+        metrics_set_histogram(m, h++, &t->timestamping[s][0], &t->timestamping[s][1]);
+        metrics_set_histogram(m, h++, &t->connection[s][0], &t->connection[s][1]);
+    }
+    metrics_set_histogram(m, h++, &t->call[0], &t->call[1]);
+    metrics_set_histogram(m, h++, &t->completion[0], &t->completion[1]);
+    metrics_set_histogram(m, h++, &t->wakeup[0], &t->wakeup[1]);
+    metrics_end(m);
+}
+
+/*
+ * Ends the window of a worker: folds per connection state into the totals,
+ * then either prints them or publishes them for the reporter.
+ */
+static void report(struct worker* w) {
+    struct stats* st = w->st;
+    struct totals* t = &st->t;
+    t->n.inflight = 0;
+    t->n.coalesced = 0;
+    t->n.unmatched = 0;
+    for(size_t i = 0; i < w->count; ++i) {
+        struct connection* conn = w->conns[i];
+        t->n.inflight += conn->c.head - conn->c.tail;
+        t->n.coalesced += conn->c.coalesced;
+        t->n.unmatched += conn->c.unmatched;
+        for(size_t s = 0; s < STAGES; ++s) {
+            if(conn->stage_count[s] > 0) {
+                hist_record(&t->connection[s][0], conn->stage_ns[s] / conn->stage_count[s]);
+            }
+            conn->stage_ns[s] = 0;
+            conn->stage_count[s] = 0;
+        }
+    }
+    ++t->n.windows;
+    t->n.cpu_ns = thread_cpu_ns();
+    t->n.polls = w->poller.calls;
+    t->n.empty_polls = w->poller.empty;
+    t->n.sleeps = w->poller.sleeps;
+    if(st->perf.kind != PERF_NONE) {
+        perf_update(&t->n.perf, &st->perf);
+    }
+    if(tsc_recalibrate(&st->clock)) {
+        t->n.tsc_corrections = st->clock.corrections;
+        t->n.tsc_drift_ns = st->clock.drift_ns;
+    }
+    totals_close_window(t);
+
+    if(st->snapshot != NULL) {
+        struct snapshot* s = st->snapshot;
+        seqlock_write_begin(&s->lock);
+        memcpy(&s->t, t, sizeof(s->t));
+        seqlock_write_end(&s->lock);
+    } else {
+        if(st->metrics != NULL) {
+            metrics_update(st->metrics, t);
+        }
+        struct timespec now;
+        ENFORCE_ERRNO(clock_gettime(CLOCK_MONOTONIC, &now), "clock_gettime: report");
+        printf("Window %ld (%ld total) - ", st->window, t->n.messages);
+        print_totals(t, &st->prev, delta_ns(&now, &st->started) / 1e9, w->count, w->pool->zerocopy,
+                     w->poller.mode);
+        st->started = now;
+        st->prev = t->n;
+    }
+    totals_reset_window(t);
+}
+
+static void pool_create(struct pool* p, size_t size, size_t count, int zerocopy) {
+    const char hello[] = "hello\n";
+    long page = sysconf(_SC_PAGESIZE);
+    ENFORCE_ERRNO(page, "sysconf: _SC_PAGESIZE");
+    p->size = (size + page - 1) / page * page;
+    p->count = count;
+    p->zerocopy = zerocopy;
+    p->base = mmap(NULL, p->size * count, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    ENFORCE_CUSTOM(p->base != MAP_FAILED, "mmap: %zd send buffers of %zd bytes\n", count, p->size);
+    if(mlock(p->base, p->size * count) < 0) {
+        /* still usable, only page faults are back in the measurement */
+        perror("mlock: send buffers (check RLIMIT_MEMLOCK)");
+    }
+    p->free = malloc(count * sizeof(*p->free));
+    ENFORCE_CUSTOM(p->free != NULL, "unable to allocate pool\n");
+    for(size_t b = 0; b < count; ++b) {
+        char* buffer = p->base + b * p->size;
+        for(size_t i = 0; i < size; ++i) {
+            buffer[i] = hello[i % strlen(hello)];
+        }
+        p->free[b] = count - 1 - b;
+    }
+    p->free_count = count;
+}
+
+static void pool_destroy(struct pool* p) {
+    free(p->free);
+    ENFORCE_ERRNO(munmap(p->base, p->size * p->count), "munmap: send buffers");
+}
+
+/* completions [lo, hi] of the zerocopy counter, the kernel merges adjacent ones */
+static void pool_complete(struct pool* p, struct stats* st, struct connection* conn,
+                          uint32_t lo, uint32_t hi, int copied, uint64_t now) {
+    for(uint32_t id = lo; ; ++id) {
+        ENFORCE_CUSTOM((uint32_t)(conn->zc_id - id) - 1 < p->count,
+                       "Unexpected zerocopy completion: %u next: %u\n", id, conn->zc_id);
+        struct zerocopy* z = &conn->pending[id & conn->zc_mask];
+        hist_record(&st->t.completion[0], tsc_delta_ns(&st->clock, now, z->sent));
+        p->free[p->free_count++] = z->buffer;
+        ++st->t.n.completions;
+        st->t.n.copied += copied;
+        if(id == hi) {
+            break;
+        }
+    }
+}
+
+static void send_message(struct worker* w, struct connection* conn, size_t size) {
+    struct stats* st = w->st;
+    struct pool* p = w->pool;
+    uint32_t buffer;
+    if(p->zerocopy) {
+        if(p->free_count == 0) {
+            /* every buffer is still referenced by the kernel, skip this tick */
+            ++st->t.n.exhausted;
+            return;
+        }
+        buffer = p->free[--p->free_count];
+    } else {
+        buffer = p->next;
+        p->next = (p->next + 1) % p->count;
+    }
+    const char* message = p->base + buffer * p->size;
+
+    int perf = st->perf.kind != PERF_NONE;
+    struct perf_sample before;
+    struct perf_sample after;
+    if(perf) {
+        perf_read(&st->perf, &before);
+    }
+    uint64_t now = tsc_read(&st->clock);
+    ssize_t sent = send(conn->tcp, message, size, MSG_DONTWAIT | (p->zerocopy ? MSG_ZEROCOPY : 0));
+    uint64_t done = tsc_read(&st->clock);
+    if(perf) {
+        perf_read(&st->perf, &after);
+        perf_account(&st->t.n.perf, &st->perf, &before, &after);
+    }
+    /* printf("NOW                : %ld sent: %ld ns counter: %u\n", */
+    /*        tsc_ns(&st->clock, now), tsc_delta_ns(&st->clock, done, now), counter); */
+
+    if(sent < 0 && (errno == EAGAIN || errno == ENOBUFS)) {
+        /* socket buffer is full (or optmem for zerocopy), skip this tick */
+        ++st->t.n.eagain;
+        if(p->zerocopy) {
+            p->free[p->free_count++] = buffer;
+        }
+        return;
+    }
+    ENFORCE_ERRNO(sent, "send: tcp");
+    ENFORCE_CUSTOM(sent > 0, "Unable send %zd bytes\n", size);
+    hist_record(&st->t.call[0], tsc_delta_ns(&st->clock, done, now));
+    inflight_push(&conn->c, sent, now);
+    if(p->zerocopy) {
+        struct zerocopy* z = &conn->pending[conn->zc_id++ & conn->zc_mask];
+        z->sent = now;
+        z->buffer = buffer;
+    }
+    st->t.n.bytes += sent;
+
+    ++st->t.n.messages;
+    if((st->t.n.messages % st->window) == 0) {
+        report(w);
+    }
+}
+
+static void process_notification(struct worker* w, struct connection* conn, struct msghdr* aux, uint64_t now) {
+    struct stats* st = w->st;
+    struct correlation* c = &conn->c;
+    ENFORCE_CUSTOM((aux->msg_flags & MSG_CTRUNC) == 0, "cmsg truncated\n");
+
+    size_t stage = 0;
+    uint32_t message_id = 0;
+    int have_id = 0;
+    struct sock_extended_err err;
+    struct timespec timestampns = {0, 0};
+    struct scm_timestamping timestamping;
+    memset(&timestamping, 0, sizeof(timestamping));
+
+    for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(aux);
+        cmsg != NULL;
+        cmsg = CMSG_NXTHDR(aux, cmsg)) {
+        /* printf("cmsg: level %d type %d\n", */
+        /*        cmsg->cmsg_level, */
+        /*        cmsg->cmsg_type); */
+        switch(cmsg->cmsg_type) {
+            case SCM_TIMESTAMPNS:
+                timestampns = *(struct timespec*)CMSG_DATA(cmsg);
+                break;
+            case SCM_TIMESTAMPING:
+                timestamping = *(struct scm_timestamping*)CMSG_DATA(cmsg);
+                break;
+            case IP_RECVERR:
+                ENFORCE_CUSTOM(cmsg->cmsg_level == SOL_IP,
+                               "Unexpected level: %d wants: %d\n", cmsg->cmsg_level, SOL_IP);
+                memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+                have_id = 1;
+                break;
+            default:
+                ENFORCE_CUSTOM(0, "unexpected control message type: %d\n", cmsg->cmsg_type);
+        }
+    }
+    ENFORCE_CUSTOM(have_id, "errqueue message without IP_RECVERR\n");
+
+    if(err.ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+        ENFORCE_CUSTOM(w->pool->zerocopy && err.ee_errno == 0,
+                       "Unexpected zerocopy completion, errno: %d\n", err.ee_errno);
+        pool_complete(w->pool, st, conn, err.ee_info, err.ee_data,
+                      (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0, tsc_read(&st->clock));
+        return;
+    }
+    ENFORCE_CUSTOM(err.ee_errno == ENOMSG,
+                   "Unexpected errno: %d wants: %d\n", err.ee_errno, ENOMSG);
+    ENFORCE_CUSTOM(err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING,
+                   "Unexpected origin: %d wants: %d\n", err.ee_origin, SO_EE_ORIGIN_TIMESTAMPING);
+    message_id = err.ee_data;
+    stage = err.ee_info;
+    ENFORCE_CUSTOM(stage < STAGES, "Unexpected stage: %zd\n", stage);
+    /* printf("Stage: %s\n", stages[stage]); */
+    ++st->t.n.timestamps;
+    if(stage == SCM_TSTAMP_ACK && (timestamping.ts[0].tv_sec != 0 || timestamping.ts[0].tv_nsec != 0)) {
+        /* the ACK comes in from softirq, this is what the wait policy adds */
+        hist_record(&st->t.wakeup[0], tsc_ns(&st->clock, now) - trace_ns(&timestamping.ts[0]));
+    }
+
+    uint64_t idx = inflight_find(c, message_id);
+    if(idx == c->head) {
+        ++c->unmatched;
+        return;
+    }
+    struct inflight* e = inflight_at(c, idx);
+    int64_t sent_ns = tsc_ns(&st->clock, e->sent);
+    if(timestampns.tv_sec != 0 || timestampns.tv_nsec != 0) {
+        hist_record(&st->t.timestampns[stage][0], trace_ns(&timestampns) - sent_ns);
+    }
+    if(timestamping.ts[0].tv_sec != 0 || timestamping.ts[0].tv_nsec != 0) {
+        long latency = trace_ns(&timestamping.ts[0]) - sent_ns;
+        hist_record(&st->t.timestamping[stage][0], latency);
+        conn->stage_ns[stage] += latency;
+        ++conn->stage_count[stage];
+    }
+    if(st->trace != NULL) {
+        struct trace_record* r = trace_next(st->trace);
+        r->id = message_id;
+        r->stage = stage;
+        r->user_ns = sent_ns;
+        r->timestampns_ns = trace_ns(&timestampns);
+        for(size_t i = 0; i < 3; ++i) {
+            r->timestamping_ns[i] = trace_ns(&timestamping.ts[i]);
+        }
+        trace_commit(st->trace);
+    }
+    e->seen |= 1 << stage;
+    /* ACK is cumulative: anything sent before has nothing more to report */
+    inflight_retire(c, stage == SCM_TSTAMP_ACK ? idx : c->tail);
+}
+
+/* drains the errqueue, up to ERRQUEUE_BATCH notifications per recvmmsg() */
+static void process_errqueue(struct worker* w, struct connection* conn) {
+    struct mmsghdr msgs[ERRQUEUE_BATCH];
+    char control[ERRQUEUE_BATCH][ERRQUEUE_CONTROL];
+
+    struct timespec start;
+    ENFORCE_ERRNO(clock_gettime(CLOCK_MONOTONIC, &start), "clock_gettime: errqueue");
+    while(1) {
+        memset(msgs, 0, sizeof(msgs));
+        for(size_t i = 0; i < ERRQUEUE_BATCH; ++i) {
+            msgs[i].msg_hdr.msg_control = control[i];
+            msgs[i].msg_hdr.msg_controllen = ERRQUEUE_CONTROL;
+        }
+
+        int read = recvmmsg(conn->tcp, msgs, ERRQUEUE_BATCH, MSG_ERRQUEUE | MSG_DONTWAIT, NULL);
+        if(read < 0 && errno == EAGAIN) {
+            break;
+        }
+        ENFORCE_ERRNO(read, "recvmmsg: tcp");
+        ++w->st->t.n.errqueue_calls;
+        uint64_t now = tsc_read(&w->st->clock);
+        for(int i = 0; i < read; ++i) {
+            process_notification(w, conn, &msgs[i].msg_hdr, now);
+        }
+        if(read < ERRQUEUE_BATCH) {
+            break;
+        }
+    }
+    struct timespec done;
+    ENFORCE_ERRNO(clock_gettime(CLOCK_MONOTONIC, &done), "clock_gettime: errqueue");
+    w->st->t.n.errqueue_ns += delta_ns(&done, &start);
+}
+
+/* -e busy needs EPIOCSPARAMS, spins in user space on kernels without it */
+static void poller_init(struct poller* p, int epoll, const struct options* opts, int verbose) {
+    p->epoll = epoll;
+    p->mode = opts->poll;
+    p->spin_ns = opts->poll_usecs * 1000;
+    p->calls = 0;
+    p->empty = 0;
+    p->sleeps = 0;
+    if(p->mode != POLL_BUSY) {
+        return;
+    }
+    struct epoll_params params;
+    memset(&params, 0, sizeof(params));
+    params.busy_poll_usecs = opts->poll_usecs;
+    params.busy_poll_budget = opts->poll_budget;
+    params.prefer_busy_poll = ENABLE;
+    if(ioctl(epoll, EPIOCSPARAMS, &params) < 0) {
+        ENFORCE_CUSTOM(errno == ENOTTY, "ioctl: EPIOCSPARAMS: %s\n", strerror(errno));
+        if(verbose) {
+            printf("EPIOCSPARAMS not supported, spinning on epoll_wait(..., 0) instead\n");
+        }
+        p->mode = POLL_SPIN;
+    }
+}
+
+static int poller_wait(struct poller* p, struct epoll_event* events, int max) {
+    int fds;
+    if(p->mode == POLL_SPIN || p->mode == POLL_ADAPTIVE) {
+        struct timespec start;
+        struct timespec now;
+        ENFORCE_ERRNO(clock_gettime(CLOCK_MONOTONIC, &start), "clock_gettime: poll");
+        while(1) {
+            fds = epoll_wait(p->epoll, events, max, 0);
+            ++p->calls;
+            if(fds != 0) {
+                break;
+            }
+            ++p->empty;
+            if(p->mode == POLL_ADAPTIVE) {
+                ENFORCE_ERRNO(clock_gettime(CLOCK_MONOTONIC, &now), "clock_gettime: poll");
+                if(delta_ns(&now, &start) >= p->spin_ns) {
+                    break;
+                }
+            }
+        }
+        if(fds != 0) {
+            ENFORCE_ERRNO(fds, "epoll_wait");
+            return fds;
+        }
+    }
+    /* block and busy; adaptive once it spun long enough */
+    fds = epoll_wait(p->epoll, events, max, -1);
+    ++p->calls;
+    ++p->sleeps;
+    ENFORCE_ERRNO(fds, "epoll_wait");
+    return fds;
+}
+
+static struct connection* open_connection(const struct options* opts, size_t inflight) {
+    struct connection* conn = calloc(1, sizeof(*conn));
+    ENFORCE_CUSTOM(conn != NULL, "unable to allocate connection\n");
+    conn->c.ring = calloc(inflight, sizeof(*conn->c.ring));
+    ENFORCE_CUSTOM(conn->c.ring != NULL, "unable to allocate inflight ring\n");
+    conn->c.mask = inflight - 1;
+    if(opts->zerocopy) {
+        size_t pending = 1;
+        while(pending < opts->buffers) {
+            pending <<= 1;
+        }
+        conn->pending = calloc(pending, sizeof(*conn->pending));
+        ENFORCE_CUSTOM(conn->pending != NULL, "unable to allocate zerocopy ring\n");
+        conn->zc_mask = pending - 1;
+    }
+
     int tcp = socket(AF_INET, SOCK_STREAM, 0);
     ENFORCE_ERRNO(tcp, "socket: tcp");
+    conn->tcp = tcp;
     uint32_t flags;
 
     flags = ENABLE;
@@ -66,10 +854,17 @@ int main() {
     ENFORCE_ERRNO(setsockopt(tcp, IPPROTO_TCP, TCP_NODELAY, &flags, sizeof(flags)),
                   "setsockopt: TCP_NODELAY");
 
+    if(opts->zerocopy) {
+        flags = ENABLE;
+        ENFORCE_ERRNO(setsockopt(tcp, SOL_SOCKET, SO_ZEROCOPY, &flags, sizeof(flags)),
+                      "setsockopt: SO_ZEROCOPY");
+    }
+
     struct sockaddr_in remote;
     remote.sin_family = AF_INET;
     remote.sin_port = htons(PORT);
-    remote.sin_addr.s_addr = INADDR_ANY;
+    ENFORCE_CUSTOM(inet_pton(AF_INET, opts->host, &remote.sin_addr) == 1,
+                   "invalid address: %s\n", opts->host);
     ENFORCE_ERRNO(connect(tcp, (struct sockaddr*)&remote, sizeof(remote)), "connect: tcp");
 
     flags = ENABLE;
@@ -98,157 +893,817 @@ int main() {
             ;
     ENFORCE_ERRNO(setsockopt(tcp, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)),
                   "setsockopt: SO_TIMESTAMPING");
+    return conn;
+}
 
+static void close_connection(struct connection* conn) {
+    ENFORCE_ERRNO(close(conn->tcp), "close: tcp");
+    free(conn->pending);
+    free(conn->c.ring);
+    free(conn);
+}
+
+/* every tick sends on all connections of the worker, completions come via epoll */
+static void run(struct worker* w) {
+    const struct options* opts = w->opts;
     int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
     ENFORCE_ERRNO(timer, "timerfd_create");
 
     struct itimerspec interval;
-    interval.it_value.tv_sec = 1;
-    interval.it_value.tv_nsec = 0;
-    interval.it_interval.tv_sec = 0;
-    interval.it_interval.tv_nsec = 0;
+    interval.it_value.tv_sec = 0;
+    interval.it_value.tv_nsec = 1;
+    interval.it_interval.tv_sec = 1 / opts->rate;
+    interval.it_interval.tv_nsec = 1000000000 / opts->rate % 1000000000;
 
     int epoll = epoll_create1(EPOLL_CLOEXEC);
     ENFORCE_ERRNO(epoll, "epoll: create");
 
     struct epoll_event ev;
-    ev.events = EPOLLIN | EPOLLERR;
-    ev.data.fd = tcp;
-    ENFORCE_ERRNO(epoll_ctl(epoll, EPOLL_CTL_ADD, tcp, &ev), "epoll_ctrl: tcp");
+    for(size_t i = 0; i < w->count; ++i) {
+        ev.events = EPOLLIN | EPOLLERR;
+        ev.data.ptr = w->conns[i];
+        ENFORCE_ERRNO(epoll_ctl(epoll, EPOLL_CTL_ADD, w->conns[i]->tcp, &ev), "epoll_ctrl: tcp");
+    }
 
     ev.events = EPOLLIN;
-    ev.data.fd = timer;
+    ev.data.ptr = NULL;
     ENFORCE_ERRNO(epoll_ctl(epoll, EPOLL_CTL_ADD, timer, &ev), "epoll_ctrl: timer");
+    poller_init(&w->poller, epoll, opts, w->index == 0);
 
-    long counter = 0;
-    uint32_t total_sent = 0;
-    long long call[AVG_WINDOW];
-    long long timestampns[sizeof(stages)/sizeof(stages[0])][AVG_WINDOW];
-    long long timestamping[sizeof(stages)/sizeof(stages[0])][AVG_WINDOW];
-    struct epoll_event events[MAX_EVENTS];
-    printf("Sending data...\n");
+    /* catch up on missed ticks, but never flood the sockets */
+    uint64_t burst_max = w->count > 0 && w->count < BURST_MAX ? BURST_MAX / w->count : 1;
 
+    struct epoll_event* events = calloc(MAX_EVENTS, sizeof(*events));
+    ENFORCE_CUSTOM(events != NULL, "unable to allocate events\n");
+    ENFORCE_ERRNO(timerfd_settime(timer, 0, &interval, NULL), "timerfd_settime");
     while(1) {
-        const char hello[] = "hello\n";
-        struct timespec now;
-        ENFORCE_ERRNO(clock_gettime(CLOCK_REALTIME, &now), "clock_gettime: now");
-        size_t sent = send(tcp, hello, strlen(hello), MSG_DONTWAIT);
-        total_sent += sent;
-        struct timespec done;
-        ENFORCE_ERRNO(clock_gettime(CLOCK_REALTIME, &done), "clock_gettime: done");
-        call[counter % AVG_WINDOW] = delta_ns(&done, &now);
-        /* printf("NOW                : %ld.%09ld sent: %ld ns counter: %u\n", */
-        /*        now.tv_sec, now.tv_nsec, delta_ns(&done, &now), counter); */
-
-        ENFORCE_CUSTOM(sent == strlen(hello),
-                       "Unable send %zd bytes\n", strlen(hello));
-
-        ENFORCE_ERRNO(timerfd_settime(timer, 0, &interval, NULL), "timerfd_settime");
-
-        int wait = 1;
-        while(wait) {
-            int fds = epoll_wait(epoll, events, MAX_EVENTS, -1);
-            ENFORCE_ERRNO(fds, "epoll_wait");
-            for(int i = 0; i < fds; ++i) {
-                if(events[i].data.fd == tcp) {
-                    if((events[i].events & EPOLLERR) != 0) {
-                        char control[65535];
-                        struct msghdr aux;
-                        aux.msg_name = NULL;
-                        aux.msg_namelen = 0;
-                        aux.msg_iov = NULL;
-                        aux.msg_iovlen = 0;
-                        aux.msg_control = control;
-                        aux.msg_controllen = sizeof(control);
-
-                        ENFORCE_ERRNO(recvmsg(tcp, &aux, MSG_ERRQUEUE), "recvmsg: tcp");
-
-                        size_t stage = 0;
-                        long timestampns_delta = 0;
-                        long timestamping_delta = 0;
-
-                        for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&aux);
-                            cmsg != NULL;
-                            cmsg = CMSG_NXTHDR(&aux, cmsg)) {
-                            /* printf("cmsg: level %d type %d\n", */
-                            /*        cmsg->cmsg_level, */
-                            /*        cmsg->cmsg_type); */
-                            struct scm_timestamping* data;
-                            struct timespec* pts;
-                            struct sock_extended_err* err;
-                            switch(cmsg->cmsg_type) {
-                                case SCM_TIMESTAMPNS:
-                                    pts = (struct timespec*)CMSG_DATA(cmsg);
-                                    timestampns_delta = delta_ns(pts, &now);
-                                    /* printf("SCM_TIMESTAMS      : %ld.%09ld latency: %ld ns\n", */
-                                    /*        pts->tv_sec, pts->tv_nsec, delta_ns(pts, &now)); */
-                                    //timestampns[counter % AVG_WINDOW] = delta_ns(&now, pts);
-                                    break;
-                                case SCM_TIMESTAMPING:
-                                    data = (struct scm_timestamping*)CMSG_DATA(cmsg);
-                                    timestamping_delta = delta_ns(&data->ts[0], &now);
-                                    /* for(size_t idx = 0; idx < 2; ++idx) { */
-                                    /*     if(data->ts[idx].tv_sec == 0 && */
-                                    /*        data->ts[idx].tv_nsec == 0) { */
-                                    /*         continue; */
-                                    /*     } */
-                                    /*     //timestamping[counter % AVG_WINDOW] = delta_ns(&now, &data->ts[0]); */
-                                    /*     printf("SCM_TIMESTAMPING[%zd]: %ld.%09ld latency: %ld ns\n", */
-                                    /*            idx, data->ts[idx].tv_sec, data->ts[idx].tv_nsec, */
-                                    /*            delta_ns(&data->ts[idx], &now)); */
-                                    /*     } */
-                                    break;
-                                case IP_RECVERR:
-                                    ENFORCE_CUSTOM(cmsg->cmsg_level == SOL_IP,
-                                                   "Unexpected level: %d wants: %d\n", cmsg->cmsg_level, SOL_IP);
-                                    err = (struct sock_extended_err*)CMSG_DATA(cmsg);
-                                    ENFORCE_CUSTOM(err->ee_errno == ENOMSG,
-                                                   "Unexpected errno: %d wants: %d\n", err->ee_errno, ENOMSG);
-                                    ENFORCE_CUSTOM(err->ee_origin == SO_EE_ORIGIN_TIMESTAMPING,
-                                                   "Unexpected origin: %d wants: %d\n", err->ee_origin, SO_EE_ORIGIN_TIMESTAMPING);
-                                    uint32_t message_id = err->ee_data;
-                                    ENFORCE_CUSTOM(total_sent - 1 == message_id,
-                                                   "Unexpected message_id: %u wants: %u\n", message_id, total_sent);
-                                    stage = err->ee_info;
-                                    /* printf("Stage: %s\n", stages[stage]); */
-                                    break;
-                                default:
-                                    ENFORCE_CUSTOM(0, "unexpected control message type: %d\n", cmsg->cmsg_type);
-                            }
-                        }
-                        timestampns[stage][counter % AVG_WINDOW] = timestampns_delta;
-                        timestamping[stage][counter % AVG_WINDOW] = timestamping_delta;
-                    }
+        int fds = poller_wait(&w->poller, events, MAX_EVENTS);
+        for(int i = 0; i < fds; ++i) {
+            struct connection* conn = events[i].data.ptr;
+            if(conn != NULL) {
+                if((events[i].events & EPOLLERR) != 0) {
+                    process_errqueue(w, conn);
+                }
+                continue;
+            }
+            if((events[i].events & EPOLLIN) != 0) {
+                uint64_t exp = 0;
+                ENFORCE_CUSTOM(read(timer, &exp, sizeof(exp)) == sizeof(exp), "read: timer");
+                if(exp > burst_max) {
+                    exp = burst_max;
                 }
-                if(events[i].data.fd == timer) {
-                    if((events[i].events & EPOLLIN) != 0) {
-                        uint64_t exp = 0;
-                        ENFORCE_CUSTOM(read(timer, &exp, sizeof(exp)) == sizeof(exp) && exp == 1, "read: timer");
-                        wait = 0;
+                for(uint64_t k = 0; k < exp; ++k) {
+                    for(size_t c = 0; c < w->count; ++c) {
+                        send_message(w, w->conns[c], opts->size);
                     }
                 }
             }
         }
-        ++counter;
-        if((counter % AVG_WINDOW) == 0) {
-            for(size_t s = 0; s < sizeof(stages)/sizeof(stages[0]); ++s) {
-                long long avg_timestampns = 0;
-                long long avg_timestamping = 0;
-                for(size_t i = 0; i < AVG_WINDOW; ++i) {
-                    avg_timestampns += timestampns[s][i];
-                    avg_timestamping += timestamping[s][i];
+    }
+    free(events);
+    ENFORCE_ERRNO(close(timer), "close: timer");
+    ENFORCE_ERRNO(close(epoll), "close: epoll");
+}
+
+static void worker_create(struct worker* w) {
+    const struct options* opts = w->opts;
+    w->st = calloc(1, sizeof(*w->st));
+    w->pool = calloc(1, sizeof(*w->pool));
+    ENFORCE_CUSTOM(w->st != NULL && w->pool != NULL, "unable to allocate stats\n");
+    w->st->window = opts->window;
+    w->st->snapshot = w->snapshot;
+    w->st->clock = *w->clock;
+    totals_reset(&w->st->t);
+    pool_create(w->pool, opts->size, opts->buffers, opts->zerocopy);
+    if(opts->trace != NULL) {
+        char path[4096];
+        if(opts->threads > 0) {
+            snprintf(path, sizeof(path), "%s.%zd", opts->trace, w->index);
+        } else {
+            snprintf(path, sizeof(path), "%s", opts->trace);
+        }
+        w->st->trace = malloc(sizeof(*w->st->trace));
+        ENFORCE_CUSTOM(w->st->trace != NULL, "unable to allocate trace\n");
+        int err = trace_open(w->st->trace, path, TRACE_RECORDS, TRACE_TCP_TX);
+        ENFORCE_CUSTOM(err == 0, "trace: %s: %s\n", path, strerror(-err));
+    }
+    if(opts->perf) {
+        /* counts the calling thread, so only once on the worker */
+        int err = perf_open(&w->st->perf);
+        ENFORCE_CUSTOM(err == 0, "perf_event_open: %s\n", strerror(-err));
+        if(w->index == 0) {
+            printf("perf: %s%s\n", perf_describe(&w->st->perf),
+                   w->st->perf.user_only ? ", user space only" : "");
+        }
+        perf_update(&w->st->t.n.perf, &w->st->perf);
+    }
+    ENFORCE_ERRNO(clock_gettime(CLOCK_MONOTONIC, &w->st->started), "clock_gettime: started");
+    w->st->prev = w->st->t.n;
+    w->st->prev.cpu_ns = thread_cpu_ns();
+}
+
+static void worker_destroy(struct worker* w) {
+    if(w->st->perf.kind != PERF_NONE) {
+        perf_close(&w->st->perf);
+    }
+    if(w->st->trace != NULL) {
+        trace_close(w->st->trace);
+        free(w->st->trace);
+    }
+    pool_destroy(w->pool);
+    free(w->pool);
+    free(w->st);
+}
+
+static void* worker_main(void* arg) {
+    struct worker* w = arg;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    ENFORCE_ERRNO(cpus, "sysconf: _SC_NPROCESSORS_ONLN");
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w->index % cpus, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    ENFORCE_CUSTOM(err == 0, "pthread_setaffinity_np: %s\n", strerror(err));
+
+    /* pool, stats and trace are created on the pinned cpu */
+    worker_create(w);
+    run(w);
+    worker_destroy(w);
+    return NULL;
+}
+
+static void snapshot_read(const struct snapshot* s, struct totals* copy) {
+    uint32_t seq;
+    do {
+        seq = seqlock_read_begin(&s->lock);
+        memcpy(copy, &s->t, sizeof(*copy));
+    } while(seqlock_read_retry(&s->lock, seq));
+}
+
+static void counters_add(struct counters* dst, const struct counters* src) {
+    dst->messages += src->messages;
+    dst->bytes += src->bytes;
+    dst->eagain += src->eagain;
+    dst->timestamps += src->timestamps;
+    dst->errqueue_calls += src->errqueue_calls;
+    dst->errqueue_ns += src->errqueue_ns;
+    dst->inflight += src->inflight;
+    dst->coalesced += src->coalesced;
+    dst->unmatched += src->unmatched;
+    dst->completions += src->completions;
+    dst->copied += src->copied;
+    dst->exhausted += src->exhausted;
+    dst->cpu_ns += src->cpu_ns;
+    dst->tsc_corrections += src->tsc_corrections;
+    dst->polls += src->polls;
+    dst->empty_polls += src->empty_polls;
+    dst->sleeps += src->sleeps;
+    perf_totals_add(&dst->perf, &src->perf);
+    if(llabs(src->tsc_drift_ns) > llabs(dst->tsc_drift_ns)) {
+        dst->tsc_drift_ns = src->tsc_drift_ns;
+    }
+}
+
+/* merges per-thread snapshots without ever blocking the workers */
+static void report_workers(struct worker* workers, const struct options* opts, struct metrics* m) {
+    struct totals* copy = malloc(sizeof(*copy));
+    struct totals* merged = malloc(sizeof(*merged));
+    long* windows = calloc(opts->threads, sizeof(*windows));
+    ENFORCE_CUSTOM(copy && merged && windows, "unable to allocate reporter\n");
+
+    struct counters prev;
+    memset(&prev, 0, sizeof(prev));
+    struct timespec started;
+    ENFORCE_ERRNO(clock_gettime(CLOCK_MONOTONIC, &started), "clock_gettime: report");
+    while(1) {
+        sleep(REPORT_INTERVAL);
+        struct timespec now;
+        ENFORCE_ERRNO(clock_gettime(CLOCK_MONOTONIC, &now), "clock_gettime: report");
+
+        totals_reset(merged);
+        for(size_t t = 0; t < opts->threads; ++t) {
+            snapshot_read(workers[t].snapshot, copy);
+            counters_add(&merged->n, &copy->n);
+            /* a window counts once, until the worker publishes the next one */
+            size_t first = copy->n.windows != windows[t] ? 0 : 1;
+            windows[t] = copy->n.windows;
+            for(size_t w = first; w < 2; ++w) {
+                hist_merge(&merged->call[w], &copy->call[w]);
+                hist_merge(&merged->completion[w], &copy->completion[w]);
+                hist_merge(&merged->wakeup[w], &copy->wakeup[w]);
+                for(size_t s = 0; s < STAGES; ++s) {
+                    hist_merge(&merged->timestampns[s][w], &copy->timestampns[s][w]);
+                    hist_merge(&merged->timestamping[s][w], &copy->timestamping[s][w]);
+                    hist_merge(&merged->connection[s][w], &copy->connection[s][w]);
                 }
-                printf("Avg %s over %d - timestampns: %llu ns, timestamping: %llu ns\n",
-                       stages[s], AVG_WINDOW, avg_timestampns / AVG_WINDOW, avg_timestamping / AVG_WINDOW);
             }
-            long long avg_done = 0;
-            for(size_t i = 0; i < AVG_WINDOW; ++i) {
-                avg_done += call[i];
+        }
+
+        if(m != NULL) {
+            metrics_update(m, merged);
+        }
+        printf("Threads %zd (%ld total, published per %ld messages) - ",
+               opts->threads, merged->n.messages, opts->window);
+        /* workers only ever fall back from busy to spin, the first one tells */
+        print_totals(merged, &prev, delta_ns(&now, &started) / 1e9, opts->connections, opts->zerocopy,
+                     workers[0].poller.mode);
+        fflush(stdout);
+        prev = merged->n;
+        started = now;
+    }
+
+    free(windows);
+    free(merged);
+    free(copy);
+}
+
+/* every connection is an fd, make sure there are enough of them */
+static void raise_nofile(size_t needed) {
+    struct rlimit limit;
+    ENFORCE_ERRNO(getrlimit(RLIMIT_NOFILE, &limit), "getrlimit: RLIMIT_NOFILE");
+    if(limit.rlim_cur >= needed) {
+        return;
+    }
+    ENFORCE_CUSTOM(limit.rlim_max >= needed, "RLIMIT_NOFILE hard limit %llu, needs %zd\n",
+                   (unsigned long long)limit.rlim_max, needed);
+    limit.rlim_cur = needed;
+    ENFORCE_ERRNO(setrlimit(RLIMIT_NOFILE, &limit), "setrlimit: RLIMIT_NOFILE");
+}
+
+/* accepted connection of the receive side */
+struct peer {
+    int tcp;
+    size_t index;     /* in receiver.peers */
+    uint32_t segs_in; /* tcpi_data_segs_in at the start of the window */
+};
+
+/* cumulative, reports take differences between windows */
+struct rx_counters {
+    uint64_t accepted;
+    uint64_t reads;
+    uint64_t bytes;
+    uint64_t timestamps;    /* reads which carried SCM_TIMESTAMPING */
+    uint64_t untimestamped;
+    uint64_t partial;       /* reads TCP_INQ says left data queued */
+    uint64_t eagain;        /* reads which found nothing */
+    uint64_t segments;      /* data segments on the wire, before GRO */
+    long long cpu_ns;
+    uint64_t polls;         /* epoll_wait() calls */
+    uint64_t empty_polls;
+    uint64_t sleeps;
+    struct perf_totals perf; /* -C: around recvmsg() */
+};
+
+/*
+ * TCP hands out one timestamp per recvmsg(), that of the last skb it
+ * copied from. With GRO an skb is already several segments, and a large
+ * read drains several skbs, so one timestamp stands for many sends: bytes
+ * and wire segments per timestamp show how much.
+ */
+struct receiver {
+    struct rx_counters n;
+    struct rx_counters prev;      /* at the start of the current window */
+    struct histogram recvmsg[2];  /* RX software timestamp to recvmsg() return */
+    struct histogram wakeup[2];   /* RX software timestamp to epoll_wait() return */
+    struct histogram bytes[2];    /* per timestamp */
+    struct timespec started;
+    long window;
+    size_t size; /* sender's message size, for messages per timestamp */
+    struct tsc clock;
+    struct metrics* metrics;
+    struct poller poller;
+    struct perf_group perf;
+    char* buffer;
+    struct peer** peers;
+    size_t count;
+    size_t capacity;
+};
+
+static uint32_t peer_segments(const struct peer* p) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    ENFORCE_ERRNO(getsockopt(p->tcp, IPPROTO_TCP, TCP_INFO, &info, &len), "getsockopt: TCP_INFO");
+    return info.tcpi_data_segs_in;
+}
+
+static void peer_accept(struct receiver* r, int listener, int epoll) {
+    while(1) {
+        int tcp = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(tcp < 0 && (errno == EAGAIN || errno == ECONNABORTED)) {
+            return;
+        }
+        ENFORCE_ERRNO(tcp, "accept: tcp");
+
+        uint32_t flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+        ENFORCE_ERRNO(setsockopt(tcp, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)),
+                      "setsockopt: SO_TIMESTAMPING");
+        /* bytes still queued after every read, saves the closing EAGAIN */
+        flags = ENABLE;
+        ENFORCE_ERRNO(setsockopt(tcp, IPPROTO_TCP, TCP_INQ, &flags, sizeof(flags)),
+                      "setsockopt: TCP_INQ");
+
+        if(r->count == r->capacity) {
+            r->capacity = r->capacity > 0 ? 2 * r->capacity : 64;
+            r->peers = realloc(r->peers, r->capacity * sizeof(*r->peers));
+            ENFORCE_CUSTOM(r->peers != NULL, "unable to allocate peers\n");
+        }
+        struct peer* p = calloc(1, sizeof(*p));
+        ENFORCE_CUSTOM(p != NULL, "unable to allocate peer\n");
+        p->tcp = tcp;
+        p->index = r->count;
+        p->segs_in = peer_segments(p);
+        r->peers[r->count++] = p;
+        ++r->n.accepted;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = p;
+        ENFORCE_ERRNO(epoll_ctl(epoll, EPOLL_CTL_ADD, tcp, &ev), "epoll_ctrl: tcp");
+    }
+}
+
+static void peer_close(struct receiver* r, struct peer* p) {
+    r->n.segments += peer_segments(p) - p->segs_in;
+    ENFORCE_ERRNO(close(p->tcp), "close: tcp");
+    r->peers[p->index] = r->peers[--r->count];
+    r->peers[p->index]->index = p->index;
+    free(p);
+}
+
+static void print_sizes(const char* label, const struct histogram* h) {
+    if(h->count == 0) {
+        printf("%s: no samples\n", label);
+        return;
+    }
+    printf("%s: n %llu min %lld p50 %lld p90 %lld p99 %lld max %lld bytes\n",
+           label, (unsigned long long)h->count, (long long)h->min,
+           (long long)hist_percentile(h, 0.5), (long long)hist_percentile(h, 0.9),
+           (long long)hist_percentile(h, 0.99), (long long)h->max);
+}
+
+/* -M segment on the receive side, struct rx_counters order */
+static struct metrics* receiver_metrics_create(const char* name) {
+    static const char* names[] = {
+        "accepted", "reads", "bytes", "timestamps", "untimestamped", "partial", "eagain", "segments", "cpu_ns",
+        "polls", "empty_polls", "sleeps"
+    };
+    struct metrics* m = malloc(sizeof(*m));
+    ENFORCE_CUSTOM(m != NULL, "unable to allocate metrics\n");
+    int err = metrics_open(m, name, "tcp_timestamping");
+    ENFORCE_CUSTOM(err == 0, "metrics: %s: %s\n", name, strerror(-err));
+    for(size_t c = 0; c < sizeof(names)/sizeof(names[0]); ++c) {
+        metrics_add_counter(m, names[c]);
+    }
+    metrics_add_histogram(m, "recvmsg()");
+    metrics_add_histogram(m, "wakeup");
+    return m;
+}
+
+static void receiver_report(struct receiver* r) {
+    for(size_t i = 0; i < r->count; ++i) {
+        uint32_t segs_in = peer_segments(r->peers[i]);
+        r->n.segments += segs_in - r->peers[i]->segs_in;
+        r->peers[i]->segs_in = segs_in;
+    }
+    r->n.cpu_ns = thread_cpu_ns();
+    r->n.polls = r->poller.calls;
+    r->n.empty_polls = r->poller.empty;
+    r->n.sleeps = r->poller.sleeps;
+    if(r->perf.kind != PERF_NONE) {
+        perf_update(&r->n.perf, &r->perf);
+    }
+    tsc_recalibrate(&r->clock);
+    hist_merge(&r->recvmsg[1], &r->recvmsg[0]);
+    hist_merge(&r->wakeup[1], &r->wakeup[0]);
+    hist_merge(&r->bytes[1], &r->bytes[0]);
+
+    const struct rx_counters* n = &r->n;
+    const struct rx_counters* prev = &r->prev;
+    if(r->metrics != NULL) {
+        int64_t values[] = {
+            n->accepted, n->reads, n->bytes, n->timestamps, n->untimestamped,
+            n->partial, n->eagain, n->segments, n->cpu_ns, n->polls, n->empty_polls, n->sleeps
+        };
+        metrics_begin(r->metrics);
+        for(size_t c = 0; c < sizeof(values)/sizeof(values[0]); ++c) {
+            metrics_set(r->metrics, c, values[c]);
+        }
+        metrics_set_histogram(r->metrics, 0, &r->recvmsg[0], &r->recvmsg[1]);
+        metrics_set_histogram(r->metrics, 1, &r->wakeup[0], &r->wakeup[1]);
+        metrics_end(r->metrics);
+    }
+
+    struct timespec now;
+    ENFORCE_ERRNO(clock_gettime(CLOCK_MONOTONIC, &now), "clock_gettime: report");
+    double elapsed = delta_ns(&now, &r->started) / 1e9;
+    double rate = elapsed > 0 ? (n->bytes - prev->bytes) / elapsed : 0.0;
+    uint64_t reads = n->reads - prev->reads;
+    uint64_t timestamps = n->timestamps - prev->timestamps;
+    uint64_t bytes = n->bytes - prev->bytes;
+    printf("Window %llu timestamps (%llu total) - connections: %zd (%llu accepted), reads: %llu, "
+           "without timestamp: %llu, throughput: %.1f MB/s (%.3f Gbit/s), cpu: %.1f%%\n",
+           (unsigned long long)timestamps, (unsigned long long)n->timestamps,
+           r->count, (unsigned long long)n->accepted, (unsigned long long)reads,
+           (unsigned long long)(n->untimestamped - prev->untimestamped),
+           rate / 1e6, rate * 8 / 1e9,
+           elapsed > 0 ? 100.0 * (n->cpu_ns - prev->cpu_ns) / 1e9 / elapsed : 0.0);
+    printf("  per timestamp: %.0f bytes, %.2f messages of %zd bytes, %.2f segments; "
+           "reads leaving data (TCP_INQ): %llu, EAGAIN: %llu\n",
+           timestamps > 0 ? (double)bytes / timestamps : 0.0,
+           timestamps > 0 ? (double)bytes / r->size / timestamps : 0.0, r->size,
+           timestamps > 0 ? (double)(n->segments - prev->segments) / timestamps : 0.0,
+           (unsigned long long)(n->partial - prev->partial),
+           (unsigned long long)(n->eagain - prev->eagain));
+    uint64_t polls = n->polls - prev->polls;
+    printf("  epoll %s: %llu calls, %.1f%% empty, %llu blocking\n", poll_modes[r->poller.mode],
+           (unsigned long long)polls,
+           polls > 0 ? 100.0 * (n->empty_polls - prev->empty_polls) / polls : 0.0,
+           (unsigned long long)(n->sleeps - prev->sleeps));
+    print_pair("  recvmsg()", r->recvmsg);
+    perf_print("  perf recvmsg()", &n->perf, &prev->perf);
+    print_pair("  wakeup   ", r->wakeup);
+    print_sizes("  bytes/timestamp window", &r->bytes[0]);
+    print_sizes("  bytes/timestamp total ", &r->bytes[1]);
+    fflush(stdout);
+
+    hist_reset(&r->recvmsg[0]);
+    hist_reset(&r->wakeup[0]);
+    hist_reset(&r->bytes[0]);
+    r->started = now;
+    r->prev = r->n;
+}
+
+/* drains a readable connection, woke is when epoll_wait() returned */
+static void receive(struct receiver* r, struct peer* p, uint64_t woke) {
+    char control[RECEIVE_CONTROL];
+    struct iovec iov;
+    struct msghdr msg;
+    int perf = r->perf.kind != PERF_NONE;
+    struct perf_sample before;
+    struct perf_sample after;
+    for(int reads = 0; reads < RECEIVE_READS_MAX; ++reads) {
+        iov.iov_base = r->buffer;
+        iov.iov_len = RECEIVE_MAX_SIZE;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if(perf) {
+            perf_read(&r->perf, &before);
+        }
+        ssize_t got = recvmsg(p->tcp, &msg, MSG_DONTWAIT);
+        uint64_t now = tsc_read(&r->clock);
+        if(perf) {
+            perf_read(&r->perf, &after);
+            perf_account(&r->n.perf, &r->perf, &before, &after);
+        }
+        if(got < 0 && errno == EAGAIN) {
+            ++r->n.eagain;
+            return;
+        }
+        if(got == 0 || (got < 0 && errno == ECONNRESET)) {
+            peer_close(r, p);
+            return;
+        }
+        ENFORCE_ERRNO(got, "recvmsg: tcp");
+        ENFORCE_CUSTOM((msg.msg_flags & MSG_CTRUNC) == 0, "cmsg truncated\n");
+
+        int inq = -1; /* kernels without TCP_INQ read until EAGAIN */
+        struct scm_timestamping timestamping;
+        memset(&timestamping, 0, sizeof(timestamping));
+        for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg != NULL;
+            cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+                timestamping = *(struct scm_timestamping*)CMSG_DATA(cmsg);
+            } else if(cmsg->cmsg_level == IPPROTO_TCP && cmsg->cmsg_type == TCP_CM_INQ) {
+                inq = *(int*)CMSG_DATA(cmsg);
+            } else {
+                ENFORCE_CUSTOM(0, "unexpected control message: level %d type %d\n",
+                               cmsg->cmsg_level, cmsg->cmsg_type);
+            }
+        }
+
+        ++r->n.reads;
+        r->n.bytes += got;
+        if(timestamping.ts[0].tv_sec != 0 || timestamping.ts[0].tv_nsec != 0) {
+            int64_t received = trace_ns(&timestamping.ts[0]);
+            hist_record(&r->recvmsg[0], tsc_ns(&r->clock, now) - received);
+            int64_t woke_ns = tsc_ns(&r->clock, woke);
+            /* later reads may return data which arrived after the wakeup */
+            if(reads == 0 && received <= woke_ns) {
+                hist_record(&r->wakeup[0], woke_ns - received);
+            }
+            hist_record(&r->bytes[0], got);
+            ++r->n.timestamps;
+            if(r->n.timestamps % r->window == 0) {
+                receiver_report(r);
+            }
+        } else {
+            ++r->n.untimestamped;
+        }
+        if(inq == 0) {
+            return;
+        }
+        if(inq > 0) {
+            ++r->n.partial;
+        }
+    }
+}
+
+/* -l: accepts any number of senders, reports every window timestamps */
+static void serve(const struct options* opts, const struct tsc* clock, struct metrics* m) {
+    struct receiver* r = calloc(1, sizeof(*r));
+    ENFORCE_CUSTOM(r != NULL, "unable to allocate receiver\n");
+    r->buffer = malloc(RECEIVE_MAX_SIZE);
+    ENFORCE_CUSTOM(r->buffer != NULL, "unable to allocate receive buffer\n");
+    r->window = opts->window;
+    r->size = opts->size;
+    r->clock = *clock;
+    r->metrics = m;
+    for(size_t w = 0; w < 2; ++w) {
+        hist_reset(&r->recvmsg[w]);
+        hist_reset(&r->wakeup[w]);
+        hist_reset(&r->bytes[w]);
+    }
+
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    ENFORCE_ERRNO(listener, "socket: tcp");
+    uint32_t flags = ENABLE;
+    ENFORCE_ERRNO(setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &flags, sizeof(flags)),
+                  "setsockopt: SO_REUSEADDR");
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_port = htons(PORT);
+    ENFORCE_CUSTOM(inet_pton(AF_INET, opts->host, &local.sin_addr) == 1,
+                   "invalid address: %s\n", opts->host);
+    ENFORCE_ERRNO(bind(listener, (struct sockaddr*)&local, sizeof(local)), "bind: tcp");
+    ENFORCE_ERRNO(listen(listener, LISTEN_BACKLOG), "listen: tcp");
+
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    ENFORCE_ERRNO(epoll, "epoll: create");
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    ENFORCE_ERRNO(epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &ev), "epoll_ctrl: listen");
+    poller_init(&r->poller, epoll, opts, 1);
+
+    printf("Receiving on %s:%d, %zd byte messages, reads of up to %d bytes...\n",
+           opts->host, PORT, opts->size, RECEIVE_MAX_SIZE);
+    if(opts->perf) {
+        int err = perf_open(&r->perf);
+        ENFORCE_CUSTOM(err == 0, "perf_event_open: %s\n", strerror(-err));
+        printf("perf: %s%s\n", perf_describe(&r->perf), r->perf.user_only ? ", user space only" : "");
+        perf_update(&r->n.perf, &r->perf);
+    }
+    ENFORCE_ERRNO(clock_gettime(CLOCK_MONOTONIC, &r->started), "clock_gettime: started");
+    r->prev = r->n;
+    r->prev.cpu_ns = thread_cpu_ns();
+
+    struct epoll_event* events = calloc(MAX_EVENTS, sizeof(*events));
+    ENFORCE_CUSTOM(events != NULL, "unable to allocate events\n");
+    while(1) {
+        int fds = poller_wait(&r->poller, events, MAX_EVENTS);
+        uint64_t woke = tsc_read(&r->clock);
+        for(int i = 0; i < fds; ++i) {
+            struct peer* p = events[i].data.ptr;
+            if(p == NULL) {
+                peer_accept(r, listener, epoll);
+            } else {
+                receive(r, p, woke);
             }
-            printf("Avg sent() over %d - %llu ns\n", AVG_WINDOW, avg_done / AVG_WINDOW);
         }
     }
+    free(events);
     ENFORCE_ERRNO(close(epoll), "close: epoll");
-    ENFORCE_ERRNO(close(tcp), "close: tcp");
+    ENFORCE_ERRNO(close(listener), "close: listen");
+    while(r->count > 0) {
+        peer_close(r, r->peers[0]);
+    }
+    if(r->perf.kind != PERF_NONE) {
+        perf_close(&r->perf);
+    }
+    free(r->peers);
+    free(r->buffer);
+    free(r);
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,
+            "usage: %s [-a addr] [-r rate] [-s size] [-w window] [-z] [-n buffers] [-c connections [-t threads]]\n"
+            "          [-e poll [-E usecs] [-B budget]] [-T trace] [-K] [-C] [-M name]\n"
+            "       %s -l [-a addr] [-s size] [-w window] [-c connections] [-e poll ...] [-K] [-C] [-M name]\n"
+            "  -a addr         sink IPv4 address (default 127.0.0.1), with -l the address to\n"
+            "                  listen on (default 0.0.0.0)\n"
+            "  -l              receive side: accept senders on port %d, timestamp with\n"
+            "                  SOF_TIMESTAMPING_RX_SOFTWARE, with -s the senders' message size\n"
+            "                  and -w timestamps per report\n"
+            "  -r rate         messages per second per connection (default 1)\n"
+            "  -s size         message size, <= %d (default 6)\n"
+            "  -w window       messages per report, per thread with -t (default %d)\n"
+            "  -z              send with MSG_ZEROCOPY and track its completions\n"
+            "  -n buffers      send buffer pool size per thread, <= %d (default 1, %d with -z)\n"
+            "  -c connections  open connections (<= %d), all in one epoll set (default 1);\n"
+            "                  with -l only sizes RLIMIT_NOFILE\n"
+            "  -t threads      shard connections round-robin over threads (<= %d), an epoll set each\n"
+            "  -e poll         epoll wait: block (default), busy (EPIOCSPARAMS kernel busy poll,\n"
+            "                  needs NAPI devices, not loopback; spin if unsupported), spin or\n"
+            "                  adaptive (spin up to -E usecs, then block)\n"
+            "  -E usecs        busy poll / adaptive spin time (default %d)\n"
+            "  -B budget       busy: packets per NAPI poll, > 64 needs CAP_NET_ADMIN (default %d)\n"
+            "  -T trace        record raw timestamps into an mmap()ed ring of %d records,\n"
+            "                  one file per thread (trace.N) with -t\n"
+            "  -M name         live metrics segment, " METRICS_DIR "name unless it has a '/' (see metrics_reader)\n"
+            "  -C              count cycles, instructions and cache misses per send()/recvmsg() with\n"
+            "                  perf_event_open (rdpmc where allowed, software events without a PMU)\n"
+            "  -K              time sends with the calibrated " TSC_NAME " instead of clock_gettime()\n",
+            name, name, PORT, MESSAGE_MAX_SIZE, AVG_WINDOW, INFLIGHT_MAX, POOL_DEFAULT,
+            CONNECTIONS_MAX, THREADS_MAX, BUSY_POLL_USECS, BUSY_POLL_BUDGET, TRACE_RECORDS);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    struct options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.rate = 1;
+    opts.window = AVG_WINDOW;
+    opts.connections = 1;
+    opts.poll = POLL_BLOCK;
+    opts.poll_usecs = BUSY_POLL_USECS;
+    opts.poll_budget = BUSY_POLL_BUDGET;
+
+    int opt;
+    while((opt = getopt(argc, argv, "a:lr:s:w:zn:c:t:e:E:B:T:KCM:h")) != -1) {
+        switch(opt) {
+            case 'a':
+                opts.host = optarg;
+                break;
+            case 'l':
+                opts.listen = ENABLE;
+                break;
+            case 'r':
+                opts.rate = strtol(optarg, NULL, 0);
+                break;
+            case 's':
+                opts.size = strtoul(optarg, NULL, 0);
+                break;
+            case 'w':
+                opts.window = strtol(optarg, NULL, 0);
+                break;
+            case 'z':
+                opts.zerocopy = ENABLE;
+                break;
+            case 'n':
+                opts.buffers = strtoul(optarg, NULL, 0);
+                ENFORCE_CUSTOM(opts.buffers > 0, "invalid pool size: %s\n", optarg);
+                break;
+            case 'c':
+                opts.connections = strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                opts.threads = strtoul(optarg, NULL, 0);
+                break;
+            case 'e':
+                for(opts.poll = 0; opts.poll < POLL_MODES; ++opts.poll) {
+                    if(strcmp(optarg, poll_modes[opts.poll]) == 0) {
+                        break;
+                    }
+                }
+                ENFORCE_CUSTOM(opts.poll < POLL_MODES, "unknown poll mode: %s\n", optarg);
+                break;
+            case 'E':
+                opts.poll_usecs = strtol(optarg, NULL, 0);
+                break;
+            case 'B':
+                opts.poll_budget = strtol(optarg, NULL, 0);
+                break;
+            case 'T':
+                opts.trace = optarg;
+                break;
+            case 'K':
+                opts.tsc = ENABLE;
+                break;
+            case 'C':
+                opts.perf = ENABLE;
+                break;
+            case 'M':
+                opts.metrics = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    ENFORCE_CUSTOM(opts.rate > 0 && opts.rate <= 1000000000, "invalid rate: %ld\n", opts.rate);
+    ENFORCE_CUSTOM(opts.size <= MESSAGE_MAX_SIZE, "message too large: %zd\n", opts.size);
+    ENFORCE_CUSTOM(opts.window > 0, "invalid window: %ld\n", opts.window);
+    ENFORCE_CUSTOM(opts.connections > 0 && opts.connections <= CONNECTIONS_MAX,
+                   "invalid connections: %zd\n", opts.connections);
+    ENFORCE_CUSTOM(opts.threads <= THREADS_MAX && opts.threads <= opts.connections,
+                   "invalid threads: %zd\n", opts.threads);
+    ENFORCE_CUSTOM(opts.poll_usecs > 0 && opts.poll_usecs <= INT32_MAX, "invalid poll time: %ld\n", opts.poll_usecs);
+    ENFORCE_CUSTOM(opts.poll_budget > 0 && opts.poll_budget <= UINT16_MAX,
+                   "invalid poll budget: %d\n", opts.poll_budget);
+    ENFORCE_CUSTOM(!opts.listen || (!opts.zerocopy && opts.threads == 0 && opts.trace == NULL),
+                   "-l does not combine with -z, -t or -T\n");
+    if(opts.host == NULL) {
+        opts.host = opts.listen ? "0.0.0.0" : "127.0.0.1";
+    }
+    if(opts.size == 0) {
+        opts.size = strlen("hello\n");
+    }
+    if(opts.buffers == 0) {
+        opts.buffers = opts.zerocopy ? POOL_DEFAULT : 1;
+    }
+    ENFORCE_CUSTOM(opts.buffers <= INFLIGHT_MAX, "pool too large: %zd\n", opts.buffers);
+
+    size_t inflight = INFLIGHT_MAX;
+    while(inflight > INFLIGHT_MIN && inflight * opts.connections > INFLIGHT_MAX) {
+        inflight /= 2;
+    }
+
+    struct tsc clock;
+    if(opts.tsc) {
+        int err = tsc_init(&clock);
+        ENFORCE_CUSTOM(err == 0, "-K: no invariant %s on this cpu\n", TSC_NAME);
+    } else {
+        tsc_init_realtime(&clock);
+    }
+    tsc_print_overhead(&clock);
+    if(opts.listen) {
+        struct metrics* m = opts.metrics != NULL ? receiver_metrics_create(opts.metrics) : NULL;
+        raise_nofile(opts.connections + 64);
+        serve(&opts, &clock, m);
+        if(m != NULL) {
+            metrics_close(m);
+            free(m);
+        }
+        return 0;
+    }
+    struct metrics* m = opts.metrics != NULL ? metrics_create(opts.metrics) : NULL;
+
+    raise_nofile(opts.connections + 64);
+    struct connection** conns = calloc(opts.connections, sizeof(*conns));
+    ENFORCE_CUSTOM(conns != NULL, "unable to allocate connections\n");
+    for(size_t i = 0; i < opts.connections; ++i) {
+        conns[i] = open_connection(&opts, inflight);
+    }
+
+    size_t shards = opts.threads > 0 ? opts.threads : 1;
+    struct worker* workers = calloc(shards, sizeof(*workers));
+    ENFORCE_CUSTOM(workers != NULL, "unable to allocate workers\n");
+    for(size_t t = 0; t < shards; ++t) {
+        workers[t].index = t;
+        workers[t].opts = &opts;
+        workers[t].clock = &clock;
+        workers[t].conns = calloc(opts.connections, sizeof(*workers[t].conns));
+        ENFORCE_CUSTOM(workers[t].conns != NULL, "unable to allocate connections\n");
+    }
+    /* by index, fd numbers interleave with other files and fd % shards can leave a shard empty */
+    for(size_t i = 0; i < opts.connections; ++i) {
+        struct worker* w = &workers[i % shards];
+        w->conns[w->count++] = conns[i];
+    }
+
+    printf("Sending data to %s:%d at %ld msg/s over %zd connections, %zd bytes each, %s from %zd buffers...\n",
+           opts.host, PORT, opts.rate, opts.connections, opts.size, opts.zerocopy ? "MSG_ZEROCOPY" : "copying",
+           opts.buffers);
+    if(opts.threads > 0) {
+        for(size_t t = 0; t < opts.threads; ++t) {
+            struct worker* w = &workers[t];
+            w->snapshot = aligned_alloc(CACHE_LINE, ALIGN_UP(sizeof(*w->snapshot), CACHE_LINE));
+            ENFORCE_CUSTOM(w->snapshot != NULL, "unable to allocate snapshot\n");
+            memset(w->snapshot, 0, sizeof(*w->snapshot));
+            totals_reset(&w->snapshot->t);
+            int err = pthread_create(&w->thread, NULL, worker_main, w);
+            ENFORCE_CUSTOM(err == 0, "pthread_create: %s\n", strerror(err));
+        }
+        report_workers(workers, &opts, m);
+        for(size_t t = 0; t < opts.threads; ++t) {
+            pthread_join(workers[t].thread, NULL);
+            free(workers[t].snapshot);
+        }
+    } else {
+        worker_create(&workers[0]);
+        workers[0].st->metrics = m;
+        run(&workers[0]);
+        worker_destroy(&workers[0]);
+    }
+
+    for(size_t t = 0; t < shards; ++t) {
+        free(workers[t].conns);
+    }
+    free(workers);
+    for(size_t i = 0; i < opts.connections; ++i) {
+        close_connection(conns[i]);
+    }
+    free(conns);
+    if(m != NULL) {
+        metrics_close(m);
+        free(m);
+    }
     return 0;
 }
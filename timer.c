@@ -1,136 +1,790 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <time.h>
+#include <sched.h>
 
 #include <sys/timerfd.h>
 #include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+
+#include "histogram.h"
+#include "metrics.h"
+#include "timer_heap.h"
 
 static const int CLOCK_ID = CLOCK_MONOTONIC;
 static const size_t MAX_EVENTS = 16;
 static const size_t WINDOW = 300;
+static const size_t MANY_EVENTS = 1024;
+static const long DURATION = 5;
 
-int main() {
-    int timer = timerfd_create(CLOCK_ID, TFD_NONBLOCK | TFD_CLOEXEC);
-    if(timer < 0) {
-        perror("timerfd_create");
-        exit(1);
+enum mode {
+    MODE_EPOLL,     /* timerfd + EPOLLONESHOT epoll re-arm */
+    MODE_READ,      /* blocking read() on timerfd */
+    MODE_NANOSLEEP, /* clock_nanosleep(TIMER_ABSTIME) */
+    MODE_SPIN,      /* busy loop on clock_gettime() */
+    MODE_HEAP,      /* all timers in a timer_heap over one timerfd */
+    MODES
+};
+
+static const char* modes[MODES] = {
+    "epoll", "read", "nanosleep", "spin", "heap"
+};
+
+struct options {
+    enum mode mode;
+    long period;
+    size_t window;
+    int cpu;
+    int priority;
+    long slack;
+    const char* metrics; /* shared memory segment name */
+    size_t timers;       /* concurrent periodic timers */
+    size_t sweep;        /* compare epoll and heap for 1, 10, ... sweep timers */
+    long duration;       /* seconds per sweep point */
+};
+
+struct bench {
+    enum mode mode;
+    long period;
+    int timer;
+    int epoll;
+    struct epoll_event ev;
+    struct timespec deadline; /* next expected expiration */
+    unsigned long long overruns;
+};
+
+static inline long long delta_ns(const struct timespec* lhs, const struct timespec* rhs) {
+    return 1000000000LL*(lhs->tv_sec - rhs->tv_sec) + (lhs->tv_nsec - rhs->tv_nsec);
+}
+
+static inline void timespec_add(struct timespec* ts, long long ns) {
+    ts->tv_sec += ns / 1000000000;
+    ts->tv_nsec += ns % 1000000000;
+    if(ts->tv_nsec >= 1000000000) {
+        ts->tv_nsec -= 1000000000;
+        ++ts->tv_sec;
     }
+}
 
-    struct timespec now;
-    if(clock_gettime(CLOCK_ID, &now) < 0) {
-        perror("clock_gettime");
+static void now_or_die(struct timespec* now, const char* message) {
+    if(clock_gettime(CLOCK_ID, now) < 0) {
+        perror(message);
         exit(2);
     }
+}
+
+static void setup(struct bench* b, const struct options* opts) {
+    b->mode = opts->mode;
+    b->period = opts->period;
+    b->timer = -1;
+    b->epoll = -1;
+    b->overruns = 0;
+
+    now_or_die(&b->deadline, "clock_gettime");
+    timespec_add(&b->deadline, 2 * b->period);
+
+    if(b->mode != MODE_EPOLL && b->mode != MODE_READ) {
+        return;
+    }
+
+    int flags = TFD_CLOEXEC | (b->mode == MODE_EPOLL ? TFD_NONBLOCK : 0);
+    b->timer = timerfd_create(CLOCK_ID, flags);
+    if(b->timer < 0) {
+        perror("timerfd_create");
+        exit(1);
+    }
 
     struct itimerspec interval;
-    interval.it_value.tv_sec = now.tv_sec + 2;
-    interval.it_value.tv_nsec = 0;
-    interval.it_interval.tv_sec = 1;
-    interval.it_interval.tv_nsec = 0;
-    if(timerfd_settime(timer, TFD_TIMER_ABSTIME, &interval, NULL) < 0) {
+    interval.it_value = b->deadline;
+    interval.it_interval.tv_sec = b->period / 1000000000;
+    interval.it_interval.tv_nsec = b->period % 1000000000;
+    if(timerfd_settime(b->timer, TFD_TIMER_ABSTIME, &interval, NULL) < 0) {
         perror("timerfd_settime");
         exit(2);
     }
-    printf("timer started\n");
 
-    int epoll = epoll_create1(EPOLL_CLOEXEC);
-    if(epoll < 0) {
+    if(b->mode != MODE_EPOLL) {
+        return;
+    }
+
+    b->epoll = epoll_create1(EPOLL_CLOEXEC);
+    if(b->epoll < 0) {
         perror("epoll_create1");
         exit(1);
     }
-    struct epoll_event ev;
-    ev.events = EPOLLET | EPOLLIN | EPOLLOUT | EPOLLONESHOT | EPOLLWAKEUP;
-    ev.data.fd = timer;
-    if(epoll_ctl(epoll, EPOLL_CTL_ADD, timer, &ev) < 0) {
+    b->ev.events = EPOLLET | EPOLLIN | EPOLLOUT | EPOLLONESHOT | EPOLLWAKEUP;
+    b->ev.data.fd = b->timer;
+    if(epoll_ctl(b->epoll, EPOLL_CTL_ADD, b->timer, &b->ev) < 0) {
         perror("epoll_ctrl: timer");
         exit(4);
     }
+}
 
-    struct epoll_event events[MAX_EVENTS];
-    struct timespec expected = interval.it_value;
-    struct timespec prev;
-    prev.tv_sec = prev.tv_nsec = 0;
+static void teardown(struct bench* b) {
+    if(b->epoll >= 0 && close(b->epoll) < 0) {
+        perror("close: epoll");
+        exit(1);
+    }
+    if(b->timer >= 0 && close(b->timer) < 0) {
+        perror("close: timer");
+        exit(1);
+    }
+}
 
-    long long offset_w[WINDOW];
-    long long length_w[WINDOW];
-    size_t counter = 0;
-    do {
-        int fds = epoll_wait(epoll, events, MAX_EVENTS, -1);
+static uint64_t read_timer(struct bench* b) {
+    uint64_t exp = 0;
+    ssize_t s = read(b->timer, &exp, sizeof(exp));
+    if(s != sizeof(exp)) {
+        perror("read");
+        exit(3);
+    }
+    return exp;
+}
+
+static uint64_t wait_epoll(struct bench* b) {
+    struct epoll_event events[MAX_EVENTS];
+    while(1) {
+        int fds = epoll_wait(b->epoll, events, MAX_EVENTS, -1);
         if(fds < 0) {
             perror("epoll_wait");
             exit(4);
         }
         for(int i = 0; i < fds; ++i) {
-            if(events[i].data.fd == timer &&
+            if(events[i].data.fd == b->timer &&
                (events[i].events & EPOLLIN) != 0) {
-                uint64_t exp = 0;
-                size_t s = read(timer, &exp, sizeof(exp));
-                if(s != sizeof(exp)) {
-                    perror("read");
-                    exit(3);
-                }
-                if(exp != 1) {
-                    printf("too many expirations: %lu\n", exp);
-                    exit(5);
-                }
-                struct timespec now;
-                if(clock_gettime(CLOCK_ID, &now) < 0) {
-                    perror("clock_gettime: loop");
-                    exit(2);
-                }
-                long long delta;
-                delta = 1000000000*(now.tv_sec - expected.tv_sec);
-                delta += (now.tv_nsec - expected.tv_nsec);
-
-                long long length = 0;
-                if(prev.tv_sec == 0 && prev.tv_nsec == 0) {
-                    length = 1000000000*interval.it_interval.tv_sec + interval.it_interval.tv_nsec;
-                } else {
-                    length = 1000000000*(now.tv_sec - prev.tv_sec);
-                    length += (now.tv_nsec - prev.tv_nsec);
-                }
-                /* printf("%ld.%09ld: Mismatch: %lld ns; interval: %lld ns\n", */
-                /*        now.tv_sec, now.tv_nsec, delta, length); */
-                prev = now;
-
-                struct itimerspec current;
-                if(timerfd_gettime(timer, &current) < 0) {
-                    perror("timerfs_gettime");
-                    exit(5);
-                }
-                expected.tv_sec += 1 + current.it_value.tv_sec;
-
-                if(epoll_ctl(epoll, EPOLL_CTL_MOD, timer, &ev) < 0) {
+                uint64_t exp = read_timer(b);
+                if(epoll_ctl(b->epoll, EPOLL_CTL_MOD, b->timer, &b->ev) < 0) {
                     perror("epoll_ctrl: timer");
                     exit(4);
                 }
+                return exp;
+            }
+        }
+    }
+}
 
-                length_w[counter % WINDOW] = length;
-                offset_w[counter % WINDOW] = delta;
-                ++counter;
-                if(counter % WINDOW == 0) {
-                    long long avg_offset = 0;
-                    long long avg_period = 0;
-                    for(size_t i = 0; i < WINDOW; ++i) {
-                        avg_period += length_w[i];
-                        avg_offset += offset_w[i];
-                    }
-                    printf("Avg over %zd intervals: period %lld ns, offset %lld ns\n",
-                           WINDOW, avg_period / WINDOW, avg_offset / WINDOW);
-                }
+static uint64_t wait_nanosleep(struct bench* b) {
+    int err;
+    while((err = clock_nanosleep(CLOCK_ID, TIMER_ABSTIME, &b->deadline, NULL)) == EINTR);
+    if(err != 0) {
+        fprintf(stderr, "clock_nanosleep: %s\n", strerror(err));
+        exit(2);
+    }
+    return 1;
+}
+
+static uint64_t wait_spin(struct bench* b) {
+    struct timespec now;
+    do {
+        now_or_die(&now, "clock_gettime: spin");
+    } while(delta_ns(&now, &b->deadline) < 0);
+    return 1;
+}
+
+/* blocks until the next deadline, returns the number of expirations */
+static uint64_t wait_next(struct bench* b) {
+    switch(b->mode) {
+        case MODE_EPOLL:
+            return wait_epoll(b);
+        case MODE_READ:
+            return read_timer(b);
+        case MODE_NANOSLEEP:
+            return wait_nanosleep(b);
+        case MODE_SPIN:
+            return wait_spin(b);
+        default:
+            fprintf(stderr, "unknown mode: %d\n", b->mode);
+            exit(1);
+    }
+}
+
+static void apply_options(const struct options* opts) {
+    if(opts->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(opts->cpu, &cpus);
+        if(sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+            perror("sched_setaffinity");
+            exit(1);
+        }
+    }
+    if(opts->priority > 0) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = opts->priority;
+        if(sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+            perror("sched_setscheduler: SCHED_FIFO");
+            exit(1);
+        }
+    }
+    if(opts->slack >= 0) {
+        /* 0 restores the default slack */
+        if(prctl(PR_SET_TIMERSLACK, opts->slack, 0, 0, 0) < 0) {
+            perror("prctl: PR_SET_TIMERSLACK");
+            exit(1);
+        }
+    }
+}
+
+static long long rusage_ns(const struct rusage* ru) {
+    return 1000000000LL*(ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) +
+           1000LL*(ru->ru_utime.tv_usec + ru->ru_stime.tv_usec);
+}
+
+static int64_t now_ns(const char* message) {
+    struct timespec now;
+    now_or_die(&now, message);
+    return 1000000000LL*now.tv_sec + now.tv_nsec;
+}
+
+/* counters first, then period and offset */
+static void metrics_create(struct metrics* m, const char* name) {
+    static const char* counters[] = {
+        "wakeups", "overruns", "voluntary_switches", "involuntary_switches", "cpu_ns"
+    };
+    int err = metrics_open(m, name, "timer");
+    if(err < 0) {
+        fprintf(stderr, "metrics: %s: %s\n", name, strerror(-err));
+        exit(1);
+    }
+    for(size_t c = 0; c < sizeof(counters)/sizeof(counters[0]); ++c) {
+        metrics_add_counter(m, counters[c]);
+    }
+    metrics_add_histogram(m, "period");
+    metrics_add_histogram(m, "offset");
+}
+
+static void metrics_update(struct metrics* m, unsigned long long wakeups, unsigned long long overruns,
+                           const struct rusage* ru, const struct histogram* period,
+                           const struct histogram* offset) {
+    metrics_begin(m);
+    metrics_set(m, 0, wakeups);
+    metrics_set(m, 1, overruns);
+    metrics_set(m, 2, ru->ru_nvcsw);
+    metrics_set(m, 3, ru->ru_nivcsw);
+    metrics_set(m, 4, rusage_ns(ru));
+    metrics_set_histogram(m, 0, period, NULL);
+    metrics_set_histogram(m, 1, offset, NULL);
+    metrics_end(m);
+}
+
+/*
+ * Many periodic timers, phases spread evenly over the period: either a
+ * timerfd each in one epoll set (EPOLLONESHOT, re-armed after every
+ * expiration like the single timer) or all of them in a timer_heap.
+ */
+struct many {
+    enum mode mode;
+    size_t count;
+    long period;
+    int epoll;
+    int* timers;               /* MODE_EPOLL */
+    int64_t* deadline;         /* MODE_EPOLL: next expected expiration per timer */
+    int64_t* woke;             /* last expiration handled per timer, 0 before the first */
+    struct timer_heap heap;    /* MODE_HEAP */
+    struct epoll_event* events;
+    unsigned long long wakeups;
+    unsigned long long expirations;
+    unsigned long long overruns;
+};
+
+/* RLIMIT_NOFILE for a timerfd per timer, 0 or -1 if not allowed to */
+static int raise_nofile(size_t needed) {
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        return -1;
+    }
+    if(limit.rlim_cur >= needed) {
+        return 0;
+    }
+    limit.rlim_cur = needed;
+    if(limit.rlim_max < needed) {
+        limit.rlim_max = needed; /* needs CAP_SYS_RESOURCE */
+    }
+    return setrlimit(RLIMIT_NOFILE, &limit);
+}
+
+/* 0 or -errno, so a sweep can skip what the system does not allow */
+static int many_setup(struct many* m, enum mode mode, size_t count, long period) {
+    memset(m, 0, sizeof(*m));
+    m->mode = mode;
+    m->count = count;
+    m->period = period;
+    m->heap.fd = -1;
+    m->events = calloc(MANY_EVENTS, sizeof(*m->events));
+    m->deadline = calloc(count, sizeof(*m->deadline));
+    m->woke = calloc(count, sizeof(*m->woke));
+    if(m->events == NULL || m->deadline == NULL || m->woke == NULL) {
+        return -ENOMEM;
+    }
+    m->epoll = epoll_create1(EPOLL_CLOEXEC);
+    if(m->epoll < 0) {
+        return -errno;
+    }
+
+    int64_t start = now_ns("clock_gettime") + 2 * period;
+    struct epoll_event ev;
+    ev.events = EPOLLET | EPOLLIN | EPOLLONESHOT;
+    if(mode == MODE_HEAP) {
+        int err = timer_heap_init(&m->heap, count, CLOCK_ID);
+        if(err < 0) {
+            return err;
+        }
+        for(size_t i = 0; i < count; ++i) {
+            timer_heap_schedule(&m->heap, i, start + (long long)period * i / count);
+        }
+        if((err = timer_heap_arm(&m->heap)) < 0) {
+            return err;
+        }
+        /* level triggered, the heap fd is drained on every wakeup */
+        ev.events = EPOLLIN;
+        ev.data.u32 = UINT32_MAX;
+        return epoll_ctl(m->epoll, EPOLL_CTL_ADD, m->heap.fd, &ev) < 0 ? -errno : 0;
+    }
+
+    if(raise_nofile(count + 64) < 0) {
+        return -EMFILE;
+    }
+    m->timers = malloc(count * sizeof(*m->timers));
+    if(m->timers == NULL) {
+        return -ENOMEM;
+    }
+    for(size_t i = 0; i < count; ++i) {
+        m->timers[i] = -1;
+    }
+    for(size_t i = 0; i < count; ++i) {
+        m->timers[i] = timerfd_create(CLOCK_ID, TFD_NONBLOCK | TFD_CLOEXEC);
+        if(m->timers[i] < 0) {
+            return -errno;
+        }
+        m->deadline[i] = start + (long long)period * i / count;
+        struct itimerspec interval;
+        interval.it_value.tv_sec = m->deadline[i] / 1000000000;
+        interval.it_value.tv_nsec = m->deadline[i] % 1000000000;
+        interval.it_interval.tv_sec = period / 1000000000;
+        interval.it_interval.tv_nsec = period % 1000000000;
+        if(timerfd_settime(m->timers[i], TFD_TIMER_ABSTIME, &interval, NULL) < 0) {
+            return -errno;
+        }
+        ev.data.u32 = i;
+        if(epoll_ctl(m->epoll, EPOLL_CTL_ADD, m->timers[i], &ev) < 0) {
+            return -errno;
+        }
+    }
+    return 0;
+}
+
+static void many_teardown(struct many* m) {
+    if(m->timers != NULL) {
+        for(size_t i = 0; i < m->count && m->timers[i] >= 0; ++i) {
+            close(m->timers[i]);
+        }
+        free(m->timers);
+    }
+    if(m->mode == MODE_HEAP) {
+        timer_heap_free(&m->heap);
+    }
+    if(m->epoll >= 0) {
+        close(m->epoll);
+    }
+    free(m->deadline);
+    free(m->woke);
+    free(m->events);
+}
+
+/* the time since the same timer's previous expiration, like the single timer's period */
+static void many_period(struct many* m, uint32_t id, int64_t now, struct histogram* period) {
+    if(period != NULL && m->woke[id] != 0) {
+        hist_record(period, now - m->woke[id]);
+    }
+    m->woke[id] = now;
+}
+
+/* one epoll_wait() and every expiration it reports, period (if not NULL) and offset histograms */
+static void many_wait(struct many* m, struct histogram* period, struct histogram* offset) {
+    int fds = epoll_wait(m->epoll, m->events, MANY_EVENTS, -1);
+    if(fds < 0) {
+        if(errno == EINTR) {
+            return;
+        }
+        perror("epoll_wait");
+        exit(4);
+    }
+    ++m->wakeups;
+    int64_t now = now_ns("clock_gettime: loop");
+    for(int i = 0; i < fds; ++i) {
+        uint32_t id = m->events[i].data.u32;
+        if(id == UINT32_MAX) {
+            if(timer_heap_ack(&m->heap) < 0) {
+                perror("read: timer heap");
+                exit(3);
             }
+            /* offset is measured against the latest expiration, as with timerfd */
+            while((id = timer_heap_due(&m->heap, now)) != TIMER_HEAP_IDLE) {
+                int64_t deadline = m->heap.deadline[id];
+                int64_t missed = (now - deadline) / m->period;
+                deadline += missed * m->period;
+                m->overruns += missed;
+                hist_record(offset, now - deadline);
+                many_period(m, id, now, period);
+                timer_heap_schedule(&m->heap, id, deadline + m->period);
+                ++m->expirations;
+            }
+            if(timer_heap_arm(&m->heap) < 0) {
+                perror("timerfd_settime: timer heap");
+                exit(2);
+            }
+            continue;
         }
-    } while(1);
 
-    if(close(epoll) < 0) {
-        perror("close: epoll");
+        uint64_t exp = 0;
+        if(read(m->timers[id], &exp, sizeof(exp)) != sizeof(exp)) {
+            perror("read");
+            exit(3);
+        }
+        m->overruns += exp - 1;
+        m->deadline[id] += (exp - 1) * m->period;
+        if(m->deadline[id] > now) {
+            /* expired again since the batch started */
+            now = now_ns("clock_gettime: loop");
+        }
+        hist_record(offset, now - m->deadline[id]);
+        many_period(m, id, now, period);
+        m->deadline[id] += m->period;
+        ++m->expirations;
+
+        struct epoll_event ev;
+        ev.events = EPOLLET | EPOLLIN | EPOLLONESHOT;
+        ev.data.u32 = id;
+        if(epoll_ctl(m->epoll, EPOLL_CTL_MOD, m->timers[id], &ev) < 0) {
+            perror("epoll_ctrl: timer");
+            exit(4);
+        }
+    }
+}
+
+/* -n timers: reports every window expirations, like the single timer loop */
+static void run_many(const struct options* opts, struct metrics* metrics) {
+    struct many m;
+    int err = many_setup(&m, opts->mode, opts->timers, opts->period);
+    if(err < 0) {
+        fprintf(stderr, "%zd timers: %s\n", opts->timers, strerror(-err));
         exit(1);
     }
-    if(close(timer) < 0) {
-        perror("close: timer");
+    printf("timers started: mode %s, %zd timers, period %ld ns, slack %d ns, cpu %d, priority %d\n",
+           modes[m.mode], m.count, m.period, prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0),
+           opts->cpu, opts->priority);
+
+    /* [0] - current window, [1] - cumulative */
+    static struct histogram offset_h[2];
+    static struct histogram period_h[2];
+    for(size_t i = 0; i < 2; ++i) {
+        hist_reset(&offset_h[i]);
+        hist_reset(&period_h[i]);
+    }
+
+    struct timespec window_start;
+    struct rusage window_ru;
+    now_or_die(&window_start, "clock_gettime: window");
+    if(getrusage(RUSAGE_SELF, &window_ru) < 0) {
+        perror("getrusage");
+        exit(1);
+    }
+    unsigned long long window_wakeups = 0;
+    unsigned long long window_overruns = 0;
+    unsigned long long next_report = opts->window;
+
+    while(1) {
+        many_wait(&m, &period_h[0], &offset_h[0]);
+        if(m.expirations < next_report) {
+            continue;
+        }
+        next_report += opts->window;
+
+        struct timespec now;
+        now_or_die(&now, "clock_gettime: window");
+        struct rusage ru;
+        if(getrusage(RUSAGE_SELF, &ru) < 0) {
+            perror("getrusage");
+            exit(1);
+        }
+        long long wall = delta_ns(&now, &window_start);
+        long long cpu = rusage_ns(&ru) - rusage_ns(&window_ru);
+        unsigned long long expirations = offset_h[0].count;
+        printf("Window %llu expirations (%llu total) - wakeups: %.0f/s, %.1f expirations/wakeup, "
+               "cpu: %.1f%%, %lld ns/expiration, switches: %ld voluntary %ld involuntary, overruns: %llu\n",
+               expirations, m.expirations,
+               wall > 0 ? 1e9 * (m.wakeups - window_wakeups) / wall : 0.0,
+               m.wakeups > window_wakeups ? (double)expirations / (m.wakeups - window_wakeups) : 0.0,
+               wall > 0 ? 100.0 * cpu / wall : 0.0, expirations > 0 ? cpu / (long long)expirations : 0,
+               ru.ru_nvcsw - window_ru.ru_nvcsw, ru.ru_nivcsw - window_ru.ru_nivcsw,
+               m.overruns - window_overruns);
+        if(metrics != NULL) {
+            metrics_update(metrics, m.expirations, m.overruns, &ru, &period_h[0], &offset_h[0]);
+        }
+        hist_report("  period", &period_h[0], &period_h[1]);
+        hist_report("  offset", &offset_h[0], &offset_h[1]);
+
+        window_start = now;
+        window_ru = ru;
+        window_wakeups = m.wakeups;
+        window_overruns = m.overruns;
+    }
+    many_teardown(&m);
+}
+
+/* -b sweep: same load through N timerfds and through the heap, N = 1, 10, ... */
+static void compare(const struct options* opts) {
+    static const enum mode compared[] = { MODE_EPOLL, MODE_HEAP };
+    static struct histogram offset;
+
+    printf("Comparing timerfd per timer with the timer heap: period %ld ns, %ld s per point\n",
+           opts->period, opts->duration);
+    for(size_t count = 1; count <= opts->sweep; count *= 10) {
+        for(size_t c = 0; c < sizeof(compared)/sizeof(compared[0]); ++c) {
+            struct many m;
+            int err = many_setup(&m, compared[c], count, opts->period);
+            if(err < 0) {
+                printf("  %6zd %-5s: skipped, %s\n", count, modes[compared[c]], strerror(-err));
+                many_teardown(&m);
+                continue;
+            }
+            hist_reset(&offset);
+
+            /* the first expirations are 2 periods away */
+            int64_t start = now_ns("clock_gettime: compare") + 2 * opts->period;
+            while(now_ns("clock_gettime: compare") < start) {
+                many_wait(&m, NULL, &offset);
+            }
+            hist_reset(&offset);
+            unsigned long long wakeups = m.wakeups;
+            unsigned long long overruns = m.overruns;
+            struct rusage ru_start;
+            struct rusage ru_end;
+            if(getrusage(RUSAGE_SELF, &ru_start) < 0) {
+                perror("getrusage");
+                exit(1);
+            }
+            int64_t end = start + opts->duration * 1000000000LL;
+            int64_t now = start;
+            while(now < end) {
+                many_wait(&m, NULL, &offset);
+                now = now_ns("clock_gettime: compare");
+            }
+            if(getrusage(RUSAGE_SELF, &ru_end) < 0) {
+                perror("getrusage");
+                exit(1);
+            }
+            double wall = (now - start) / 1e9;
+            long long cpu = rusage_ns(&ru_end) - rusage_ns(&ru_start);
+            printf("  %6zd %-5s: wakeups %8.0f/s, expirations %8.0f/s, cpu %5.1f%%, %6lld ns/expiration, "
+                   "overruns %llu, offset p50 %lld p99 %lld p99.9 %lld max %lld ns\n",
+                   count, modes[compared[c]], (m.wakeups - wakeups) / wall, offset.count / wall,
+                   100.0 * cpu / 1e9 / wall, offset.count > 0 ? cpu / (long long)offset.count : 0,
+                   m.overruns - overruns,
+                   (long long)hist_percentile(&offset, 0.5), (long long)hist_percentile(&offset, 0.99),
+                   (long long)hist_percentile(&offset, 0.999), (long long)(offset.count > 0 ? offset.max : 0));
+            fflush(stdout);
+            many_teardown(&m);
+        }
+    }
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,
+            "usage: %s [-m mode] [-n timers | -b timers [-d seconds]] [-p period] [-w window] [-c cpu]\n"
+            "          [-f priority] [-s slack] [-M name]\n"
+            "  -m mode      epoll (default), read, nanosleep, spin or heap (timers over one timerfd)\n"
+            "  -n timers    run timers periodic timers spread over the period, epoll or heap mode\n"
+            "  -b timers    compare a timerfd each with the heap for 1, 10, ... up to timers\n"
+            "  -d seconds   measurement per -b point (default %ld)\n"
+            "  -p period    wakeup period in ns (default 1000000000)\n"
+            "  -w window    wakeups (expirations with -n) per report (default %zd)\n"
+            "  -c cpu       pin to cpu\n"
+            "  -f priority  run as SCHED_FIFO with priority (spin will own the cpu)\n"
+            "  -s slack     PR_SET_TIMERSLACK in ns, 0 restores the default\n"
+            "  -M name      live metrics segment, " METRICS_DIR "name unless it has a '/' (see metrics_reader)\n",
+            name, DURATION, WINDOW);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    struct options opts;
+    opts.mode = MODE_EPOLL;
+    opts.period = 1000000000;
+    opts.window = WINDOW;
+    opts.cpu = -1;
+    opts.priority = 0;
+    opts.slack = -1;
+    opts.metrics = NULL;
+    opts.timers = 1;
+    opts.sweep = 0;
+    opts.duration = DURATION;
+
+    int opt;
+    while((opt = getopt(argc, argv, "m:n:b:d:p:w:c:f:s:M:h")) != -1) {
+        switch(opt) {
+            case 'm':
+                opts.mode = MODES;
+                for(size_t m = 0; m < MODES; ++m) {
+                    if(strcmp(optarg, modes[m]) == 0) {
+                        opts.mode = m;
+                    }
+                }
+                if(opts.mode == MODES) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'n':
+                opts.timers = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                opts.sweep = strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                opts.duration = strtol(optarg, NULL, 0);
+                break;
+            case 'p':
+                opts.period = strtol(optarg, NULL, 0);
+                break;
+            case 'w':
+                opts.window = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                opts.cpu = strtol(optarg, NULL, 0);
+                break;
+            case 'f':
+                opts.priority = strtol(optarg, NULL, 0);
+                break;
+            case 's':
+                opts.slack = strtol(optarg, NULL, 0);
+                break;
+            case 'M':
+                opts.metrics = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(opts.period <= 0 || opts.window == 0 || opts.timers == 0 || opts.duration <= 0) {
+        usage(argv[0]);
+    }
+    if((opts.timers > 1 || opts.sweep > 0) && opts.mode != MODE_EPOLL && opts.mode != MODE_HEAP) {
+        fprintf(stderr, "-n and -b need epoll or heap mode\n");
+        exit(1);
+    }
+    if(opts.timers > UINT32_MAX - 1) {
+        usage(argv[0]);
+    }
+
+    apply_options(&opts);
+    if(opts.sweep > 0) {
+        compare(&opts);
+        return 0;
+    }
+
+    struct metrics metrics;
+    if(opts.metrics != NULL) {
+        metrics_create(&metrics, opts.metrics);
+    }
+    if(opts.timers > 1 || opts.mode == MODE_HEAP) {
+        run_many(&opts, opts.metrics != NULL ? &metrics : NULL);
+        return 0;
+    }
+
+    struct bench b;
+    setup(&b, &opts);
+    printf("timer started: mode %s, period %ld ns, slack %d ns, cpu %d, priority %d\n",
+           modes[b.mode], b.period, prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0),
+           opts.cpu, opts.priority);
+
+    struct timespec prev;
+    prev.tv_sec = prev.tv_nsec = 0;
+
+    /* [0] - current window, [1] - cumulative */
+    static struct histogram offset_h[2];
+    static struct histogram length_h[2];
+    for(size_t i = 0; i < 2; ++i) {
+        hist_reset(&offset_h[i]);
+        hist_reset(&length_h[i]);
+    }
+
+    struct timespec window_start;
+    struct rusage window_ru;
+    now_or_die(&window_start, "clock_gettime: window");
+    if(getrusage(RUSAGE_SELF, &window_ru) < 0) {
+        perror("getrusage");
         exit(1);
     }
+    unsigned long long window_overruns = 0;
+
+    size_t counter = 0;
+    do {
+        uint64_t exp = wait_next(&b);
+        struct timespec now;
+        now_or_die(&now, "clock_gettime: loop");
+
+        /* offset is measured against the latest expiration */
+        b.overruns += exp - 1;
+        timespec_add(&b.deadline, (exp - 1) * b.period);
+        long long delta = delta_ns(&now, &b.deadline);
+        timespec_add(&b.deadline, b.period);
+        if(b.mode == MODE_NANOSLEEP || b.mode == MODE_SPIN) {
+            /* same as timerfd: skip deadlines already in the past */
+            while(delta_ns(&now, &b.deadline) >= 0) {
+                timespec_add(&b.deadline, b.period);
+                ++b.overruns;
+            }
+        }
+
+        long long length = 0;
+        if(prev.tv_sec == 0 && prev.tv_nsec == 0) {
+            length = b.period;
+        } else {
+            length = delta_ns(&now, &prev);
+        }
+        /* printf("%ld.%09ld: Mismatch: %lld ns; interval: %lld ns\n", */
+        /*        now.tv_sec, now.tv_nsec, delta, length); */
+        prev = now;
+
+        hist_record(&length_h[0], length);
+        hist_record(&offset_h[0], delta);
+        ++counter;
+        if(counter % opts.window == 0) {
+            struct rusage ru;
+            if(getrusage(RUSAGE_SELF, &ru) < 0) {
+                perror("getrusage");
+                exit(1);
+            }
+            long long wall = delta_ns(&now, &window_start);
+            long long cpu = rusage_ns(&ru) - rusage_ns(&window_ru);
+            printf("Window %zd intervals (%zd total) - cpu: %.1f%%, %lld ns/wakeup, "
+                   "switches: %ld voluntary %ld involuntary, overruns: %llu\n",
+                   opts.window, counter,
+                   wall > 0 ? 100.0 * cpu / wall : 0.0, cpu / (long long)opts.window,
+                   ru.ru_nvcsw - window_ru.ru_nvcsw, ru.ru_nivcsw - window_ru.ru_nivcsw,
+                   b.overruns - window_overruns);
+            if(opts.metrics != NULL) {
+                metrics_update(&metrics, counter, b.overruns, &ru, &length_h[0], &offset_h[0]);
+            }
+            hist_report("  period", &length_h[0], &length_h[1]);
+            hist_report("  offset", &offset_h[0], &offset_h[1]);
+
+            window_start = now;
+            window_ru = ru;
+            window_overruns = b.overruns;
+        }
+    } while(1);
+
+    teardown(&b);
+    if(opts.metrics != NULL) {
+        metrics_close(&metrics);
+    }
     return 0;
 }
@@ -0,0 +1,176 @@
+#ifndef TIMER_HEAP_H
+#define TIMER_HEAP_H
+
+/*
+ * Many deadlines over a single timerfd.
+ *
+ * Timers are small integer ids ordered by deadline in a 4-ary min-heap:
+ * half the depth of a binary heap and a node's children share a cache
+ * line. The timerfd is kept armed (TFD_TIMER_ABSTIME) at the earliest
+ * deadline and timerfd_settime() is only called when that changes, so a
+ * batch of expirations costs one read() and at most one re-arm, however
+ * many timers there are. Functions return 0 or -errno and never exit.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/timerfd.h>
+
+#define TIMER_HEAP_ARITY 4
+#define TIMER_HEAP_IDLE UINT32_MAX
+
+struct timer_heap {
+    int fd;             /* TFD_NONBLOCK timerfd, poll it for EPOLLIN */
+    clockid_t clock;
+    uint32_t count;
+    uint32_t capacity;  /* ids are [0, capacity) */
+    uint32_t* heap;     /* ids, heap[0] has the earliest deadline */
+    uint32_t* pos;      /* per id: index into heap or TIMER_HEAP_IDLE */
+    int64_t* deadline;  /* per id, ns of clock */
+    int64_t armed;      /* deadline the timerfd is set to, 0 if disarmed */
+};
+
+static inline int timer_heap_init(struct timer_heap* h, uint32_t capacity, clockid_t clock) {
+    h->clock = clock;
+    h->count = 0;
+    h->capacity = capacity;
+    h->armed = 0;
+    h->heap = malloc(capacity * sizeof(*h->heap));
+    h->pos = malloc(capacity * sizeof(*h->pos));
+    h->deadline = malloc(capacity * sizeof(*h->deadline));
+    if(h->heap == NULL || h->pos == NULL || h->deadline == NULL) {
+        return -ENOMEM;
+    }
+    for(uint32_t id = 0; id < capacity; ++id) {
+        h->pos[id] = TIMER_HEAP_IDLE;
+    }
+    h->fd = timerfd_create(clock, TFD_NONBLOCK | TFD_CLOEXEC);
+    return h->fd < 0 ? -errno : 0;
+}
+
+static inline void timer_heap_free(struct timer_heap* h) {
+    if(h->fd >= 0) {
+        close(h->fd);
+    }
+    free(h->deadline);
+    free(h->pos);
+    free(h->heap);
+}
+
+static inline void timer_heap_place(struct timer_heap* h, uint32_t idx, uint32_t id) {
+    h->heap[idx] = id;
+    h->pos[id] = idx;
+}
+
+static inline void timer_heap_up(struct timer_heap* h, uint32_t idx) {
+    uint32_t id = h->heap[idx];
+    while(idx > 0) {
+        uint32_t parent = (idx - 1) / TIMER_HEAP_ARITY;
+        if(h->deadline[h->heap[parent]] <= h->deadline[id]) {
+            break;
+        }
+        timer_heap_place(h, idx, h->heap[parent]);
+        idx = parent;
+    }
+    timer_heap_place(h, idx, id);
+}
+
+static inline void timer_heap_down(struct timer_heap* h, uint32_t idx) {
+    uint32_t id = h->heap[idx];
+    while(1) {
+        uint32_t first = idx * TIMER_HEAP_ARITY + 1;
+        if(first >= h->count) {
+            break;
+        }
+        uint32_t last = first + TIMER_HEAP_ARITY < h->count ? first + TIMER_HEAP_ARITY : h->count;
+        uint32_t min = first;
+        for(uint32_t c = first + 1; c < last; ++c) {
+            if(h->deadline[h->heap[c]] < h->deadline[h->heap[min]]) {
+                min = c;
+            }
+        }
+        if(h->deadline[h->heap[min]] >= h->deadline[id]) {
+            break;
+        }
+        timer_heap_place(h, idx, h->heap[min]);
+        idx = min;
+    }
+    timer_heap_place(h, idx, id);
+}
+
+/* (re)schedules id at deadline, takes effect on the next timer_heap_arm() */
+static inline void timer_heap_schedule(struct timer_heap* h, uint32_t id, int64_t deadline) {
+    if(h->pos[id] == TIMER_HEAP_IDLE) {
+        h->deadline[id] = deadline;
+        timer_heap_place(h, h->count++, id);
+        timer_heap_up(h, h->pos[id]);
+        return;
+    }
+    int64_t prev = h->deadline[id];
+    h->deadline[id] = deadline;
+    if(deadline < prev) {
+        timer_heap_up(h, h->pos[id]);
+    } else {
+        timer_heap_down(h, h->pos[id]);
+    }
+}
+
+static inline void timer_heap_cancel(struct timer_heap* h, uint32_t id) {
+    uint32_t idx = h->pos[id];
+    if(idx == TIMER_HEAP_IDLE) {
+        return;
+    }
+    h->pos[id] = TIMER_HEAP_IDLE;
+    uint32_t last = h->heap[--h->count];
+    if(idx == h->count) {
+        return;
+    }
+    timer_heap_place(h, idx, last);
+    timer_heap_up(h, idx);
+    timer_heap_down(h, h->pos[last]);
+}
+
+/*
+ * Earliest timer if it is due at now, TIMER_HEAP_IDLE otherwise. The timer
+ * stays scheduled: the caller reschedules it (periodic) or cancels it.
+ */
+static inline uint32_t timer_heap_due(const struct timer_heap* h, int64_t now) {
+    if(h->count == 0 || h->deadline[h->heap[0]] > now) {
+        return TIMER_HEAP_IDLE;
+    }
+    return h->heap[0];
+}
+
+/* points the timerfd at the earliest deadline, a syscall only if it moved */
+static inline int timer_heap_arm(struct timer_heap* h) {
+    int64_t next = h->count > 0 ? h->deadline[h->heap[0]] : 0;
+    if(next == h->armed) {
+        return 0;
+    }
+    struct itimerspec value;
+    value.it_interval.tv_sec = 0;
+    value.it_interval.tv_nsec = 0;
+    value.it_value.tv_sec = next / 1000000000;
+    value.it_value.tv_nsec = next % 1000000000;
+    if(timerfd_settime(h->fd, TFD_TIMER_ABSTIME, &value, NULL) < 0) {
+        return -errno;
+    }
+    h->armed = next;
+    return 0;
+}
+
+/* clears the timerfd readiness: 1 if it had fired, 0 if not */
+static inline int timer_heap_ack(struct timer_heap* h) {
+    uint64_t exp;
+    if(read(h->fd, &exp, sizeof(exp)) != sizeof(exp)) {
+        return errno == EAGAIN ? 0 : -errno;
+    }
+    h->armed = 0; /* one-shot, fired */
+    return 1;
+}
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * Binary per-packet trace kept in a preallocated, mmap()ed file used as a
+ * ring buffer. Appending a record is a couple of stores into the shared
+ * mapping, no syscalls; the kernel writes pages back on its own. head
+ * counts records ever written, so a reader knows which part of the ring
+ * is valid after wrap-around. trace_reader converts the file to CSV.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+#define TRACE_MAGIC 0x45435254 /* "TRCE" */
+#define TRACE_VERSION 1
+#define TRACE_RECORDS (1 << 20) /* default capacity, 64 MiB */
+
+enum trace_source {
+    TRACE_UDP_RX, /* user time is after recvmsg(), latency = user - kernel */
+    TRACE_TCP_TX  /* user time is before send(), latency = kernel - user */
+};
+
+struct trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t source;
+    uint64_t capacity; /* power of two */
+    _Atomic uint64_t head;
+    uint8_t reserved[32];
+};
+
+/* all times are CLOCK_REALTIME ns, 0 if the kernel didn't provide one */
+struct trace_record {
+    uint64_t id;    /* dgram sequence or SOF_TIMESTAMPING_OPT_ID */
+    uint32_t stage; /* SCM_TSTAMP_* for TCP, 0 for UDP */
+    uint32_t reserved;
+    int64_t user_ns;
+    int64_t timestampns_ns;
+    int64_t timestamping_ns[3];
+    int64_t reserved2;
+};
+
+_Static_assert(sizeof(struct trace_header) == 64, "trace header must fill a cache line");
+_Static_assert(sizeof(struct trace_record) == 64, "trace record must fill a cache line");
+
+struct trace {
+    int fd;
+    size_t size;
+    struct trace_header* header;
+    struct trace_record* records;
+    uint64_t head;
+};
+
+static inline int64_t trace_ns(const struct timespec* ts) {
+    return 1000000000ll*ts->tv_sec + ts->tv_nsec;
+}
+
+/* capacity must be a power of two */
+static inline int trace_open(struct trace* t, const char* path, uint64_t capacity, uint32_t source) {
+    memset(t, 0, sizeof(*t));
+    t->size = sizeof(struct trace_header) + capacity * sizeof(struct trace_record);
+    t->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(t->fd < 0) {
+        return -errno;
+    }
+    int err = posix_fallocate(t->fd, 0, t->size);
+    if(err != 0) {
+        return -err;
+    }
+    void* base = mmap(NULL, t->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, t->fd, 0);
+    if(base == MAP_FAILED) {
+        return -errno;
+    }
+    t->header = base;
+    t->records = (struct trace_record*)(t->header + 1);
+    t->header->magic = TRACE_MAGIC;
+    t->header->version = TRACE_VERSION;
+    t->header->record_size = sizeof(struct trace_record);
+    t->header->source = source;
+    t->header->capacity = capacity;
+    atomic_store_explicit(&t->header->head, 0, memory_order_release);
+    return 0;
+}
+
+/* slot for the next record, visible to readers after trace_commit() */
+static inline struct trace_record* trace_next(struct trace* t) {
+    return &t->records[t->head & (t->header->capacity - 1)];
+}
+
+static inline void trace_commit(struct trace* t) {
+    atomic_store_explicit(&t->header->head, ++t->head, memory_order_release);
+}
+
+static inline void trace_close(struct trace* t) {
+    msync(t->header, t->size, MS_SYNC);
+    munmap(t->header, t->size);
+    close(t->fd);
+}
+
+#endif
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <error.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+#define ENFORCE(condition, report) \
+    do {                                        \
+        if(!(condition)) {                      \
+            report;                             \
+            exit(1);                            \
+        }                                       \
+    } while(0)                                  \
+
+
+#define ENFORCE_ERRNO(condition, message)       \
+    ENFORCE((condition >= 0), perror(message))  \
+
+#define ENFORCE_CUSTOM(condition, ...)                            \
+    ENFORCE((condition), fprintf(stderr, __VA_ARGS__))            \
+
+#define STAGES 3
+
+static const char* tcp_stages[STAGES] = {
+    "SCM_TSTAMP_SND", "SCM_TSTAMP_SCHED", "SCM_TSTAMP_ACK"
+};
+
+static const char* stage_name(uint32_t source, uint32_t stage) {
+    if(source == TRACE_UDP_RX) {
+        return "RX";
+    }
+    return stage < STAGES ? tcp_stages[stage] : "unknown";
+}
+
+/* kernel timestamp of the record, SCM_TIMESTAMPING preferred */
+static int64_t kernel_ns(const struct trace_record* r) {
+    return r->timestamping_ns[0] != 0 ? r->timestamping_ns[0] : r->timestampns_ns;
+}
+
+static int64_t latency_ns(uint32_t source, const struct trace_record* r) {
+    return source == TRACE_UDP_RX ? r->user_ns - kernel_ns(r) : kernel_ns(r) - r->user_ns;
+}
+
+static int compare(const void* lhs, const void* rhs) {
+    int64_t l = *(const int64_t*)lhs;
+    int64_t r = *(const int64_t*)rhs;
+    return (l > r) - (l < r);
+}
+
+static int64_t percentile(const int64_t* sorted, size_t count, double q) {
+    size_t idx = q * count;
+    return sorted[idx < count ? idx : count - 1];
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,
+            "usage: %s [-c] trace\n"
+            "  -c  dump records as CSV instead of printing percentiles\n",
+            name);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    int csv = 0;
+
+    int opt;
+    while((opt = getopt(argc, argv, "ch")) != -1) {
+        switch(opt) {
+            case 'c':
+                csv = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(optind + 1 != argc) {
+        usage(argv[0]);
+    }
+    const char* path = argv[optind];
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ENFORCE_ERRNO(fd, path);
+    struct stat st;
+    ENFORCE_ERRNO(fstat(fd, &st), "fstat");
+    ENFORCE_CUSTOM((size_t)st.st_size >= sizeof(struct trace_header), "%s: too short\n", path);
+
+    void* base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ENFORCE_CUSTOM(base != MAP_FAILED, "mmap: %s\n", path);
+    const struct trace_header* header = base;
+    ENFORCE_CUSTOM(header->magic == TRACE_MAGIC, "%s: not a trace\n", path);
+    ENFORCE_CUSTOM(header->version == TRACE_VERSION, "%s: unsupported version %u\n", path, header->version);
+    ENFORCE_CUSTOM(header->record_size == sizeof(struct trace_record),
+                   "%s: unexpected record size %u\n", path, header->record_size);
+    ENFORCE_CUSTOM(sizeof(*header) + header->capacity * sizeof(struct trace_record) <= (size_t)st.st_size,
+                   "%s: truncated\n", path);
+
+    const struct trace_record* records = (const struct trace_record*)(header + 1);
+    uint64_t head = atomic_load_explicit((_Atomic uint64_t*)&header->head, memory_order_acquire);
+    uint64_t first = head > header->capacity ? head - header->capacity : 0;
+
+    if(csv) {
+        printf("id,stage,user_ns,timestampns_ns,timestamping0_ns,timestamping1_ns,timestamping2_ns,latency_ns\n");
+        for(uint64_t i = first; i < head; ++i) {
+            const struct trace_record* r = &records[i & (header->capacity - 1)];
+            printf("%llu,%s,%lld,%lld,%lld,%lld,%lld,%lld\n",
+                   (unsigned long long)r->id, stage_name(header->source, r->stage),
+                   (long long)r->user_ns, (long long)r->timestampns_ns,
+                   (long long)r->timestamping_ns[0], (long long)r->timestamping_ns[1],
+                   (long long)r->timestamping_ns[2], (long long)latency_ns(header->source, r));
+        }
+    } else {
+        int64_t* samples[STAGES];
+        size_t counts[STAGES];
+        for(size_t s = 0; s < STAGES; ++s) {
+            samples[s] = malloc((head - first) * sizeof(int64_t) + 1);
+            ENFORCE_CUSTOM(samples[s] != NULL, "unable to allocate samples\n");
+            counts[s] = 0;
+        }
+        for(uint64_t i = first; i < head; ++i) {
+            const struct trace_record* r = &records[i & (header->capacity - 1)];
+            if(r->stage < STAGES && kernel_ns(r) != 0) {
+                samples[r->stage][counts[r->stage]++] = latency_ns(header->source, r);
+            }
+        }
+
+        printf("%s: %llu records (%llu written, capacity %llu)\n", path,
+               (unsigned long long)(head - first), (unsigned long long)head,
+               (unsigned long long)header->capacity);
+        for(size_t s = 0; s < STAGES; ++s) {
+            size_t n = counts[s];
+            if(n == 0) {
+                continue;
+            }
+            qsort(samples[s], n, sizeof(int64_t), compare);
+            long double sum = 0;
+            for(size_t i = 0; i < n; ++i) {
+                sum += samples[s][i];
+            }
+            printf("  %-16s: n %zd min %lld p50 %lld p90 %lld p99 %lld p99.9 %lld max %lld avg %.0Lf ns\n",
+                   stage_name(header->source, s), n, (long long)samples[s][0],
+                   (long long)percentile(samples[s], n, 0.5),
+                   (long long)percentile(samples[s], n, 0.9),
+                   (long long)percentile(samples[s], n, 0.99),
+                   (long long)percentile(samples[s], n, 0.999),
+                   (long long)samples[s][n - 1], sum / n);
+        }
+        for(size_t s = 0; s < STAGES; ++s) {
+            free(samples[s]);
+        }
+    }
+
+    ENFORCE_ERRNO(munmap(base, st.st_size), "munmap");
+    ENFORCE_ERRNO(close(fd), "close");
+    return 0;
+}
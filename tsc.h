@@ -0,0 +1,227 @@
+#ifndef TSC_H
+#define TSC_H
+
+/*
+ * Calibrated CPU counter as a cheaper CLOCK_REALTIME.
+ *
+ * The hot path reads raw ticks (rdtscp on x86, the generic timer on
+ * aarch64) into a stamp; stamps become CLOCK_REALTIME ns only when a sample
+ * is recorded against a kernel timestamp or reported. The tick rate is
+ * measured against clock_gettime() at startup and refined by
+ * tsc_recalibrate() over a growing baseline, so NTP slewing is followed.
+ * Without a usable counter tsc_init() fails and the same API hands out
+ * CLOCK_REALTIME ns instead, callers need no second code path.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define TSC_NAME "rdtscp"
+#elif defined(__aarch64__)
+#define TSC_NAME "cntvct_el0"
+#else
+#define TSC_NAME "none"
+#endif
+
+#define TSC_CALIBRATE_NS 20000000ll    /* initial calibration, 20 ms */
+#define TSC_RECALIBRATE_NS 1000000000ll /* at most one correction per second */
+#define TSC_STEP_NS 1000000ll          /* larger errors mean the clock was set, restart */
+#define TSC_PAIR_TRIES 16
+#define TSC_OVERHEAD_CALLS 100000
+
+struct tsc {
+    int enabled;        /* 0: stamps are CLOCK_REALTIME ns */
+    double ns_per_tick;
+    uint64_t tsc;       /* anchor: ticks ... */
+    int64_t ns;         /* ... and CLOCK_REALTIME at the same moment */
+    uint64_t base_tsc;  /* start of the calibration baseline */
+    int64_t base_ns;
+    int64_t drift_ns;   /* error found by the last correction */
+    uint64_t corrections;
+};
+
+static inline int64_t tsc_realtime_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return 1000000000ll*now.tv_sec + now.tv_nsec;
+}
+
+static inline uint64_t tsc_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned aux;
+    return __rdtscp(&aux);
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r"(ticks) :: "memory");
+    return ticks;
+#else
+    return 0;
+#endif
+}
+
+/* constant rate, not stopped in deep C-states, safe to compare across cpus */
+static inline int tsc_invariant(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned eax, ebx, ecx, edx;
+    if(!__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) || (edx & (1u << 27)) == 0) {
+        return 0; /* no rdtscp */
+    }
+    if(!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    return (edx & (1u << 8)) != 0;
+#elif defined(__aarch64__)
+    return 1; /* the generic timer is architecturally fixed frequency */
+#else
+    return 0;
+#endif
+}
+
+/* (ticks, ns) taken as close together as possible: tightest of a few tries */
+static inline void tsc_pair(uint64_t* ticks, int64_t* ns) {
+    uint64_t best = UINT64_MAX;
+    for(int i = 0; i < TSC_PAIR_TRIES; ++i) {
+        uint64_t before = tsc_ticks();
+        int64_t now = tsc_realtime_ns();
+        uint64_t after = tsc_ticks();
+        if(after - before < best) {
+            best = after - before;
+            *ticks = before + (after - before) / 2;
+            *ns = now;
+        }
+    }
+}
+
+/* stamps are plain CLOCK_REALTIME ns */
+static inline void tsc_init_realtime(struct tsc* c) {
+    memset(c, 0, sizeof(*c));
+    c->ns_per_tick = 1.0;
+}
+
+/* spins for TSC_CALIBRATE_NS, 0 or -ENOTSUP (c stays usable as a fallback) */
+static inline int tsc_init(struct tsc* c) {
+    tsc_init_realtime(c);
+    if(!tsc_invariant()) {
+        return -ENOTSUP;
+    }
+    tsc_pair(&c->base_tsc, &c->base_ns);
+    uint64_t ticks = 0;
+    int64_t ns = 0;
+    do {
+        tsc_pair(&ticks, &ns);
+    } while(ns - c->base_ns < TSC_CALIBRATE_NS);
+    if(ticks <= c->base_tsc) {
+        return -ENOTSUP;
+    }
+    c->ns_per_tick = (double)(ns - c->base_ns) / (ticks - c->base_tsc);
+    c->tsc = ticks;
+    c->ns = ns;
+    c->enabled = 1;
+    return 0;
+}
+
+static inline uint64_t tsc_read(const struct tsc* c) {
+    return c->enabled ? tsc_ticks() : (uint64_t)tsc_realtime_ns();
+}
+
+/* stamp to CLOCK_REALTIME ns */
+static inline int64_t tsc_ns(const struct tsc* c, uint64_t stamp) {
+    if(!c->enabled) {
+        return (int64_t)stamp;
+    }
+    return c->ns + (int64_t)((double)(int64_t)(stamp - c->tsc) * c->ns_per_tick);
+}
+
+/* difference of two stamps to ns */
+static inline int64_t tsc_delta_ns(const struct tsc* c, uint64_t later, uint64_t earlier) {
+    return c->enabled ? (int64_t)((double)(int64_t)(later - earlier) * c->ns_per_tick)
+                      : (int64_t)(later - earlier);
+}
+
+static inline void tsc_timespec(const struct tsc* c, uint64_t stamp, struct timespec* ts) {
+    int64_t ns = tsc_ns(c, stamp);
+    ts->tv_sec = ns / 1000000000;
+    ts->tv_nsec = ns % 1000000000;
+}
+
+/*
+ * Drift correction, cheap to call often: does nothing until
+ * TSC_RECALIBRATE_NS has passed since the last anchor. Stamps taken before
+ * and converted after a correction are off by at most drift_ns.
+ * Returns 1 if a correction was made.
+ */
+static inline int tsc_recalibrate(struct tsc* c) {
+    if(!c->enabled) {
+        return 0;
+    }
+    uint64_t now = tsc_ticks();
+    if(tsc_delta_ns(c, now, c->tsc) < TSC_RECALIBRATE_NS) {
+        return 0;
+    }
+    uint64_t ticks = 0;
+    int64_t ns = 0;
+    tsc_pair(&ticks, &ns);
+    c->drift_ns = ns - tsc_ns(c, ticks);
+    if(c->drift_ns > TSC_STEP_NS || c->drift_ns < -TSC_STEP_NS) {
+        /* CLOCK_REALTIME was stepped, the old baseline is useless */
+        c->base_tsc = c->tsc;
+        c->base_ns = c->ns + c->drift_ns;
+    }
+    if(ticks > c->base_tsc) {
+        c->ns_per_tick = (double)(ns - c->base_ns) / (ticks - c->base_tsc);
+    }
+    c->tsc = ticks;
+    c->ns = ns;
+    ++c->corrections;
+    return 1;
+}
+
+static inline double tsc_overhead_clock(clockid_t id) {
+    struct timespec ts;
+    int64_t start = tsc_realtime_ns();
+    for(int i = 0; i < TSC_OVERHEAD_CALLS; ++i) {
+        clock_gettime(id, &ts);
+        __asm__ __volatile__("" ::: "memory");
+    }
+    return (double)(tsc_realtime_ns() - start) / TSC_OVERHEAD_CALLS;
+}
+
+static inline double tsc_overhead_ticks(void) {
+    int64_t start = tsc_realtime_ns();
+    for(int i = 0; i < TSC_OVERHEAD_CALLS; ++i) {
+        uint64_t ticks = tsc_ticks();
+        __asm__ __volatile__("" :: "r"(ticks) : "memory");
+    }
+    return (double)(tsc_realtime_ns() - start) / TSC_OVERHEAD_CALLS;
+}
+
+/* cost of one read of every clock source, plus what the kernel uses behind the vDSO */
+static inline void tsc_print_overhead(const struct tsc* c) {
+    char source[64] = "unknown";
+    FILE* f = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "r");
+    if(f != NULL) {
+        if(fgets(source, sizeof(source), f) != NULL) {
+            source[strcspn(source, "\n")] = '\0';
+        }
+        fclose(f);
+    }
+    printf("Clock overhead: CLOCK_REALTIME %.1f ns, CLOCK_MONOTONIC %.1f ns",
+           tsc_overhead_clock(CLOCK_REALTIME), tsc_overhead_clock(CLOCK_MONOTONIC));
+    if(tsc_invariant()) {
+        printf(", %s %.1f ns", TSC_NAME, tsc_overhead_ticks());
+    } else {
+        printf(", %s unusable (no invariant counter)", TSC_NAME);
+    }
+    printf(" (kernel clocksource %s)\n", source);
+    if(c->enabled) {
+        printf("Timing with %s: %.3f MHz\n", TSC_NAME, 1e3 / c->ns_per_tick);
+    }
+}
+
+#endif
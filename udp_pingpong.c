@@ -0,0 +1,668 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <error.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+#include "histogram.h"
+#include "dgram.h"
+
+#define ENFORCE(condition, report) \
+    do {                                        \
+        if(!(condition)) {                      \
+            report;                             \
+            exit(1);                            \
+        }                                       \
+    } while(0)                                  \
+
+
+#define ENFORCE_ERRNO(condition, message)       \
+    ENFORCE((condition >= 0), perror(message))  \
+
+#define ENFORCE_CUSTOM(condition, ...)                            \
+    ENFORCE((condition), fprintf(stderr, __VA_ARGS__))            \
+
+#define ENABLE 1
+#define DISABLE 0
+
+/* next to udp_timestamping's PORT, so both can run at once */
+#define PONG_PORT 10001
+
+#define DGRAM_MAX_SIZE 65507
+
+#define AVG_WINDOW 1000
+#define MAX_EVENTS 16
+
+/* round trips in flight, a slot is reused ROUNDS requests later */
+#define ROUNDS 4096
+/* closed loop: give up on a request after this long */
+#define ROUND_TIMEOUT 1000 /* ms */
+
+/*
+ * Four-point breakdown of one round trip, every part taken on a single
+ * host's clock so client and reflector need not be synchronized:
+ *   client stack  user send -> SND + kernel RX -> user
+ *   wire          (client RX - client SND) - (reflector TX - reflector RX)
+ *   server stack  kernel RX -> user + user send -> TX
+ *   server app    user after recvmsg() -> user before sendmsg()
+ * The parts add up to the round trip time.
+ */
+enum metric {
+    RTT,
+    CLIENT_SCHED, /* user send to SCHED, part of the client stack */
+    CLIENT_STACK,
+    WIRE,
+    SERVER_STACK,
+    SERVER_APP,
+    METRICS
+};
+
+static const char* metrics[METRICS] = {
+    "rtt         ", "client sched", "client stack", "wire        ", "server stack", "server app  "
+};
+
+enum piece {
+    HAVE_SCHED = 1 << 0,
+    HAVE_SND = 1 << 1,
+    HAVE_REPLY = 1 << 2,
+    HAVE_SERVER_TX = 1 << 3,
+    HAVE_ALL = (1 << 4) - 1
+};
+
+/* what process_reply() read */
+enum reply_kind {
+    REPLY_NONE,   /* nothing left to read */
+    REPLY_OTHER,  /* unmatched, another session or an older request */
+    REPLY_LATEST  /* the reply to the request sent last */
+};
+
+/* all CLOCK_REALTIME ns, client or reflector side as named */
+struct round {
+    uint64_t seq;
+    int pending; /* sent, breakdown not recorded yet */
+    uint32_t have;
+    int64_t send_ns;
+    int64_t sched_ns;
+    int64_t snd_ns;
+    int64_t rx_ns;
+    int64_t rx_user_ns;
+    int64_t server_rx_ns;
+    int64_t server_rx_user_ns;
+    int64_t server_send_ns;
+    int64_t server_tx_ns;
+};
+
+struct options {
+    int reflect;
+    const char* host;
+    long rate;
+    size_t size;
+    long window;
+};
+
+/* [0] - current window, [1] - cumulative */
+struct client {
+    int udp;
+    char* payload;
+    size_t size;
+    long window;
+    struct dgram_header header;
+    uint64_t replies;
+    uint64_t lost;       /* no reply before the slot was reused */
+    uint64_t incomplete; /* reply came back, but a TX timestamp never did */
+    uint64_t unmatched;  /* replies and timestamps for unknown rounds */
+    struct round rounds[ROUNDS];
+    struct histogram hist[METRICS][2];
+    struct timespec started; /* CLOCK_MONOTONIC at the start of the current window */
+};
+
+/* reflector: who each sendmsg() answered, matched with its TX timestamp */
+struct reply {
+    uint32_t session;
+    uint64_t seq;
+    int64_t send_ns;
+};
+
+struct reflector {
+    int udp;
+    char* payload;
+    long window;
+    uint64_t sent;       /* OPT_ID counts these */
+    uint32_t tx_session; /* latest TX timestamp, carried by the next reply to that session */
+    uint64_t tx_seq;
+    int64_t tx_ns;
+    struct reply replies[ROUNDS];
+    struct histogram rx_stack[2];
+    struct histogram app[2];
+    struct histogram tx_stack[2];
+    struct timespec started;
+};
+
+static inline long delta_ns(const struct timespec* lhs, const struct timespec* rhs) {
+    return 1000000000*(lhs->tv_sec - rhs->tv_sec) + (lhs->tv_nsec - rhs->tv_nsec);
+}
+
+static inline int64_t timespec_ns(const struct timespec* ts) {
+    return 1000000000ll*ts->tv_sec + ts->tv_nsec;
+}
+
+static int64_t now_ns(const char* message) {
+    struct timespec now;
+    ENFORCE_ERRNO(clock_gettime(CLOCK_REALTIME, &now), message);
+    return timespec_ns(&now);
+}
+
+/* OPT_ID is 32 bits, reconstruct the full counter given the next one */
+static inline uint64_t widen_id(uint32_t id, uint64_t next) {
+    uint64_t full = (next & ~(uint64_t)UINT32_MAX) | id;
+    if(full >= next) {
+        full -= (uint64_t)1 << 32;
+    }
+    return full;
+}
+
+/*
+ * Reads one TX timestamp off the errqueue: 0 when it's empty, otherwise 1
+ * with the OPT_ID key, the SCM_TSTAMP_* stage and the software timestamp.
+ */
+static int read_errqueue(int udp, uint32_t* id, uint32_t* stage, int64_t* tx_ns) {
+    char control[256];
+    struct msghdr aux;
+    memset(&aux, 0, sizeof(aux));
+    aux.msg_control = control;
+    aux.msg_controllen = sizeof(control);
+
+    ssize_t read = recvmsg(udp, &aux, MSG_ERRQUEUE | MSG_DONTWAIT);
+    if(read < 0 && errno == EAGAIN) {
+        return 0;
+    }
+    ENFORCE_ERRNO(read, "recvmsg: errqueue");
+    ENFORCE_CUSTOM((aux.msg_flags & MSG_CTRUNC) == 0, "cmsg truncated\n");
+
+    int have_id = 0;
+    *tx_ns = 0;
+    for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&aux);
+        cmsg != NULL;
+        cmsg = CMSG_NXTHDR(&aux, cmsg)) {
+        struct sock_extended_err* err;
+        switch(cmsg->cmsg_type) {
+            case SCM_TIMESTAMPING:
+                *tx_ns = timespec_ns(&((struct scm_timestamping*)CMSG_DATA(cmsg))->ts[0]);
+                break;
+            case IP_RECVERR:
+                err = (struct sock_extended_err*)CMSG_DATA(cmsg);
+                ENFORCE_CUSTOM(err->ee_errno == ENOMSG,
+                               "Unexpected errno: %d wants: %d\n", err->ee_errno, ENOMSG);
+                ENFORCE_CUSTOM(err->ee_origin == SO_EE_ORIGIN_TIMESTAMPING,
+                               "Unexpected origin: %d wants: %d\n", err->ee_origin, SO_EE_ORIGIN_TIMESTAMPING);
+                *id = err->ee_data;
+                *stage = err->ee_info;
+                have_id = 1;
+                break;
+            default:
+                ENFORCE_CUSTOM(0, "unexpected control message type: %d\n", cmsg->cmsg_type);
+        }
+    }
+    ENFORCE_CUSTOM(have_id, "timestamp without IP_RECVERR\n");
+    return 1;
+}
+
+/* recvmsg() with the SCM_TIMESTAMPING RX software timestamp, 0 if none */
+static ssize_t read_dgram(int udp, char* buf, size_t size, int flags, struct sockaddr_in* remote,
+                          int64_t* rx_ns, int64_t* rx_user_ns) {
+    char control[256];
+    struct iovec data;
+    data.iov_base = buf;
+    data.iov_len = size;
+    struct msghdr aux;
+    memset(&aux, 0, sizeof(aux));
+    aux.msg_name = remote;
+    aux.msg_namelen = remote != NULL ? sizeof(*remote) : 0;
+    aux.msg_iov = &data;
+    aux.msg_iovlen = 1;
+    aux.msg_control = control;
+    aux.msg_controllen = sizeof(control);
+
+    ssize_t read = recvmsg(udp, &aux, flags);
+    if(read < 0) {
+        return read;
+    }
+    *rx_user_ns = now_ns("clock_gettime: rx");
+    ENFORCE_CUSTOM((aux.msg_flags & MSG_CTRUNC) == 0, "cmsg truncated\n");
+    ENFORCE_CUSTOM((aux.msg_flags & MSG_TRUNC) == 0, "dgram truncated\n");
+
+    *rx_ns = 0;
+    for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&aux);
+        cmsg != NULL;
+        cmsg = CMSG_NXTHDR(&aux, cmsg)) {
+        ENFORCE_CUSTOM(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING,
+                       "unexpected control message: %d/%d\n", cmsg->cmsg_level, cmsg->cmsg_type);
+        *rx_ns = timespec_ns(&((struct scm_timestamping*)CMSG_DATA(cmsg))->ts[0]);
+    }
+    return read;
+}
+
+static int open_socket(int tx_sched) {
+    int udp = socket(AF_INET, SOCK_DGRAM, 0);
+    ENFORCE_ERRNO(udp, "socket: udp");
+
+    int flags = DISABLE
+            | SOF_TIMESTAMPING_RX_SOFTWARE
+            | SOF_TIMESTAMPING_TX_SOFTWARE
+            | SOF_TIMESTAMPING_SOFTWARE
+            | SOF_TIMESTAMPING_OPT_ID
+            | SOF_TIMESTAMPING_OPT_TSONLY
+            ;
+    if(tx_sched) {
+        flags |= SOF_TIMESTAMPING_TX_SCHED;
+    }
+    ENFORCE_ERRNO(setsockopt(udp, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)),
+                  "setsockopt: SO_TIMESTAMPING");
+    return udp;
+}
+
+static void report_client(struct client* c) {
+    struct timespec mono;
+    ENFORCE_ERRNO(clock_gettime(CLOCK_MONOTONIC, &mono), "clock_gettime: report");
+    long elapsed = delta_ns(&mono, &c->started);
+
+    printf("Window %ld (%llu total) - rate: %.0f rtt/s, replies: %llu, lost: %llu, "
+           "incomplete: %llu, unmatched: %llu\n",
+           c->window, (unsigned long long)c->header.seq,
+           elapsed > 0 ? 1e9 * c->window / elapsed : 0.0,
+           (unsigned long long)c->replies, (unsigned long long)c->lost,
+           (unsigned long long)c->incomplete, (unsigned long long)c->unmatched);
+    for(size_t m = 0; m < METRICS; ++m) {
+        char label[64];
+        snprintf(label, sizeof(label), "  %s", metrics[m]);
+        hist_report(label, &c->hist[m][0], &c->hist[m][1]);
+    }
+    c->started = mono;
+}
+
+static struct round* round_find(struct client* c, uint64_t seq) {
+    struct round* r = &c->rounds[seq % ROUNDS];
+    return r->pending && r->seq == seq ? r : NULL;
+}
+
+/* records the breakdown once every piece of the round trip is in */
+static void round_update(struct client* c, struct round* r, uint32_t piece) {
+    r->have |= piece;
+    if(r->have != HAVE_ALL) {
+        return;
+    }
+    hist_record(&c->hist[RTT][0], r->rx_user_ns - r->send_ns);
+    hist_record(&c->hist[CLIENT_SCHED][0], r->sched_ns - r->send_ns);
+    hist_record(&c->hist[CLIENT_STACK][0], (r->snd_ns - r->send_ns) + (r->rx_user_ns - r->rx_ns));
+    hist_record(&c->hist[WIRE][0], (r->rx_ns - r->snd_ns) - (r->server_tx_ns - r->server_rx_ns));
+    hist_record(&c->hist[SERVER_STACK][0], (r->server_rx_user_ns - r->server_rx_ns) +
+                                           (r->server_tx_ns - r->server_send_ns));
+    hist_record(&c->hist[SERVER_APP][0], r->server_send_ns - r->server_rx_user_ns);
+    r->pending = 0;
+}
+
+static void send_request(struct client* c) {
+    struct round* r = &c->rounds[c->header.seq % ROUNDS];
+    if(r->pending) {
+        /* slot reuse: whatever is still missing is not coming */
+        if((r->have & HAVE_REPLY) == 0) {
+            ++c->lost;
+        } else {
+            ++c->incomplete;
+        }
+    }
+    memset(r, 0, sizeof(*r));
+    r->seq = c->header.seq;
+    r->pending = 1;
+
+    r->send_ns = now_ns("clock_gettime: send");
+    c->header.send_ns = r->send_ns;
+    dgram_encode(c->payload, &c->header);
+    ssize_t sent = send(c->udp, c->payload, c->size, 0);
+    ENFORCE_ERRNO(sent, "send: udp");
+    ENFORCE_CUSTOM((size_t)sent == c->size, "Unable send %zd bytes\n", c->size);
+    ++c->header.seq;
+}
+
+static void process_client_errqueue(struct client* c) {
+    uint32_t id = 0;
+    uint32_t stage = 0;
+    int64_t tx_ns = 0;
+    while(read_errqueue(c->udp, &id, &stage, &tx_ns)) {
+        /* only requests are sent, so OPT_ID is the request sequence */
+        struct round* r = round_find(c, widen_id(id, c->header.seq));
+        if(r == NULL) {
+            ++c->unmatched;
+            continue;
+        }
+        if(stage == SCM_TSTAMP_SCHED) {
+            r->sched_ns = tx_ns;
+            round_update(c, r, HAVE_SCHED);
+        } else if(stage == SCM_TSTAMP_SND) {
+            r->snd_ns = tx_ns;
+            round_update(c, r, HAVE_SND);
+        }
+    }
+}
+
+static enum reply_kind process_reply(struct client* c) {
+    char buf[DGRAM_MAX_SIZE];
+    int64_t rx_ns = 0;
+    int64_t rx_user_ns = 0;
+    ssize_t read = read_dgram(c->udp, buf, sizeof(buf), MSG_DONTWAIT, NULL, &rx_ns, &rx_user_ns);
+    if(read < 0 && errno == EAGAIN) {
+        return REPLY_NONE;
+    }
+    if(read < 0 && errno == ECONNREFUSED) {
+        /* ICMP port unreachable for an earlier request: no reflector yet */
+        return REPLY_NONE;
+    }
+    ENFORCE_ERRNO(read, "recvmsg: udp");
+
+    struct pong_header pong;
+    if(!pong_decode(buf, read, &pong) || pong.dgram.session != c->header.session) {
+        ++c->unmatched;
+        return REPLY_OTHER;
+    }
+    if(pong.dgram.tx_seq != DGRAM_NO_TX) {
+        struct round* tx = round_find(c, pong.dgram.tx_seq);
+        if(tx != NULL) {
+            tx->server_tx_ns = pong.dgram.tx_ns;
+            round_update(c, tx, HAVE_SERVER_TX);
+        }
+    }
+
+    struct round* r = round_find(c, pong.dgram.seq);
+    if(r == NULL || rx_ns == 0) {
+        ++c->unmatched;
+        return REPLY_OTHER;
+    }
+    /* a late reply to a request given up on after ROUND_TIMEOUT is not it, nor a duplicate */
+    int latest = pong.dgram.seq == c->header.seq - 1 && (r->have & HAVE_REPLY) == 0;
+    r->rx_ns = rx_ns;
+    r->rx_user_ns = rx_user_ns;
+    r->server_rx_ns = pong.rx_ns;
+    r->server_rx_user_ns = pong.rx_user_ns;
+    r->server_send_ns = pong.dgram.send_ns;
+    round_update(c, r, HAVE_REPLY);
+
+    ++c->replies;
+    if((c->replies % c->window) == 0) {
+        report_client(c);
+    }
+    return latest ? REPLY_LATEST : REPLY_OTHER;
+}
+
+/*
+ * rate 0: closed loop, the next request goes out as soon as the previous
+ * reply is in (or after ROUND_TIMEOUT). Otherwise requests are paced by a
+ * periodic timerfd regardless of replies.
+ */
+static void run_client(const struct options* opts) {
+    struct client* c = calloc(1, sizeof(*c));
+    ENFORCE_CUSTOM(c != NULL, "unable to allocate client\n");
+    c->udp = open_socket(ENABLE);
+    c->size = opts->size;
+    c->window = opts->window;
+    c->payload = calloc(1, opts->size);
+    ENFORCE_CUSTOM(c->payload != NULL, "unable to allocate payload\n");
+    for(size_t m = 0; m < METRICS; ++m) {
+        hist_reset(&c->hist[m][0]);
+        hist_reset(&c->hist[m][1]);
+    }
+    c->header.magic = DGRAM_MAGIC;
+    c->header.session = getpid() ^ time(NULL);
+    c->header.tx_seq = DGRAM_NO_TX;
+
+    struct sockaddr_in remote;
+    remote.sin_family = AF_INET;
+    remote.sin_port = htons(PONG_PORT);
+    ENFORCE_CUSTOM(inet_pton(AF_INET, opts->host, &remote.sin_addr) == 1,
+                   "invalid address: %s\n", opts->host);
+    ENFORCE_ERRNO(connect(c->udp, (struct sockaddr*)&remote, sizeof(remote)), "connect: udp");
+
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    ENFORCE_ERRNO(epoll, "epoll: create");
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLERR;
+    ev.data.fd = c->udp;
+    ENFORCE_ERRNO(epoll_ctl(epoll, EPOLL_CTL_ADD, c->udp, &ev), "epoll_ctrl: udp");
+
+    int timer = -1;
+    if(opts->rate > 0) {
+        timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        ENFORCE_ERRNO(timer, "timerfd_create");
+        struct itimerspec interval;
+        interval.it_value.tv_sec = 0;
+        interval.it_value.tv_nsec = 1;
+        interval.it_interval.tv_sec = 1 / opts->rate;
+        interval.it_interval.tv_nsec = 1000000000 / opts->rate % 1000000000;
+        ENFORCE_ERRNO(timerfd_settime(timer, 0, &interval, NULL), "timerfd_settime");
+        ev.events = EPOLLIN;
+        ev.data.fd = timer;
+        ENFORCE_ERRNO(epoll_ctl(epoll, EPOLL_CTL_ADD, timer, &ev), "epoll_ctrl: timer");
+    }
+
+    ENFORCE_ERRNO(clock_gettime(CLOCK_MONOTONIC, &c->started), "clock_gettime: started");
+    printf("Ping-pong with %s:%d, %zd byte requests, %s\n", opts->host, PONG_PORT, opts->size,
+           opts->rate > 0 ? "paced" : "closed loop");
+    if(timer < 0) {
+        send_request(c);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while(1) {
+        int fds = epoll_wait(epoll, events, MAX_EVENTS, timer < 0 ? ROUND_TIMEOUT : -1);
+        ENFORCE_ERRNO(fds, "epoll_wait");
+        if(fds == 0) {
+            /* closed loop lost its request, get going again */
+            send_request(c);
+            continue;
+        }
+        for(int i = 0; i < fds; ++i) {
+            if(events[i].data.fd == c->udp) {
+                if((events[i].events & EPOLLERR) != 0) {
+                    process_client_errqueue(c);
+                }
+                if((events[i].events & EPOLLIN) != 0) {
+                    enum reply_kind reply;
+                    while((reply = process_reply(c)) != REPLY_NONE) {
+                        /* closed loop keeps exactly one request in flight */
+                        if(timer < 0 && reply == REPLY_LATEST) {
+                            send_request(c);
+                        }
+                    }
+                }
+            }
+            if(events[i].data.fd == timer && (events[i].events & EPOLLIN) != 0) {
+                uint64_t exp = 0;
+                ENFORCE_CUSTOM(read(timer, &exp, sizeof(exp)) == sizeof(exp), "read: timer");
+                for(uint64_t k = 0; k < exp && k < ROUNDS; ++k) {
+                    send_request(c);
+                }
+            }
+        }
+    }
+
+    if(timer >= 0) {
+        ENFORCE_ERRNO(close(timer), "close: timer");
+    }
+    ENFORCE_ERRNO(close(epoll), "close: epoll");
+    ENFORCE_ERRNO(close(c->udp), "close: udp");
+    free(c->payload);
+    free(c);
+}
+
+static void report_reflector(struct reflector* s) {
+    struct timespec mono;
+    ENFORCE_ERRNO(clock_gettime(CLOCK_MONOTONIC, &mono), "clock_gettime: report");
+    long elapsed = delta_ns(&mono, &s->started);
+
+    printf("Window %ld (%llu total) - rate: %.0f replies/s\n",
+           s->window, (unsigned long long)s->sent,
+           elapsed > 0 ? 1e9 * s->window / elapsed : 0.0);
+    hist_report("  rx stack    ", &s->rx_stack[0], &s->rx_stack[1]);
+    hist_report("  server app  ", &s->app[0], &s->app[1]);
+    hist_report("  tx stack    ", &s->tx_stack[0], &s->tx_stack[1]);
+    s->started = mono;
+}
+
+static void process_reflector_errqueue(struct reflector* s) {
+    uint32_t id = 0;
+    uint32_t stage = 0;
+    int64_t tx_ns = 0;
+    while(read_errqueue(s->udp, &id, &stage, &tx_ns)) {
+        uint64_t sent = widen_id(id, s->sent);
+        if(s->sent - sent > ROUNDS) {
+            continue;
+        }
+        const struct reply* r = &s->replies[sent % ROUNDS];
+        hist_record(&s->tx_stack[0], tx_ns - r->send_ns);
+        s->tx_session = r->session;
+        s->tx_seq = r->seq;
+        s->tx_ns = tx_ns;
+    }
+}
+
+static void run_reflector(const struct options* opts) {
+    struct reflector* s = calloc(1, sizeof(*s));
+    ENFORCE_CUSTOM(s != NULL, "unable to allocate reflector\n");
+    s->udp = open_socket(DISABLE);
+    s->window = opts->window;
+    s->payload = malloc(DGRAM_MAX_SIZE);
+    ENFORCE_CUSTOM(s->payload != NULL, "unable to allocate payload\n");
+    s->tx_seq = DGRAM_NO_TX;
+    for(size_t i = 0; i < 2; ++i) {
+        hist_reset(&s->rx_stack[i]);
+        hist_reset(&s->app[i]);
+        hist_reset(&s->tx_stack[i]);
+    }
+
+    struct sockaddr_in local;
+    local.sin_family = AF_INET;
+    local.sin_port = htons(PONG_PORT);
+    local.sin_addr.s_addr = INADDR_ANY;
+    ENFORCE_ERRNO(bind(s->udp, (struct sockaddr*)&local, sizeof(local)), "bind: udp");
+
+    ENFORCE_ERRNO(clock_gettime(CLOCK_MONOTONIC, &s->started), "clock_gettime: started");
+    printf("Reflecting on port %d\n", PONG_PORT);
+    while(1) {
+        struct sockaddr_in remote;
+        int64_t rx_ns = 0;
+        int64_t rx_user_ns = 0;
+        ssize_t read = read_dgram(s->udp, s->payload, DGRAM_MAX_SIZE, 0, &remote, &rx_ns, &rx_user_ns);
+        ENFORCE_ERRNO(read, "recvmsg: udp");
+
+        struct pong_header pong;
+        if(!dgram_decode(s->payload, read, &pong.dgram) || (size_t)read < sizeof(pong)) {
+            continue;
+        }
+        hist_record(&s->rx_stack[0], rx_user_ns - rx_ns);
+        /* TX timestamps of earlier replies, the latest one goes with this reply */
+        process_reflector_errqueue(s);
+
+        pong.dgram.magic = PONG_MAGIC;
+        if(s->tx_seq != DGRAM_NO_TX && s->tx_session == pong.dgram.session) {
+            pong.dgram.tx_seq = s->tx_seq;
+            pong.dgram.tx_ns = s->tx_ns;
+        } else {
+            pong.dgram.tx_seq = DGRAM_NO_TX;
+            pong.dgram.tx_ns = 0;
+        }
+        pong.rx_ns = rx_ns;
+        pong.rx_user_ns = rx_user_ns;
+
+        struct reply* r = &s->replies[s->sent % ROUNDS];
+        r->session = pong.dgram.session;
+        r->seq = pong.dgram.seq;
+        r->send_ns = now_ns("clock_gettime: reply");
+        pong.dgram.send_ns = r->send_ns;
+        pong_encode(s->payload, &pong);
+        hist_record(&s->app[0], r->send_ns - rx_user_ns);
+
+        ssize_t sent = sendto(s->udp, s->payload, read, 0, (struct sockaddr*)&remote, sizeof(remote));
+        ENFORCE_ERRNO(sent, "sendto: udp");
+        ++s->sent;
+        if((s->sent % s->window) == 0) {
+            report_reflector(s);
+        }
+    }
+
+    free(s->payload);
+    ENFORCE_ERRNO(close(s->udp), "close: udp");
+    free(s);
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,
+            "usage: %s -S [-w window]\n"
+            "       %s [-a addr] [-r rate] [-s size] [-w window]\n"
+            "  -S         reflect requests back with the reflector's timestamps\n"
+            "  -a addr    reflector IPv4 address (default 127.0.0.1)\n"
+            "  -r rate    requests per second, 0 for closed loop (default 0)\n"
+            "  -s size    request size, %zd..%d (default %zd)\n"
+            "  -w window  round trips per report (default %d)\n",
+            name, name, sizeof(struct pong_header), DGRAM_MAX_SIZE, sizeof(struct pong_header),
+            AVG_WINDOW);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    struct options opts;
+    opts.reflect = DISABLE;
+    opts.host = "127.0.0.1";
+    opts.rate = 0;
+    opts.size = sizeof(struct pong_header);
+    opts.window = AVG_WINDOW;
+
+    int opt;
+    while((opt = getopt(argc, argv, "Sa:r:s:w:h")) != -1) {
+        switch(opt) {
+            case 'S':
+                opts.reflect = ENABLE;
+                break;
+            case 'a':
+                opts.host = optarg;
+                break;
+            case 'r':
+                opts.rate = strtol(optarg, NULL, 0);
+                break;
+            case 's':
+                opts.size = strtoul(optarg, NULL, 0);
+                break;
+            case 'w':
+                opts.window = strtol(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    ENFORCE_CUSTOM(opts.rate >= 0 && opts.rate <= 1000000000, "invalid rate: %ld\n", opts.rate);
+    /* the reply reuses the request, so it must have room for the reflector's fields */
+    ENFORCE_CUSTOM(opts.size >= sizeof(struct pong_header) && opts.size <= DGRAM_MAX_SIZE,
+                   "invalid size: %zd\n", opts.size);
+    ENFORCE_CUSTOM(opts.window > 0, "invalid window: %ld\n", opts.window);
+
+    if(opts.reflect) {
+        run_reflector(&opts);
+    } else {
+        run_client(&opts);
+    }
+    return 0;
+}
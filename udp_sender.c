@@ -0,0 +1,562 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <error.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/timerfd.h>
+
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+#include "histogram.h"
+#include "dgram.h"
+
+#define ENFORCE(condition, report) \
+    do {                                        \
+        if(!(condition)) {                      \
+            report;                             \
+            exit(1);                            \
+        }                                       \
+    } while(0)                                  \
+
+
+#define ENFORCE_ERRNO(condition, message)       \
+    ENFORCE((condition >= 0), perror(message))  \
+
+#define ENFORCE_CUSTOM(condition, ...)                            \
+    ENFORCE((condition), fprintf(stderr, __VA_ARGS__))            \
+
+#define ENABLE 1
+#define DISABLE 0
+
+#define PORT 10000
+
+#define DGRAM_MAX_SIZE 65507
+
+#define AVG_WINDOW 1000
+
+#define BURST_MAX 1024
+/* UDP_SEGMENT: dgrams per send(), the kernel's UDP_MAX_SEGMENTS is at least this */
+#define SEGMENTS_MAX 64
+/* user send times by sequence, matched with TX timestamps from the errqueue */
+#define TX_HISTORY 4096
+/* SO_TXTIME: default launch time lead */
+#define LEAD_USECS 1000
+
+struct options {
+    const char* host;
+    long rate;
+    size_t size;
+    size_t burst;
+    int busy;
+    long window;
+    size_t segments; /* UDP_SEGMENT: dgrams per send(), 1 without GSO */
+    const char* txtime; /* SO_TXTIME: "fq" or "etf", the qdisc sets the clock */
+    long lead;          /* ... ns between handing a dgram over and its launch time */
+};
+
+/* [0] - current window, [1] - cumulative */
+struct sender {
+    int udp;
+    char* payload;
+    size_t size;
+    size_t segments;
+    long window;
+    struct dgram_header header;
+    int64_t send_ns[TX_HISTORY];
+    int64_t launch_ns[TX_HISTORY]; /* intended send time, CLOCK_REALTIME */
+    /* OPT_ID counts send() calls, each one starts at this sequence */
+    uint64_t sends;
+    uint64_t first_seq[TX_HISTORY];
+    uint64_t window_sends; /* at the start of the current window */
+    uint64_t window_seq;
+    struct histogram pacing[2]; /* wakeup vs. schedule, with SO_TXTIME launch time lead */
+    struct histogram call[2];   /* send() cost */
+    struct histogram stack[2];  /* user send to kernel TX timestamp */
+    struct histogram launch[2]; /* intended send time to kernel TX timestamp */
+    uint64_t late_ticks;
+    clockid_t clock;  /* schedule: CLOCK_MONOTONIC, CLOCK_TAI for etf */
+    int64_t offset;   /* CLOCK_REALTIME - clock, TX timestamps are CLOCK_REALTIME */
+    int txtime;       /* SCM_TXTIME on every send() */
+    uint64_t missed;  /* SO_EE_CODE_TXTIME_MISSED: qdisc dropped a late dgram */
+    uint64_t invalid; /* SO_EE_CODE_TXTIME_INVALID_PARAM */
+    struct timespec started; /* CLOCK_MONOTONIC at the start of the current window */
+};
+
+static inline long delta_ns(const struct timespec* lhs, const struct timespec* rhs) {
+    return 1000000000*(lhs->tv_sec - rhs->tv_sec) + (lhs->tv_nsec - rhs->tv_nsec);
+}
+
+static inline int64_t timespec_ns(const struct timespec* ts) {
+    return 1000000000ll*ts->tv_sec + ts->tv_nsec;
+}
+
+static inline void timespec_add(struct timespec* ts, long ns) {
+    ts->tv_sec += ns / 1000000000;
+    ts->tv_nsec += ns % 1000000000;
+    if(ts->tv_nsec >= 1000000000) {
+        ts->tv_nsec -= 1000000000;
+        ++ts->tv_sec;
+    }
+}
+
+static inline int64_t clock_ns(clockid_t clock) {
+    struct timespec now;
+    ENFORCE_ERRNO(clock_gettime(clock, &now), "clock_gettime");
+    return timespec_ns(&now);
+}
+
+/* CLOCK_REALTIME - clock, the realtime reads bracket the clock read */
+static int64_t clock_offset(clockid_t clock) {
+    int64_t before = clock_ns(CLOCK_REALTIME);
+    int64_t now = clock_ns(clock);
+    int64_t after = clock_ns(CLOCK_REALTIME);
+    return before + (after - before) / 2 - now;
+}
+
+static void report(struct sender* s) {
+    struct timespec mono;
+    ENFORCE_ERRNO(clock_gettime(CLOCK_MONOTONIC, &mono), "clock_gettime: report");
+    long elapsed = delta_ns(&mono, &s->started);
+    uint64_t dgrams = s->header.seq - s->window_seq;
+    uint64_t sends = s->sends - s->window_sends;
+
+    printf("Window %llu (%llu total) - rate: %.0f pps, %.1f MB/s, %.1f dgrams/send(), late ticks: %llu, tx seq: %lld\n",
+           (unsigned long long)dgrams, (unsigned long long)s->header.seq,
+           elapsed > 0 ? 1e9 * dgrams / elapsed : 0.0,
+           elapsed > 0 ? 1e3 * dgrams * s->size / elapsed : 0.0,
+           sends > 0 ? (double)dgrams / sends : 0.0,
+           (unsigned long long)s->late_ticks,
+           s->header.tx_seq == DGRAM_NO_TX ? -1ll : (long long)s->header.tx_seq);
+    hist_report(s->txtime ? "  lead        " : "  pacing      ", &s->pacing[0], &s->pacing[1]);
+    hist_report("  send()      ", &s->call[0], &s->call[1]);
+    hist_report("  sender stack", &s->stack[0], &s->stack[1]);
+    hist_report("  launch      ", &s->launch[0], &s->launch[1]);
+    if(s->txtime) {
+        printf("  txtime      : missed %llu invalid %llu\n",
+               (unsigned long long)s->missed, (unsigned long long)s->invalid);
+    }
+
+    /* follows NTP adjustments of CLOCK_REALTIME */
+    s->offset = clock_offset(s->clock);
+    s->started = mono;
+    s->window_seq = s->header.seq;
+    s->window_sends = s->sends;
+}
+
+/*
+ * count dgrams in one send(), more than one are a UDP_SEGMENT super-packet.
+ * launch is the intended send time on s->clock, with SO_TXTIME the qdisc
+ * holds the dgrams until then.
+ */
+static void send_dgrams(struct sender* s, size_t count, int64_t launch) {
+    struct timespec now;
+    ENFORCE_ERRNO(clock_gettime(CLOCK_REALTIME, &now), "clock_gettime: now");
+    s->header.send_ns = timespec_ns(&now);
+    uint64_t first = s->header.seq;
+    for(size_t i = 0; i < count; ++i) {
+        s->header.seq = first + i;
+        dgram_encode(s->payload + i * s->size, &s->header);
+    }
+    s->header.seq = first;
+
+    struct iovec data;
+    data.iov_base = s->payload;
+    data.iov_len = count * s->size;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &data;
+    msg.msg_iovlen = 1;
+    char control[CMSG_SPACE(sizeof(uint64_t))];
+    if(s->txtime) {
+        uint64_t txtime = launch;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_TXTIME;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(txtime));
+        memcpy(CMSG_DATA(cmsg), &txtime, sizeof(txtime));
+    }
+
+    ssize_t sent = sendmsg(s->udp, &msg, 0);
+    struct timespec done;
+    ENFORCE_ERRNO(clock_gettime(CLOCK_REALTIME, &done), "clock_gettime: done");
+    ENFORCE_ERRNO(sent, "send: udp");
+    ENFORCE_CUSTOM((size_t)sent == count * s->size, "Unable send %zd bytes\n", count * s->size);
+
+    hist_record(&s->call[0], delta_ns(&done, &now));
+    s->first_seq[s->sends++ % TX_HISTORY] = first;
+    for(size_t i = 0; i < count; ++i) {
+        s->send_ns[s->header.seq % TX_HISTORY] = s->header.send_ns;
+        s->launch_ns[s->header.seq % TX_HISTORY] = launch + s->offset;
+        ++s->header.seq;
+        if((s->header.seq % s->window) == 0) {
+            report(s);
+        }
+    }
+}
+
+/* picks up TX timestamps; the latest one travels with the following dgrams */
+static void process_errqueue(struct sender* s) {
+    while(1) {
+        char control[256];
+        struct msghdr aux;
+        memset(&aux, 0, sizeof(aux));
+        aux.msg_control = control;
+        aux.msg_controllen = sizeof(control);
+
+        ssize_t read = recvmsg(s->udp, &aux, MSG_ERRQUEUE | MSG_DONTWAIT);
+        if(read < 0 && errno == EAGAIN) {
+            return;
+        }
+        ENFORCE_ERRNO(read, "recvmsg: errqueue");
+        ENFORCE_CUSTOM((aux.msg_flags & MSG_CTRUNC) == 0, "cmsg truncated\n");
+
+        struct timespec tx = {0, 0};
+        uint32_t id = 0;
+        int have_id = 0;
+        for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&aux);
+            cmsg != NULL;
+            cmsg = CMSG_NXTHDR(&aux, cmsg)) {
+            struct sock_extended_err* err;
+            switch(cmsg->cmsg_type) {
+                case SCM_TIMESTAMPING:
+                    tx = ((struct scm_timestamping*)CMSG_DATA(cmsg))->ts[0];
+                    break;
+                case IP_RECVERR:
+                    err = (struct sock_extended_err*)CMSG_DATA(cmsg);
+                    if(err->ee_origin == SO_EE_ORIGIN_TXTIME) {
+                        /* the dgram itself comes back, dropped by the qdisc */
+                        if(err->ee_code == SO_EE_CODE_TXTIME_MISSED) {
+                            ++s->missed;
+                        } else {
+                            ++s->invalid;
+                        }
+                        break;
+                    }
+                    ENFORCE_CUSTOM(err->ee_errno == ENOMSG,
+                                   "Unexpected errno: %d wants: %d\n", err->ee_errno, ENOMSG);
+                    ENFORCE_CUSTOM(err->ee_origin == SO_EE_ORIGIN_TIMESTAMPING,
+                                   "Unexpected origin: %d wants: %d\n", err->ee_origin, SO_EE_ORIGIN_TIMESTAMPING);
+                    id = err->ee_data;
+                    have_id = 1;
+                    break;
+                default:
+                    ENFORCE_CUSTOM(0, "unexpected control message type: %d\n", cmsg->cmsg_type);
+            }
+        }
+        if(tx.tv_sec == 0 && tx.tv_nsec == 0 && !have_id) {
+            continue; /* SO_EE_ORIGIN_TXTIME */
+        }
+        ENFORCE_CUSTOM(have_id, "timestamp without IP_RECVERR\n");
+
+        /* OPT_ID counts sends, reconstruct the full 64 bit count */
+        uint64_t send = (s->sends & ~(uint64_t)UINT32_MAX) | id;
+        if(send >= s->sends) {
+            send -= (uint64_t)1 << 32;
+        }
+        if(s->sends - send > TX_HISTORY) {
+            continue;
+        }
+        /* one timestamp for a whole super-packet, it goes with its first dgram */
+        uint64_t seq = s->first_seq[send % TX_HISTORY];
+        if(s->header.seq - seq > TX_HISTORY) {
+            continue;
+        }
+        int64_t tx_ns = timespec_ns(&tx);
+        hist_record(&s->stack[0], tx_ns - s->send_ns[seq % TX_HISTORY]);
+        hist_record(&s->launch[0], tx_ns - s->launch_ns[seq % TX_HISTORY]);
+        if(s->header.tx_seq == DGRAM_NO_TX || seq > s->header.tx_seq) {
+            s->header.tx_seq = seq;
+            s->header.tx_ns = tx_ns;
+        }
+    }
+}
+
+static void send_burst(struct sender* s, size_t burst, int64_t launch) {
+    while(burst > 0) {
+        size_t count = burst < s->segments ? burst : s->segments;
+        send_dgrams(s, count, launch);
+        burst -= count;
+    }
+    process_errqueue(s);
+}
+
+static void run_timerfd(struct sender* s, const struct options* opts, long period) {
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    ENFORCE_ERRNO(timer, "timerfd_create");
+
+    struct timespec next;
+    ENFORCE_ERRNO(clock_gettime(CLOCK_MONOTONIC, &next), "clock_gettime: start");
+    timespec_add(&next, period);
+
+    struct itimerspec interval;
+    interval.it_value = next;
+    interval.it_interval.tv_sec = period / 1000000000;
+    interval.it_interval.tv_nsec = period % 1000000000;
+    ENFORCE_ERRNO(timerfd_settime(timer, TFD_TIMER_ABSTIME, &interval, NULL), "timerfd_settime");
+
+    while(1) {
+        uint64_t exp = 0;
+        ENFORCE_CUSTOM(read(timer, &exp, sizeof(exp)) == sizeof(exp), "read: timer");
+        struct timespec now;
+        ENFORCE_ERRNO(clock_gettime(CLOCK_MONOTONIC, &now), "clock_gettime: tick");
+        /* pacing is measured against the latest tick that expired */
+        timespec_add(&next, period * (exp - 1));
+        hist_record(&s->pacing[0], delta_ns(&now, &next));
+        int64_t launch = timespec_ns(&next);
+        timespec_add(&next, period);
+        if(exp > 1) {
+            s->late_ticks += exp - 1;
+        }
+
+        size_t burst = opts->burst * exp;
+        send_burst(s, burst > BURST_MAX ? BURST_MAX : burst, launch);
+    }
+    ENFORCE_ERRNO(close(timer), "close: timer");
+}
+
+static void run_busy(struct sender* s, const struct options* opts, long period) {
+    struct timespec next;
+    ENFORCE_ERRNO(clock_gettime(CLOCK_MONOTONIC, &next), "clock_gettime: start");
+    timespec_add(&next, period);
+
+    while(1) {
+        struct timespec now;
+        do {
+            ENFORCE_ERRNO(clock_gettime(CLOCK_MONOTONIC, &now), "clock_gettime: spin");
+        } while(delta_ns(&now, &next) < 0);
+
+        hist_record(&s->pacing[0], delta_ns(&now, &next));
+        int64_t launch = timespec_ns(&next);
+        timespec_add(&next, period);
+        if(delta_ns(&now, &next) >= 0) {
+            /* fell behind by more than a tick, don't try to catch up */
+            ++s->late_ticks;
+            next = now;
+            timespec_add(&next, period);
+        }
+        send_burst(s, opts->burst, launch);
+    }
+}
+
+/*
+ * SO_TXTIME: no wakeup per tick. A coarse timer tops the qdisc up to lead
+ * ns ahead of now, every burst carrying its tick as SCM_TXTIME, and the
+ * qdisc (fq or etf) releases it at that time. Wakeup jitter only has to
+ * stay below the lead.
+ */
+static void run_txtime(struct sender* s, const struct options* opts, long period) {
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    ENFORCE_ERRNO(timer, "timerfd_create");
+
+    long wake = opts->lead / 2 > period ? opts->lead / 2 : period;
+    struct itimerspec interval;
+    interval.it_value.tv_sec = wake / 1000000000;
+    interval.it_value.tv_nsec = wake % 1000000000;
+    interval.it_interval = interval.it_value;
+    ENFORCE_ERRNO(timerfd_settime(timer, 0, &interval, NULL), "timerfd_settime");
+
+    int64_t next = clock_ns(s->clock) + opts->lead;
+    while(1) {
+        uint64_t exp = 0;
+        ENFORCE_CUSTOM(read(timer, &exp, sizeof(exp)) == sizeof(exp), "read: timer");
+        int64_t now = clock_ns(s->clock);
+        if(next <= now) {
+            /*
+             * Fell behind by more than the lead. Like run_timerfd() catch up
+             * on at most BURST_MAX dgrams: they keep their launch times, fq
+             * sends them at once, etf drops them as missed.
+             */
+            int64_t behind = (now - next) / period + 1;
+            s->late_ticks += behind;
+            if(behind * (int64_t)opts->burst > BURST_MAX) {
+                next += (behind - BURST_MAX / opts->burst) * period;
+            }
+        }
+        while(next <= now + opts->lead) {
+            hist_record(&s->pacing[0], next - clock_ns(s->clock));
+            send_burst(s, opts->burst, next);
+            next += period;
+        }
+    }
+    ENFORCE_ERRNO(close(timer), "close: timer");
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,
+            "usage: %s [-a addr] [-r rate] [-s size] [-b burst] [-g segments] [-y | -L qdisc [-D usecs]] [-w window]\n"
+            "  -a addr    receiver IPv4 address (default 127.0.0.1)\n"
+            "  -r rate    dgrams per second (default 1000)\n"
+            "  -s size    dgram size, %zd..%d (default 64)\n"
+            "  -b burst   dgrams sent back to back per tick, <= %d (default 1)\n"
+            "  -g segments  UDP_SEGMENT: send a burst as super-packets of up to segments (<= %d) dgrams\n"
+            "  -y         busy-wait on clock_gettime() instead of timerfd\n"
+            "  -L qdisc   SO_TXTIME: hand dgrams over ahead of time with SCM_TXTIME launch times for the\n"
+            "             fq (CLOCK_MONOTONIC) or etf (CLOCK_TAI) qdisc on the egress device\n"
+            "  -D usecs   launch time lead, under %d dgrams ahead (default %d)\n"
+            "  -w window  dgrams per report (default %d)\n",
+            name, sizeof(struct dgram_header), DGRAM_MAX_SIZE, BURST_MAX, SEGMENTS_MAX,
+            TX_HISTORY / 2, LEAD_USECS, AVG_WINDOW);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    struct options opts;
+    opts.host = "127.0.0.1";
+    opts.rate = 1000;
+    opts.size = 64;
+    opts.burst = 1;
+    opts.busy = DISABLE;
+    opts.window = AVG_WINDOW;
+    opts.segments = 1;
+    opts.txtime = NULL;
+    opts.lead = LEAD_USECS;
+
+    int opt;
+    while((opt = getopt(argc, argv, "a:r:s:b:g:yL:D:w:h")) != -1) {
+        switch(opt) {
+            case 'a':
+                opts.host = optarg;
+                break;
+            case 'r':
+                opts.rate = strtol(optarg, NULL, 0);
+                break;
+            case 's':
+                opts.size = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                opts.burst = strtoul(optarg, NULL, 0);
+                break;
+            case 'g':
+                opts.segments = strtoul(optarg, NULL, 0);
+                break;
+            case 'y':
+                opts.busy = ENABLE;
+                break;
+            case 'L':
+                opts.txtime = optarg;
+                break;
+            case 'D':
+                opts.lead = strtol(optarg, NULL, 0);
+                break;
+            case 'w':
+                opts.window = strtol(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    ENFORCE_CUSTOM(opts.rate > 0 && opts.rate <= 1000000000, "invalid rate: %ld\n", opts.rate);
+    ENFORCE_CUSTOM(opts.size >= sizeof(struct dgram_header) && opts.size <= DGRAM_MAX_SIZE,
+                   "invalid size: %zd\n", opts.size);
+    ENFORCE_CUSTOM(opts.burst > 0 && opts.burst <= BURST_MAX, "invalid burst: %zd\n", opts.burst);
+    ENFORCE_CUSTOM(opts.window > 0, "invalid window: %ld\n", opts.window);
+    ENFORCE_CUSTOM(opts.segments > 0 && opts.segments <= SEGMENTS_MAX &&
+                   opts.segments * opts.size <= DGRAM_MAX_SIZE,
+                   "invalid segments: %zd of %zd bytes\n", opts.segments, opts.size);
+
+    /* one tick sends a whole burst */
+    long period = 1000000000.0 * opts.burst / opts.rate;
+    ENFORCE_CUSTOM(period > 0, "rate too high for burst %zd\n", opts.burst);
+
+    clockid_t clock = CLOCK_MONOTONIC;
+    if(opts.txtime != NULL) {
+        ENFORCE_CUSTOM(strcmp(opts.txtime, "fq") == 0 || strcmp(opts.txtime, "etf") == 0,
+                       "invalid qdisc: %s\n", opts.txtime);
+        ENFORCE_CUSTOM(!opts.busy, "-y and -L are exclusive\n");
+        clock = strcmp(opts.txtime, "etf") == 0 ? CLOCK_TAI : CLOCK_MONOTONIC;
+        /* every dgram queued ahead needs its slot in the TX history */
+        ENFORCE_CUSTOM(opts.lead > 0 && (size_t)(opts.lead * 1000 / period) * opts.burst < TX_HISTORY / 2,
+                       "invalid lead: %ld usecs, at most %d dgrams ahead\n", opts.lead, TX_HISTORY / 2);
+    }
+    opts.lead *= 1000;
+
+    int udp = socket(AF_INET, SOCK_DGRAM, 0);
+    ENFORCE_ERRNO(udp, "socket: udp");
+
+    struct sockaddr_in remote;
+    remote.sin_family = AF_INET;
+    remote.sin_port = htons(PORT);
+    ENFORCE_CUSTOM(inet_pton(AF_INET, opts.host, &remote.sin_addr) == 1,
+                   "invalid address: %s\n", opts.host);
+    ENFORCE_ERRNO(connect(udp, (struct sockaddr*)&remote, sizeof(remote)), "connect: udp");
+
+    int flags = DISABLE
+            | SOF_TIMESTAMPING_TX_SOFTWARE
+            | SOF_TIMESTAMPING_SOFTWARE
+            | SOF_TIMESTAMPING_OPT_ID
+            | SOF_TIMESTAMPING_OPT_TSONLY
+            ;
+    ENFORCE_ERRNO(setsockopt(udp, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)),
+                  "setsockopt: SO_TIMESTAMPING");
+
+    if(opts.segments > 1) {
+        /* every send() longer than size is cut into size byte dgrams */
+        flags = opts.size;
+        ENFORCE_ERRNO(setsockopt(udp, SOL_UDP, UDP_SEGMENT, &flags, sizeof(flags)),
+                      "setsockopt: UDP_SEGMENT");
+    }
+
+    if(opts.txtime != NULL) {
+        /* etf drops dgrams whose clock differs from its own */
+        struct sock_txtime txtime;
+        txtime.clockid = clock;
+        txtime.flags = SOF_TXTIME_REPORT_ERRORS;
+        ENFORCE_ERRNO(setsockopt(udp, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)),
+                      "setsockopt: SO_TXTIME");
+    }
+
+    struct sender* s = calloc(1, sizeof(*s));
+    ENFORCE_CUSTOM(s != NULL, "unable to allocate sender\n");
+    s->udp = udp;
+    s->size = opts.size;
+    s->segments = opts.segments;
+    s->window = opts.window;
+    s->payload = calloc(opts.segments, opts.size);
+    ENFORCE_CUSTOM(s->payload != NULL, "unable to allocate payload\n");
+    for(size_t i = 0; i < 2; ++i) {
+        hist_reset(&s->pacing[i]);
+        hist_reset(&s->call[i]);
+        hist_reset(&s->stack[i]);
+        hist_reset(&s->launch[i]);
+    }
+    s->clock = clock;
+    s->offset = clock_offset(clock);
+    s->txtime = opts.txtime != NULL;
+    s->header.magic = DGRAM_MAGIC;
+    s->header.session = getpid() ^ time(NULL);
+    s->header.tx_seq = DGRAM_NO_TX;
+    ENFORCE_ERRNO(clock_gettime(CLOCK_MONOTONIC, &s->started), "clock_gettime: started");
+
+    printf("Sending %zd byte DGRAMS to %s:%d at %ld pps, %zd per tick, up to %zd per send(), %s pacing\n",
+           opts.size, opts.host, PORT, opts.rate, opts.burst, opts.segments,
+           opts.txtime != NULL ? "SO_TXTIME" : opts.busy ? "busy-wait" : "timerfd");
+    if(opts.txtime != NULL) {
+        printf("Launch times %ld us ahead on %s for the %s qdisc\n",
+               opts.lead / 1000, clock == CLOCK_TAI ? "CLOCK_TAI" : "CLOCK_MONOTONIC", opts.txtime);
+        run_txtime(s, &opts, period);
+    } else if(opts.busy) {
+        run_busy(s, &opts, period);
+    } else {
+        run_timerfd(s, &opts, period);
+    }
+
+    free(s->payload);
+    free(s);
+    ENFORCE_ERRNO(close(udp), "close: udp");
+    return 0;
+}
@@ -1,19 +1,43 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
+#include <stddef.h>
 #include <error.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <pthread.h>
+#include <poll.h>
 
 #include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
+#include <net/if.h>
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 
 #include <linux/net_tstamp.h>
 #include <linux/errqueue.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+
+#include "histogram.h"
+#include "seqlock.h"
+#include "dgram.h"
+#include "uring.h"
+#include "trace.h"
+#include "tsc.h"
+#include "metrics.h"
+#include "perf.h"
 
 #define ENFORCE(condition, report) \
     do {                                        \
@@ -39,11 +63,759 @@
 
 #define AVG_WINDOW 600
 
-inline long delta_ns(const struct timespec* lhs, const struct timespec* rhs) {
+#define CACHE_LINE 64
+#define ALIGN_UP(value, align) (((value) + (align) - 1) / (align) * (align))
+
+/* batch mode: slots are kept small so that a whole batch fits into L2 */
+#define BATCH_MAX 1024
+#define BATCH_SLOT_DEFAULT 2048
+#define BATCH_CONTROL_SIZE ALIGN_UP(CMSG_SPACE(sizeof(struct timespec)) +         \
+                                    CMSG_SPACE(sizeof(struct scm_timestamping)) + \
+                                    CMSG_SPACE(sizeof(uint32_t)) +                \
+                                    CMSG_SPACE(sizeof(int)) +                     \
+                                    CACHE_LINE, CACHE_LINE)
+
+/* io_uring mode: multishot recvmsg into a ring of provided buffers */
+#define URING_BUFFERS_MAX 32768
+#define URING_ENTRIES 8
+#define URING_BGID 0
+
+/*
+ * AF_PACKET mode: TPACKET_V3 ring of blocks, the kernel hands over a block
+ * once it is full or PACKET_RETIRE_TOV ms after its first packet, so at low
+ * rates the timeout is part of the kernel to user latency.
+ */
+#define PACKET_BLOCK_SIZE (1 << 20)
+#define PACKET_BLOCKS 64
+#define PACKET_FRAME_SIZE 2048
+#define PACKET_RETIRE_TOV 1 /* ms */
+
+#define THREADS_MAX 256
+#define REPORT_INTERVAL 1 /* seconds */
+
+/* receive times of recent udp_sender dgrams, to match TX timestamps carried later */
+#define RX_HISTORY 4096
+
+enum metric {
+    TIMESTAMPNS,  /* kernel RX (SO_TIMESTAMPNS) to user */
+    TIMESTAMPING, /* kernel RX (SO_TIMESTAMPING) to user */
+    ONEWAY,       /* sender user to receiver kernel RX */
+    SENDER_STACK, /* sender user to sender kernel TX */
+    WIRE,         /* sender kernel TX to receiver kernel RX */
+    GRO_SPREAD,   /* send times covered by one UDP_GRO timestamp, first to last segment */
+    METRICS
+};
+
+static const char* metrics[METRICS] = {
+    "timestampns ", "timestamping", "one-way     ", "sender stack", "wire        ", "gro spread  "
+};
+
+/* -M segment, registered in this order after the histograms above */
+enum counter {
+    DGRAMS,
+    DROPS,
+    CPU_NS,
+    LOST,
+    REORDERED,
+    DUPLICATES,
+    LATE,
+    GRO_PACKETS,
+    TRUNCATED,
+    COUNTERS
+};
+
+static const char* counters[COUNTERS] = {
+    "dgrams", "drops", "cpu_ns", "lost", "reordered", "duplicates", "late", "gro_packets", "truncated"
+};
+
+struct rx_slot {
+    uint64_t seq;
+    int64_t send_ns;
+    int64_t rx_ns;
+};
+
+/* published by a worker at the end of every window, merged by the reporter */
+struct snapshot {
+    struct seqlock lock;
+    long counter;
+    long windows;
+    uint32_t drops;
+    long long cpu_ns;
+    uint64_t lost;
+    uint64_t reordered;
+    uint64_t duplicates;
+    uint64_t late;
+    long gro_packets;
+    long truncated;
+    struct perf_totals perf;
+    struct histogram hist[METRICS][2]; /* last window, total */
+};
+
+struct stats {
+    struct histogram hist[METRICS][2]; /* window, total */
+    long counter;
+    long calls;
+    long empty; /* busy-poll: calls which returned nothing */
+    long gro_packets;      /* UDP_GRO: receives carrying more than one dgram */
+    long coalesced;        /* ... in the current window */
+    long coalesced_dgrams; /* ... and the dgrams they carried */
+    long truncated;        /* longer than the slot (MSG_TRUNC) or the capture frame, dropped */
+    uint32_t drops;        /* SO_RXQ_OVFL: socket lifetime counter */
+    uint32_t window_drops; /* ... at the start of the current window */
+    long long window_cpu;  /* thread cpu time at the start of the current window */
+    struct timespec window; /* CLOCK_MONOTONIC at the start of the current window */
+    struct snapshot* snapshot; /* multi-threaded mode: publish instead of print */
+    struct trace* trace;       /* raw per-dgram records, optional */
+    struct tsc clock;          /* user side receive time, CLOCK_REALTIME unless -K */
+    struct metrics* metrics;   /* live segment, optional */
+    struct perf_group perf;    /* -C, kind PERF_NONE otherwise */
+    struct perf_totals perf_totals; /* around recvmsg()/recvmmsg() */
+    struct perf_totals perf_window; /* ... at the start of the current window */
+    struct sequence sequence;
+    struct rx_slot history[RX_HISTORY];
+};
+
+struct options {
+    size_t batch;
+    size_t slot;
+    size_t uring;
+    int busy_poll;
+    size_t threads;
+    const char* trace;
+    int first_cpu;
+    int incoming_cpu;
+    const char* capture; /* AF_PACKET mode: interface, "any" for all */
+    int hardware;        /* AF_PACKET mode: PACKET_TIMESTAMP raw hardware */
+    int tsc;
+    const char* metrics; /* shared memory segment name */
+    int gro;             /* UDP_GRO: coalesced segments per receive */
+    int perf;            /* hardware counters around recvmsg()/recvmmsg() */
+};
+
+struct worker {
+    pthread_t thread;
+    size_t index;
+    int cpu;
+    const struct options* opts;
+    const struct tsc* clock; /* calibrated once, each worker corrects its own copy */
+    struct stats* st;
+    struct snapshot* snapshot;
+};
+
+static inline long delta_ns(const struct timespec* lhs, const struct timespec* rhs) {
     return 1000000000*(lhs->tv_sec - rhs->tv_sec) + (lhs->tv_nsec - rhs->tv_nsec);
 }
 
-int main() {
+static inline int64_t timespec_ns(const struct timespec* ts) {
+    return 1000000000ll*ts->tv_sec + ts->tv_nsec;
+}
+
+static long long thread_cpu_ns(void) {
+    struct timespec cpu;
+    ENFORCE_ERRNO(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu), "clock_gettime: cpu");
+    return timespec_ns(&cpu);
+}
+
+/* user side receive time, taken once per call that returned data */
+static inline void receive_time(struct stats* st, struct timespec* now) {
+    tsc_timespec(&st->clock, tsc_read(&st->clock), now);
+}
+
+static void print_sequence(uint64_t lost, uint64_t reordered, uint64_t duplicates, uint64_t late) {
+    printf("  sequence    : lost %llu reordered %llu duplicates %llu late %llu\n",
+           (unsigned long long)lost, (unsigned long long)reordered,
+           (unsigned long long)duplicates, (unsigned long long)late);
+}
+
+static struct metrics* metrics_create(const char* name) {
+    struct metrics* m = malloc(sizeof(*m));
+    ENFORCE_CUSTOM(m != NULL, "unable to allocate metrics\n");
+    int err = metrics_open(m, name, "udp_timestamping");
+    ENFORCE_CUSTOM(err == 0, "metrics: %s: %s\n", name, strerror(-err));
+    for(size_t h = 0; h < METRICS; ++h) {
+        ENFORCE_CUSTOM(metrics_add_histogram(m, metrics[h]) == (int)h, "metrics: too many histograms\n");
+    }
+    for(size_t c = 0; c < COUNTERS; ++c) {
+        ENFORCE_CUSTOM(metrics_add_counter(m, counters[c]) == (int)c, "metrics: too many counters\n");
+    }
+    return m;
+}
+
+/* hist[m][1] is used as the total only if it already includes hist[m][0] */
+static void metrics_update(struct metrics* m, const int64_t values[COUNTERS],
+                           struct histogram hist[METRICS][2], int merged) {
+    metrics_begin(m);
+    for(size_t c = 0; c < COUNTERS; ++c) {
+        metrics_set(m, c, values[c]);
+    }
+    for(size_t i = 0; i < METRICS; ++i) {
+        metrics_set_histogram(m, i, &hist[i][0], merged ? &hist[i][1] : NULL);
+    }
+    metrics_end(m);
+}
+
+static void report(struct stats* st) {
+    struct timespec mono;
+    ENFORCE_ERRNO(clock_gettime(CLOCK_MONOTONIC, &mono), "clock_gettime: report");
+    long elapsed = delta_ns(&mono, &st->window);
+    long long cpu = thread_cpu_ns();
+
+    if(st->metrics != NULL) {
+        int64_t values[COUNTERS] = {
+            st->counter, st->drops, cpu, st->sequence.lost, st->sequence.reordered,
+            st->sequence.duplicates, st->sequence.late, st->gro_packets, st->truncated
+        };
+        metrics_update(st->metrics, values, st->hist, 0);
+    }
+
+    printf("Window %d (%ld total) - rate: %.0f pps, batch: %.1f dgrams/call, drops: %u (%u total), "
+           "cpu: %.1f%% %lld ns/dgram, empty polls: %ld\n",
+           AVG_WINDOW, st->counter,
+           elapsed > 0 ? 1e9 * AVG_WINDOW / elapsed : 0.0,
+           st->calls > st->empty ? (double)AVG_WINDOW / (st->calls - st->empty) : 0.0,
+           st->drops - st->window_drops, st->drops,
+           elapsed > 0 ? 100.0 * (cpu - st->window_cpu) / elapsed : 0.0,
+           (cpu - st->window_cpu) / AVG_WINDOW, st->empty);
+    if(st->truncated > 0) {
+        printf("  truncated   : %ld dgrams longer than the slot dropped\n", st->truncated);
+    }
+    if(st->gro_packets > 0) {
+        printf("  gro         : %ld coalesced packets (%ld total), %.1f dgrams/packet\n",
+               st->coalesced, st->gro_packets,
+               st->coalesced > 0 ? (double)st->coalesced_dgrams / st->coalesced : 0.0);
+    }
+    for(size_t m = 0; m < METRICS; ++m) {
+        if(st->hist[m][0].count == 0 && st->hist[m][1].count == 0) {
+            continue;
+        }
+        char label[64];
+        snprintf(label, sizeof(label), "  %s", metrics[m]);
+        hist_report(label, &st->hist[m][0], &st->hist[m][1]);
+    }
+    if(st->sequence.received > 0) {
+        print_sequence(st->sequence.lost, st->sequence.reordered,
+                       st->sequence.duplicates, st->sequence.late);
+    }
+    if(st->perf.kind != PERF_NONE) {
+        perf_update(&st->perf_totals, &st->perf);
+        perf_print("  perf        ", &st->perf_totals, &st->perf_window);
+        st->perf_window = st->perf_totals;
+    }
+    if(tsc_recalibrate(&st->clock)) {
+        printf("  tsc         : %llu corrections, last drift %lld ns\n",
+               (unsigned long long)st->clock.corrections, (long long)st->clock.drift_ns);
+    }
+
+    st->window = mono;
+    st->window_cpu = cpu;
+    st->window_drops = st->drops;
+    st->coalesced = 0;
+    st->coalesced_dgrams = 0;
+    st->calls = 0;
+    st->empty = 0;
+}
+
+static void publish(struct stats* st) {
+    struct snapshot* s = st->snapshot;
+    tsc_recalibrate(&st->clock);
+    if(st->perf.kind != PERF_NONE) {
+        perf_update(&st->perf_totals, &st->perf);
+    }
+    for(size_t m = 0; m < METRICS; ++m) {
+        hist_merge(&st->hist[m][1], &st->hist[m][0]);
+    }
+
+    seqlock_write_begin(&s->lock);
+    s->counter = st->counter;
+    ++s->windows;
+    s->drops = st->drops;
+    s->cpu_ns = thread_cpu_ns();
+    s->lost = st->sequence.lost;
+    s->reordered = st->sequence.reordered;
+    s->duplicates = st->sequence.duplicates;
+    s->late = st->sequence.late;
+    s->gro_packets = st->gro_packets;
+    s->truncated = st->truncated;
+    s->perf = st->perf_totals;
+    for(size_t m = 0; m < METRICS; ++m) {
+        /*
+         * most metrics stay empty without udp_sender, skip copying those;
+         * a window that was published non-empty must still be cleared
+         */
+        if(st->hist[m][1].count != s->hist[m][1].count || s->hist[m][0].count != 0) {
+            memcpy(s->hist[m], st->hist[m], sizeof(s->hist[m]));
+        }
+    }
+    seqlock_write_end(&s->lock);
+
+    for(size_t m = 0; m < METRICS; ++m) {
+        hist_reset(&st->hist[m][0]);
+    }
+    st->coalesced = 0;
+    st->coalesced_dgrams = 0;
+    st->calls = 0;
+    st->empty = 0;
+}
+
+/* one-way breakdown for dgrams generated by udp_sender */
+static void process_header(struct stats* st, const struct dgram_header* h, int64_t rx_ns) {
+    sequence_update(&st->sequence, h->session, h->seq);
+    hist_record(&st->hist[ONEWAY][0], rx_ns - (int64_t)h->send_ns);
+
+    struct rx_slot* slot = &st->history[h->seq % RX_HISTORY];
+    slot->seq = h->seq;
+    slot->send_ns = h->send_ns;
+    slot->rx_ns = rx_ns;
+
+    if(h->tx_seq == DGRAM_NO_TX) {
+        return;
+    }
+    const struct rx_slot* tx = &st->history[h->tx_seq % RX_HISTORY];
+    if(tx->seq == h->tx_seq && tx->rx_ns != 0) {
+        hist_record(&st->hist[SENDER_STACK][0], (int64_t)h->tx_ns - tx->send_ns);
+        hist_record(&st->hist[WIRE][0], tx->rx_ns - (int64_t)h->tx_ns);
+    }
+}
+
+/* everything past the kernel timestamps: udp_sender header, trace and windows */
+static void process_payload(struct stats* st, const char* payload, size_t len, const struct timespec* now,
+                            int64_t rx_ns, const struct timespec* pts, const struct scm_timestamping* data) {
+    struct dgram_header header;
+    int ours = rx_ns != 0 && dgram_decode(payload, len, &header);
+    if(ours) {
+        process_header(st, &header, rx_ns);
+    }
+
+    if(st->trace != NULL) {
+        struct trace_record* r = trace_next(st->trace);
+        r->id = ours ? header.seq : (uint64_t)st->counter;
+        r->stage = 0;
+        r->user_ns = timespec_ns(now);
+        r->timestampns_ns = pts != NULL ? timespec_ns(pts) : 0;
+        for(size_t i = 0; i < 3; ++i) {
+            r->timestamping_ns[i] = data != NULL ? timespec_ns(&data->ts[i]) : 0;
+        }
+        trace_commit(st->trace);
+    }
+
+    ++st->counter;
+    if((st->counter % AVG_WINDOW) == 0) {
+        if(st->snapshot != NULL) {
+            publish(st);
+        } else {
+            report(st);
+        }
+    }
+}
+
+static void process(struct stats* st, struct msghdr* aux, size_t len, const struct timespec* now) {
+    ENFORCE_CUSTOM((aux->msg_flags & MSG_CTRUNC) == 0, "cmsg truncated\n");
+    if((aux->msg_flags & MSG_TRUNC) != 0) {
+        ++st->truncated;
+        return;
+    }
+
+    /*
+    char addr[12];
+    struct sockaddr_in* remote = aux->msg_name;
+    printf("read from %s:%d"
+           " - msg_namelen: %d, msg_iovlen: %zd, msg_controllen: %zd, flags: %d\n",
+           inet_ntop(remote->sin_family, &remote->sin_addr, addr, sizeof(addr)),
+           ntohs(remote->sin_port),
+           aux->msg_namelen, aux->msg_iovlen, aux->msg_controllen, aux->msg_flags);
+    */
+
+    int64_t rx_ns = 0;
+    struct scm_timestamping* data = NULL;
+    struct timespec* pts = NULL;
+    size_t segment = len; /* UDP_GRO: payload is a run of segment sized dgrams */
+    for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(aux);
+        cmsg != NULL;
+        cmsg = CMSG_NXTHDR(aux, cmsg)) {
+        if(cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            segment = *(int*)CMSG_DATA(cmsg);
+            continue;
+        }
+        ENFORCE_CUSTOM(cmsg->cmsg_level == SOL_SOCKET,
+                       "unexpected control message level: %d\n", cmsg->cmsg_level);
+        switch(cmsg->cmsg_type) {
+            case SCM_TIMESTAMPNS:
+                pts = (struct timespec*)CMSG_DATA(cmsg);
+                /* printf("SCM_TIMESTAMS      : %ld.%09ld latency: %ld ns\n", */
+                /*        pts->tv_sec, pts->tv_nsec, delta_ns(now, pts)); */
+                hist_record(&st->hist[TIMESTAMPNS][0], delta_ns(now, pts));
+                break;
+            case SCM_TIMESTAMPING:
+                data = (struct scm_timestamping*)CMSG_DATA(cmsg);
+                /* for(size_t idx = 0; idx < 2; ++idx) { */
+                /*     if(data->ts[idx].tv_sec == 0 && */
+                /*        data->ts[idx].tv_nsec == 0) { */
+                /*         continue; */
+                /*     } */
+                hist_record(&st->hist[TIMESTAMPING][0], delta_ns(now, &data->ts[0]));
+                rx_ns = timespec_ns(&data->ts[0]);
+                    /* printf("SCM_TIMESTAMPING[%zd]: %ld.%09ld latency: %ld ns\n", */
+                    /*        idx, data->ts[idx].tv_sec, data->ts[idx].tv_nsec, */
+                    /*        delta_ns(now, &data->ts[idx])); */
+                /* } */
+                 break;
+            case SO_RXQ_OVFL:
+                st->drops = *(uint32_t*)CMSG_DATA(cmsg);
+                break;
+            default:
+                ENFORCE_CUSTOM(0, "unexpected control message type: %d\n", cmsg->cmsg_type);
+        }
+    }
+
+    const char* payload = aux->msg_iov[0].iov_base;
+    if(segment == 0 || segment >= len) {
+        process_payload(st, payload, len, now, rx_ns, pts, data);
+        return;
+    }
+
+    /* every segment shares the timestamp of the packet GRO built them into */
+    size_t count = (len + segment - 1) / segment;
+    ++st->gro_packets;
+    ++st->coalesced;
+    st->coalesced_dgrams += count;
+    struct dgram_header first;
+    struct dgram_header last;
+    if(dgram_decode(payload, segment, &first) &&
+       dgram_decode(payload + (count - 1) * segment, len - (count - 1) * segment, &last)) {
+        hist_record(&st->hist[GRO_SPREAD][0], (int64_t)(last.send_ns - first.send_ns));
+    }
+    for(size_t offset = 0; offset < len; offset += segment) {
+        size_t size = len - offset < segment ? len - offset : segment;
+        process_payload(st, payload + offset, size, now, rx_ns, pts, data);
+    }
+}
+
+/* busy-poll: spin on a non-blocking socket instead of sleeping in recvmsg() */
+static void receive_single(int udp, struct stats* st, int busy) {
+    struct sockaddr_in remote;
+
+    char buf[DGRAM_MAX_SIZE];
+    struct iovec data;
+    data.iov_base = buf;
+    data.iov_len = sizeof(buf);
+
+    char control[65536];
+
+    int perf = st->perf.kind != PERF_NONE;
+    struct perf_sample before;
+    struct perf_sample after;
+    while(1) {
+        struct msghdr aux;
+        aux.msg_name = &remote;
+        aux.msg_namelen = sizeof(remote);
+        aux.msg_iov = &data;
+        aux.msg_iovlen = 1;
+        aux.msg_control = control;
+        aux.msg_controllen = sizeof(control);
+
+        if(perf) {
+            perf_read(&st->perf, &before);
+        }
+        ssize_t read = recvmsg(udp, &aux, busy ? MSG_DONTWAIT : 0);
+        if(perf) {
+            perf_read(&st->perf, &after);
+            perf_account(&st->perf_totals, &st->perf, &before, &after);
+        }
+        ++st->calls;
+        if(busy && read < 0 && errno == EAGAIN) {
+            ++st->empty;
+            continue;
+        }
+        ENFORCE_ERRNO(read, "recvmsg: udp");
+
+        struct timespec now;
+        receive_time(st, &now);
+        /* printf("NOW: %ld.%09ld\n", now.tv_sec, now.tv_nsec); */
+
+        process(st, &aux, read, &now);
+    }
+}
+
+static void receive_batch(int udp, struct stats* st, size_t batch, size_t slot, int busy) {
+    slot = ALIGN_UP(slot, CACHE_LINE);
+
+    struct mmsghdr* msgs = calloc(batch, sizeof(*msgs));
+    struct iovec* data = calloc(batch, sizeof(*data));
+    struct sockaddr_in* remote = calloc(batch, sizeof(*remote));
+    char* buf = aligned_alloc(CACHE_LINE, batch * slot);
+    char* control = aligned_alloc(CACHE_LINE, batch * BATCH_CONTROL_SIZE);
+    ENFORCE_CUSTOM(msgs && data && remote && buf && control,
+                   "unable to allocate batch of %zd\n", batch);
+
+    for(size_t i = 0; i < batch; ++i) {
+        data[i].iov_base = buf + i * slot;
+        data[i].iov_len = slot;
+        msgs[i].msg_hdr.msg_name = &remote[i];
+        msgs[i].msg_hdr.msg_iov = &data[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = control + i * BATCH_CONTROL_SIZE;
+    }
+
+    int perf = st->perf.kind != PERF_NONE;
+    struct perf_sample before;
+    struct perf_sample after;
+    while(1) {
+        /* kernel overwrites lengths on return */
+        for(size_t i = 0; i < batch; ++i) {
+            msgs[i].msg_hdr.msg_namelen = sizeof(remote[i]);
+            msgs[i].msg_hdr.msg_controllen = BATCH_CONTROL_SIZE;
+            msgs[i].msg_hdr.msg_flags = 0;
+        }
+
+        if(perf) {
+            perf_read(&st->perf, &before);
+        }
+        int read = recvmmsg(udp, msgs, batch, busy ? MSG_DONTWAIT : MSG_WAITFORONE, NULL);
+        if(perf) {
+            perf_read(&st->perf, &after);
+            perf_account(&st->perf_totals, &st->perf, &before, &after);
+        }
+        ++st->calls;
+        if(busy && read < 0 && errno == EAGAIN) {
+            ++st->empty;
+            continue;
+        }
+        ENFORCE_ERRNO(read, "recvmmsg: udp");
+
+        struct timespec now;
+        receive_time(st, &now);
+
+        for(int i = 0; i < read; ++i) {
+            process(st, &msgs[i].msg_hdr, msgs[i].msg_len, &now);
+        }
+    }
+
+    free(control);
+    free(buf);
+    free(remote);
+    free(data);
+    free(msgs);
+}
+
+static void receive_uring(int udp, struct stats* st, size_t buffers, size_t slot) {
+    struct uring ring;
+    int err = uring_init(&ring, URING_ENTRIES, 4 * buffers);
+    ENFORCE_CUSTOM(err == 0, "io_uring_setup: %s\n", strerror(-err));
+
+    /* kernel fills every buffer as io_uring_recvmsg_out, name, control, payload */
+    struct msghdr layout;
+    memset(&layout, 0, sizeof(layout));
+    layout.msg_namelen = sizeof(struct sockaddr_in);
+    layout.msg_controllen = BATCH_CONTROL_SIZE;
+    size_t header = sizeof(struct io_uring_recvmsg_out) + layout.msg_namelen + layout.msg_controllen;
+
+    struct uring_buf_ring bufs;
+    err = uring_buf_ring_setup(&ring, &bufs, buffers, ALIGN_UP(header + slot, CACHE_LINE), URING_BGID);
+    ENFORCE_CUSTOM(err == 0, "io_uring_register: IORING_REGISTER_PBUF_RING: %s\n", strerror(-err));
+
+    int armed = 0;
+    while(1) {
+        if(!armed) {
+            struct io_uring_sqe* sqe = uring_get_sqe(&ring);
+            ENFORCE_CUSTOM(sqe != NULL, "io_uring: submission queue full\n");
+            sqe->opcode = IORING_OP_RECVMSG;
+            sqe->fd = udp;
+            sqe->addr = (uint64_t)(uintptr_t)&layout;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = URING_BGID;
+            armed = 1;
+        }
+
+        err = uring_submit_and_wait(&ring, 1);
+        if(err == -EINTR) {
+            continue;
+        }
+        ENFORCE_CUSTOM(err >= 0, "io_uring_enter: %s\n", strerror(-err));
+        ++st->calls;
+
+        /* completions posted after now are left for the next round */
+        unsigned ready = uring_cq_ready(&ring);
+        struct timespec now;
+        receive_time(st, &now);
+
+        for(; ready > 0; --ready) {
+            struct io_uring_cqe* cqe = uring_peek_cqe(&ring);
+            if((cqe->flags & IORING_CQE_F_MORE) == 0) {
+                /* multishot ended, e.g. ran out of buffers: re-arm */
+                armed = 0;
+            }
+            if(cqe->res == -ENOBUFS) {
+                uring_cqe_seen(&ring);
+                continue;
+            }
+            ENFORCE_CUSTOM(cqe->res >= 0, "recvmsg: udp: %s\n", strerror(-cqe->res));
+            ENFORCE_CUSTOM((cqe->flags & IORING_CQE_F_BUFFER) != 0, "io_uring: no buffer selected\n");
+
+            unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            char* buf = uring_buf(&bufs, bid);
+            struct io_uring_recvmsg_out* out = (struct io_uring_recvmsg_out*)buf;
+
+            struct iovec data;
+            data.iov_base = buf + header;
+            data.iov_len = out->payloadlen;
+            struct msghdr aux;
+            aux.msg_name = buf + sizeof(*out);
+            aux.msg_namelen = out->namelen;
+            aux.msg_iov = &data;
+            aux.msg_iovlen = 1;
+            aux.msg_control = buf + sizeof(*out) + layout.msg_namelen;
+            aux.msg_controllen = out->controllen;
+            aux.msg_flags = out->flags;
+
+            process(st, &aux, out->payloadlen, &now);
+            uring_buf_ring_add(&bufs, bid);
+            uring_cqe_seen(&ring);
+        }
+    }
+
+    uring_buf_ring_free(&ring, &bufs);
+    uring_exit(&ring);
+}
+
+/* processes a retired block in place, packets start at the IPv4 header */
+static void process_block(struct stats* st, struct tpacket_block_desc* block, const struct timespec* now) {
+    char* frame = (char*)block + block->hdr.bh1.offset_to_first_pkt;
+    for(uint32_t i = 0; i < block->hdr.bh1.num_pkts; ++i) {
+        struct tpacket3_hdr* ph = (struct tpacket3_hdr*)frame;
+        const char* ip = frame + ph->tp_net;
+        size_t ihl = 4 * (((const struct iphdr*)ip)->ihl);
+        const struct udphdr* udp = (const struct udphdr*)(ip + ihl);
+        const char* payload = (const char*)(udp + 1);
+        size_t len = ntohs(udp->len) - sizeof(*udp);
+        if(ihl + sizeof(*udp) + len > ph->tp_snaplen) {
+            ++st->truncated;
+            frame += ph->tp_next_offset;
+            continue;
+        }
+
+        /* same slots as SCM_TIMESTAMPING: [0] software, [2] raw hardware */
+        struct scm_timestamping data;
+        memset(&data, 0, sizeof(data));
+        struct timespec* ts = &data.ts[(ph->tp_status & TP_STATUS_TS_RAW_HARDWARE) != 0 ? 2 : 0];
+        ts->tv_sec = ph->tp_sec;
+        ts->tv_nsec = ph->tp_nsec;
+        hist_record(&st->hist[TIMESTAMPING][0], delta_ns(now, ts));
+
+        process_payload(st, payload, len, now, timespec_ns(ts), NULL, &data);
+        frame += ph->tp_next_offset;
+    }
+}
+
+/* walks the ring in place: wait for the block, process it, hand it back */
+static void receive_capture(int capture, struct stats* st, int busy) {
+    char* ring = mmap(NULL, (size_t)PACKET_BLOCK_SIZE * PACKET_BLOCKS, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, capture, 0);
+    ENFORCE_CUSTOM(ring != MAP_FAILED, "mmap: PACKET_RX_RING: %s\n", strerror(errno));
+
+    struct pollfd pfd;
+    pfd.fd = capture;
+    pfd.events = POLLIN | POLLERR;
+    pfd.revents = 0;
+
+    for(size_t b = 0; ; b = (b + 1) % PACKET_BLOCKS) {
+        struct tpacket_block_desc* block = (struct tpacket_block_desc*)(ring + b * PACKET_BLOCK_SIZE);
+        _Atomic uint32_t* status = (_Atomic uint32_t*)&block->hdr.bh1.block_status;
+        while((atomic_load_explicit(status, memory_order_acquire) & TP_STATUS_USER) == 0) {
+            if(busy) {
+                ++st->calls;
+                ++st->empty;
+                CPU_RELAX();
+                continue;
+            }
+            int ready = poll(&pfd, 1, -1);
+            if(ready < 0 && errno == EINTR) {
+                continue;
+            }
+            ENFORCE_ERRNO(ready, "poll: capture");
+        }
+        ++st->calls;
+
+        struct timespec now;
+        receive_time(st, &now);
+
+        /* read-and-reset counters, the ring has no SO_RXQ_OVFL */
+        struct tpacket_stats_v3 stats;
+        socklen_t size = sizeof(stats);
+        ENFORCE_ERRNO(getsockopt(capture, SOL_PACKET, PACKET_STATISTICS, &stats, &size),
+                      "getsockopt: PACKET_STATISTICS");
+        st->drops += stats.tp_drops;
+
+        process_block(st, block, &now);
+        atomic_store_explicit(status, TP_STATUS_KERNEL, memory_order_release);
+    }
+
+    munmap(ring, (size_t)PACKET_BLOCK_SIZE * PACKET_BLOCKS);
+}
+
+/*
+ * AF_PACKET SOCK_DGRAM socket with a TPACKET_V3 ring, filtered down to
+ * incoming IPv4 UDP to PORT. Created with protocol 0 so that nothing is
+ * queued before the filter and the ring are in place, bind() starts it.
+ */
+static int open_capture(const struct options* opts) {
+    int capture = socket(AF_PACKET, SOCK_DGRAM, 0);
+    ENFORCE_ERRNO(capture, "socket: AF_PACKET (needs CAP_NET_RAW)");
+
+    /* offsets are relative to the network header with SOCK_DGRAM */
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 10, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 8),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offsetof(struct iphdr, protocol)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 6),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, offsetof(struct iphdr, frag_off)),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 4, 0), /* not the first fragment */
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, offsetof(struct udphdr, dest)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PORT, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0xffff),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog filter;
+    filter.len = sizeof(code) / sizeof(code[0]);
+    filter.filter = code;
+    ENFORCE_ERRNO(setsockopt(capture, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)),
+                  "setsockopt: SO_ATTACH_FILTER");
+
+    int flags = TPACKET_V3;
+    ENFORCE_ERRNO(setsockopt(capture, SOL_PACKET, PACKET_VERSION, &flags, sizeof(flags)),
+                  "setsockopt: PACKET_VERSION");
+
+    /* software unless the NIC stamps, tp_status tells which one was used */
+    flags = opts->hardware ? SOF_TIMESTAMPING_RAW_HARDWARE : SOF_TIMESTAMPING_SOFTWARE;
+    ENFORCE_ERRNO(setsockopt(capture, SOL_PACKET, PACKET_TIMESTAMP, &flags, sizeof(flags)),
+                  "setsockopt: PACKET_TIMESTAMP");
+
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = PACKET_BLOCK_SIZE;
+    req.tp_block_nr = PACKET_BLOCKS;
+    req.tp_frame_size = PACKET_FRAME_SIZE;
+    req.tp_frame_nr = PACKET_BLOCK_SIZE / PACKET_FRAME_SIZE * PACKET_BLOCKS;
+    req.tp_retire_blk_tov = PACKET_RETIRE_TOV;
+    ENFORCE_ERRNO(setsockopt(capture, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)),
+                  "setsockopt: PACKET_RX_RING");
+
+    struct sockaddr_ll local;
+    memset(&local, 0, sizeof(local));
+    local.sll_family = AF_PACKET;
+    local.sll_protocol = htons(ETH_P_IP);
+    if(strcmp(opts->capture, "any") != 0) {
+        local.sll_ifindex = if_nametoindex(opts->capture);
+        ENFORCE_CUSTOM(local.sll_ifindex != 0, "unknown interface: %s\n", opts->capture);
+    }
+    ENFORCE_ERRNO(bind(capture, (struct sockaddr*)&local, sizeof(local)), "bind: capture");
+    return capture;
+}
+
+static int open_socket(const struct options* opts, int cpu) {
     int udp = socket(AF_INET, SOCK_DGRAM, 0);
     ENFORCE_ERRNO(udp, "socket: udp");
     int flags;
@@ -79,103 +851,428 @@ int main() {
 
     ENFORCE_ERRNO(setsockopt(udp, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)),
                   "setsockopt: SO_TIMESTAMPING");
-    /*
+
     flags = ENABLE;
     ENFORCE_ERRNO(setsockopt(udp, SOL_SOCKET, SO_RXQ_OVFL, &flags, sizeof(flags)),
                   "setsockopt: SO_RXQ_OVFL");
-    */
+
+    if(opts->busy_poll > 0) {
+        /* raising SO_BUSY_POLL above net.core.busy_read needs CAP_NET_ADMIN */
+        flags = opts->busy_poll;
+        ENFORCE_ERRNO(setsockopt(udp, SOL_SOCKET, SO_BUSY_POLL, &flags, sizeof(flags)),
+                      "setsockopt: SO_BUSY_POLL");
+        flags = ENABLE;
+        ENFORCE_ERRNO(setsockopt(udp, SOL_SOCKET, SO_PREFER_BUSY_POLL, &flags, sizeof(flags)),
+                      "setsockopt: SO_PREFER_BUSY_POLL");
+    }
+    if(opts->gro) {
+        flags = ENABLE;
+        ENFORCE_ERRNO(setsockopt(udp, SOL_UDP, UDP_GRO, &flags, sizeof(flags)),
+                      "setsockopt: UDP_GRO");
+    }
+    if(opts->threads > 0) {
+        flags = ENABLE;
+        ENFORCE_ERRNO(setsockopt(udp, SOL_SOCKET, SO_REUSEPORT, &flags, sizeof(flags)),
+                      "setsockopt: SO_REUSEPORT");
+        if(opts->incoming_cpu) {
+            ENFORCE_ERRNO(setsockopt(udp, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)),
+                          "setsockopt: SO_INCOMING_CPU");
+        }
+    }
+
     struct sockaddr_in local;
     local.sin_family = AF_INET;
     local.sin_port = htons(PORT);
     local.sin_addr.s_addr = INADDR_ANY;
     ENFORCE_ERRNO(bind(udp, (struct sockaddr*)&local, sizeof(local)), "bind: udp");
+    return udp;
+}
 
-    struct sockaddr_in remote;
+static struct stats* stats_create(struct snapshot* snapshot, const struct tsc* clock) {
+    struct stats* st = calloc(1, sizeof(*st));
+    ENFORCE_CUSTOM(st != NULL, "unable to allocate stats\n");
+    for(size_t m = 0; m < METRICS; ++m) {
+        hist_reset(&st->hist[m][0]);
+        hist_reset(&st->hist[m][1]);
+    }
+    ENFORCE_ERRNO(clock_gettime(CLOCK_MONOTONIC, &st->window), "clock_gettime: window");
+    st->window_cpu = thread_cpu_ns();
+    st->snapshot = snapshot;
+    st->clock = *clock;
+    return st;
+}
 
-    char buf[DGRAM_MAX_SIZE];
-    struct iovec data;
-    data.iov_base = buf;
-    data.iov_len = sizeof(buf);
+/* counts the calling thread: open on the thread that receives */
+static void perf_create(struct stats* st, int verbose) {
+    int err = perf_open(&st->perf);
+    ENFORCE_CUSTOM(err == 0, "perf_event_open: %s\n", strerror(-err));
+    if(verbose) {
+        printf("perf: %s%s\n", perf_describe(&st->perf), st->perf.user_only ? ", user space only" : "");
+    }
+    perf_update(&st->perf_totals, &st->perf);
+    st->perf_window = st->perf_totals;
+}
 
-    char control[65536];
+static struct trace* trace_create(const char* path) {
+    struct trace* t = malloc(sizeof(*t));
+    ENFORCE_CUSTOM(t != NULL, "unable to allocate trace\n");
+    int err = trace_open(t, path, TRACE_RECORDS, TRACE_UDP_RX);
+    ENFORCE_CUSTOM(err == 0, "trace: %s: %s\n", path, strerror(-err));
+    return t;
+}
 
-    long timestampns[AVG_WINDOW];
-    long timestamping[AVG_WINDOW];
-    long counter = 0;
+static void receive(int udp, struct stats* st, const struct options* opts) {
+    if(opts->capture != NULL) {
+        receive_capture(udp, st, opts->busy_poll > 0);
+    } else if(opts->uring > 0) {
+        receive_uring(udp, st, opts->uring, opts->slot);
+    } else if(opts->batch > 0) {
+        receive_batch(udp, st, opts->batch, opts->slot, opts->busy_poll > 0);
+    } else {
+        receive_single(udp, st, opts->busy_poll > 0);
+    }
+}
 
-    printf("Waitng for incoming DGRAMS\n");
-    while(1) {
-        struct msghdr aux;
-        aux.msg_name = &remote;
-        aux.msg_namelen = sizeof(remote);
-        aux.msg_iov = &data;
-        aux.msg_iovlen = 1;
-        aux.msg_control = control;
-        aux.msg_controllen = sizeof(control);
+static void* worker_main(void* arg) {
+    struct worker* w = arg;
 
-        ssize_t read = recvmsg(udp, &aux, 0);
-        ENFORCE_ERRNO(read, "recvmsg: udp");
-        ENFORCE_CUSTOM((aux.msg_flags & MSG_CTRUNC) == 0, "cmsg truncated\n");
-        ENFORCE_CUSTOM((aux.msg_flags & MSG_TRUNC) == 0, "dgram truncated\n");
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(w->cpu, &cpus);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    ENFORCE_CUSTOM(err == 0, "pthread_setaffinity_np: cpu %d: %s\n", w->cpu, strerror(err));
 
+    /* socket, stats and trace are created on the pinned cpu */
+    int udp = open_socket(w->opts, w->cpu);
+    w->st = stats_create(w->snapshot, w->clock);
+    if(w->opts->trace != NULL) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s.%zd", w->opts->trace, w->index);
+        w->st->trace = trace_create(path);
+    }
+    if(w->opts->perf) {
+        perf_create(w->st, w->index == 0);
+    }
+    receive(udp, w->st, w->opts);
+    if(w->st->perf.kind != PERF_NONE) {
+        perf_close(&w->st->perf);
+    }
+    if(w->st->trace != NULL) {
+        trace_close(w->st->trace);
+        free(w->st->trace);
+    }
+    ENFORCE_ERRNO(close(udp), "close: udp");
+    return NULL;
+}
+
+static void snapshot_read(const struct snapshot* s, struct snapshot* copy) {
+    uint32_t seq;
+    do {
+        seq = seqlock_read_begin(&s->lock);
+        copy->counter = s->counter;
+        copy->windows = s->windows;
+        copy->drops = s->drops;
+        copy->cpu_ns = s->cpu_ns;
+        copy->lost = s->lost;
+        copy->reordered = s->reordered;
+        copy->duplicates = s->duplicates;
+        copy->late = s->late;
+        copy->gro_packets = s->gro_packets;
+        copy->truncated = s->truncated;
+        copy->perf = s->perf;
+        memcpy(copy->hist, s->hist, sizeof(copy->hist));
+    } while(seqlock_read_retry(&s->lock, seq));
+}
+
+/* merges per-thread snapshots without ever blocking the workers */
+static void report_workers(struct worker* workers, size_t count, struct metrics* m) {
+    struct snapshot* copy = malloc(sizeof(*copy));
+    struct snapshot* merged = malloc(sizeof(*merged));
+    long* counters = calloc(count, sizeof(*counters));
+    long* windows = calloc(count, sizeof(*windows));
+    long long* cpu = calloc(count, sizeof(*cpu));
+    ENFORCE_CUSTOM(copy && merged && counters && windows && cpu, "unable to allocate reporter\n");
+
+    struct perf_totals perf;
+    memset(&perf, 0, sizeof(perf));
+    struct timespec prev;
+    ENFORCE_ERRNO(clock_gettime(CLOCK_MONOTONIC, &prev), "clock_gettime: report");
+    while(1) {
+        sleep(REPORT_INTERVAL);
         struct timespec now;
-        ENFORCE_ERRNO(clock_gettime(CLOCK_REALTIME, &now), "clock_gettime");
-        /* printf("NOW: %ld.%09ld\n", now.tv_sec, now.tv_nsec); */
+        ENFORCE_ERRNO(clock_gettime(CLOCK_MONOTONIC, &now), "clock_gettime: report");
+        double elapsed = delta_ns(&now, &prev) / 1e9;
+        prev = now;
 
-        /*
-        char addr[12];
-        printf("read %zu bytes from %s:%d"
-               " - msg_namelen: %d, msg_iovlen: %zd, msg_controllen: %zd, flags: %d\n",
-               read,
-               inet_ntop(remote.sin_family, &remote.sin_addr, addr, sizeof(addr)),
-               ntohs(remote.sin_port),
-               aux.msg_namelen, aux.msg_iovlen, aux.msg_controllen, aux.msg_flags);
-        */
-
-        for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&aux);
-            cmsg != NULL;
-            cmsg = CMSG_NXTHDR(&aux, cmsg)) {
-            ENFORCE_CUSTOM(cmsg->cmsg_level == SOL_SOCKET,
-                           "unexpected control message level: %d\n", cmsg->cmsg_level);
-            struct scm_timestamping* data;
-            struct timespec* pts;
-            switch(cmsg->cmsg_type) {
-                case SCM_TIMESTAMPNS:
-                    pts = (struct timespec*)CMSG_DATA(cmsg);
-                    /* printf("SCM_TIMESTAMS      : %ld.%09ld latency: %ld ns\n", */
-                    /*        pts->tv_sec, pts->tv_nsec, delta_ns(&now, pts)); */
-                    timestampns[counter % AVG_WINDOW] = delta_ns(&now, pts);
-                    break;
-                case SCM_TIMESTAMPING:
-                    data = (struct scm_timestamping*)CMSG_DATA(cmsg);
-                    /* for(size_t idx = 0; idx < 2; ++idx) { */
-                    /*     if(data->ts[idx].tv_sec == 0 && */
-                    /*        data->ts[idx].tv_nsec == 0) { */
-                    /*         continue; */
-                    /*     } */
-                    timestamping[counter % AVG_WINDOW] = delta_ns(&now, &data->ts[0]);
-                        /* printf("SCM_TIMESTAMPING[%zd]: %ld.%09ld latency: %ld ns\n", */
-                        /*        idx, data->ts[idx].tv_sec, data->ts[idx].tv_nsec, */
-                        /*        delta_ns(&now, &data->ts[idx])); */
-                    /* } */
-                     break;
-                default:
-                    ENFORCE_CUSTOM(0, "unexpected control message type: %d\n", cmsg->cmsg_type);
+        for(size_t m = 0; m < METRICS; ++m) {
+            hist_reset(&merged->hist[m][0]);
+            hist_reset(&merged->hist[m][1]);
+        }
+        merged->lost = merged->reordered = merged->duplicates = merged->late = 0;
+        merged->gro_packets = 0;
+        merged->truncated = 0;
+        memset(&merged->perf, 0, sizeof(merged->perf));
+
+        char rates[THREADS_MAX * 40] = "";
+        size_t used = 0;
+        long total = 0;
+        long skipped = 0; /* windows overwritten by a later one before this report */
+        unsigned long long drops = 0;
+        int64_t values[COUNTERS];
+        memset(values, 0, sizeof(values));
+        for(size_t t = 0; t < count; ++t) {
+            snapshot_read(workers[t].snapshot, copy);
+            if(copy->windows - windows[t] > 1) {
+                skipped += copy->windows - windows[t] - 1;
+            }
+            for(size_t m = 0; m < METRICS; ++m) {
+                if(copy->windows != windows[t]) {
+                    hist_merge(&merged->hist[m][0], &copy->hist[m][0]);
+                }
+                hist_merge(&merged->hist[m][1], &copy->hist[m][1]);
+            }
+            windows[t] = copy->windows;
+            merged->lost += copy->lost;
+            merged->reordered += copy->reordered;
+            merged->duplicates += copy->duplicates;
+            merged->late += copy->late;
+            merged->gro_packets += copy->gro_packets;
+            merged->truncated += copy->truncated;
+            perf_totals_add(&merged->perf, &copy->perf);
+
+            drops += copy->drops;
+            values[DGRAMS] += copy->counter;
+            values[CPU_NS] += copy->cpu_ns;
+
+            long received = copy->counter - counters[t];
+            long long busy = cpu[t] != 0 ? copy->cpu_ns - cpu[t] : 0;
+            counters[t] = copy->counter;
+            cpu[t] = copy->cpu_ns;
+            total += received;
+            if(used < sizeof(rates)) {
+                /* snprintf() returns what it wanted to write, clamp to what fit */
+                int n = snprintf(rates + used, sizeof(rates) - used, " cpu%d %.0f pps %.0f%%",
+                                 workers[t].cpu, received / elapsed, busy / elapsed / 1e7);
+                used = n < 0 ? sizeof(rates) : used + n;
             }
         }
-        ++counter;
-        if((counter % AVG_WINDOW) == 0) {
-            long long avg_timestampns = 0;
-            long long avg_timestamping = 0;
-            for(size_t i = 0; i < AVG_WINDOW; ++i) {
-                avg_timestampns += timestampns[i];
-                avg_timestamping += timestamping[i];
+
+        if(m != NULL) {
+            values[DROPS] = drops;
+            values[LOST] = merged->lost;
+            values[REORDERED] = merged->reordered;
+            values[DUPLICATES] = merged->duplicates;
+            values[LATE] = merged->late;
+            values[GRO_PACKETS] = merged->gro_packets;
+            values[TRUNCATED] = merged->truncated;
+            metrics_update(m, values, merged->hist, 1);
+        }
+
+        printf("Threads %zd - rate: %.0f pps, drops: %llu total (published per %d dgrams) [%s ]\n",
+               count, total / elapsed, drops, AVG_WINDOW, rates);
+        if(skipped > 0) {
+            printf("  windows below hold each worker's latest window only, %ld earlier ones are in the totals\n",
+                   skipped);
+        }
+        for(size_t m = 0; m < METRICS; ++m) {
+            if(merged->hist[m][1].count == 0) {
+                continue;
             }
-            printf("Avg over %d - timestampns: %llu ns, timestamping: %llu ns\n",
-                   AVG_WINDOW, avg_timestampns / AVG_WINDOW, avg_timestamping / AVG_WINDOW);
+            char label[64];
+            snprintf(label, sizeof(label), "  %s window", metrics[m]);
+            hist_print(label, &merged->hist[m][0]);
+            snprintf(label, sizeof(label), "  %s total ", metrics[m]);
+            hist_print(label, &merged->hist[m][1]);
+        }
+        if(merged->hist[ONEWAY][1].count > 0) {
+            print_sequence(merged->lost, merged->reordered, merged->duplicates, merged->late);
+        }
+        if(merged->truncated > 0) {
+            printf("  truncated   : %ld dgrams longer than the slot dropped\n", merged->truncated);
+        }
+        if(merged->gro_packets > 0) {
+            printf("  gro         : %ld coalesced packets total\n", merged->gro_packets);
         }
+        perf_print("  perf        ", &merged->perf, &perf);
+        perf = merged->perf;
+        fflush(stdout);
     }
 
+    free(cpu);
+    free(windows);
+    free(counters);
+    free(merged);
+    free(copy);
+}
+
+static void receive_threads(const struct options* opts, const struct tsc* clock, struct metrics* m) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    ENFORCE_ERRNO(cpus, "sysconf: _SC_NPROCESSORS_ONLN");
+
+    struct worker* workers = calloc(opts->threads, sizeof(*workers));
+    ENFORCE_CUSTOM(workers != NULL, "unable to allocate workers\n");
+    for(size_t t = 0; t < opts->threads; ++t) {
+        struct worker* w = &workers[t];
+        w->index = t;
+        w->cpu = (opts->first_cpu + t) % cpus;
+        w->opts = opts;
+        w->clock = clock;
+        w->snapshot = aligned_alloc(CACHE_LINE, ALIGN_UP(sizeof(*w->snapshot), CACHE_LINE));
+        ENFORCE_CUSTOM(w->snapshot != NULL, "unable to allocate snapshot\n");
+        memset(w->snapshot, 0, sizeof(*w->snapshot));
+        int err = pthread_create(&w->thread, NULL, worker_main, w);
+        ENFORCE_CUSTOM(err == 0, "pthread_create: %s\n", strerror(err));
+    }
+
+    report_workers(workers, opts->threads, m);
+
+    for(size_t t = 0; t < opts->threads; ++t) {
+        pthread_join(workers[t].thread, NULL);
+        free(workers[t].st);
+        free(workers[t].snapshot);
+    }
+    free(workers);
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,
+            "usage: %s [-b batch | -u buffers | -P ifname [-H]] [-g] [-s slot] [-p usecs] [-t threads [-c cpu] [-i]]\n"
+            "          [-T trace] [-K] [-C] [-M name]\n"
+            "  -b batch    receive up to batch (<= %d) dgrams per recvmmsg() call\n"
+            "  -u buffers  io_uring multishot recvmsg into buffers (power of two, <= %d)\n"
+            "  -P ifname   capture with an AF_PACKET TPACKET_V3 ring instead of a socket (\"any\" for all)\n"
+            "  -H          ask the capture ring for raw hardware timestamps\n"
+            "  -g          UDP_GRO: take coalesced packets and split them into dgrams, e.g. from udp_sender -g\n"
+            "  -s slot     per dgram buffer size in batch and io_uring modes (default %d, %d with -g),\n"
+            "              longer dgrams are counted as truncated and dropped\n"
+            "  -p usecs    SO_BUSY_POLL/SO_PREFER_BUSY_POLL and spin on a non-blocking socket,\n"
+            "              with -P spin on the ring instead of poll()\n"
+            "  -t threads  run threads (<= %d) pinned workers, each with own SO_REUSEPORT socket\n"
+            "  -c cpu      pin the first worker to cpu, the rest follow (default 0)\n"
+            "  -i          steer flows to workers with SO_INCOMING_CPU\n"
+            "  -T trace    record raw timestamps into an mmap()ed ring of %d records,\n"
+            "              one file per worker (trace.N) with -t\n"
+            "  -M name     live metrics segment, " METRICS_DIR "name unless it has a '/' (see metrics_reader)\n"
+            "  -K          take receive times from the calibrated " TSC_NAME " instead of clock_gettime()\n"
+            "  -C          count cycles, instructions and cache misses per recvmsg()/recvmmsg() call with\n"
+            "              perf_event_open (rdpmc where allowed, software events without a PMU)\n",
+            name, BATCH_MAX, URING_BUFFERS_MAX, BATCH_SLOT_DEFAULT, DGRAM_MAX_SIZE, THREADS_MAX, TRACE_RECORDS);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    struct options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.slot = 0;
+
+    int opt;
+    while((opt = getopt(argc, argv, "b:u:P:Hgs:p:t:c:iT:KCM:h")) != -1) {
+        switch(opt) {
+            case 'b':
+                opts.batch = strtoul(optarg, NULL, 0);
+                break;
+            case 'u':
+                opts.uring = strtoul(optarg, NULL, 0);
+                break;
+            case 'P':
+                opts.capture = optarg;
+                break;
+            case 'H':
+                opts.hardware = ENABLE;
+                break;
+            case 'g':
+                opts.gro = ENABLE;
+                break;
+            case 's':
+                opts.slot = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                opts.busy_poll = strtol(optarg, NULL, 0);
+                break;
+            case 't':
+                opts.threads = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                opts.first_cpu = strtol(optarg, NULL, 0);
+                break;
+            case 'i':
+                opts.incoming_cpu = ENABLE;
+                break;
+            case 'T':
+                opts.trace = optarg;
+                break;
+            case 'K':
+                opts.tsc = ENABLE;
+                break;
+            case 'C':
+                opts.perf = ENABLE;
+                break;
+            case 'M':
+                opts.metrics = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    ENFORCE_CUSTOM(opts.batch <= BATCH_MAX, "batch too large: %zd\n", opts.batch);
+    ENFORCE_CUSTOM(opts.uring <= URING_BUFFERS_MAX && (opts.uring & (opts.uring - 1)) == 0,
+                   "buffers must be a power of two <= %d: %zd\n", URING_BUFFERS_MAX, opts.uring);
+    ENFORCE_CUSTOM(opts.batch == 0 || opts.uring == 0, "-b and -u are exclusive\n");
+    ENFORCE_CUSTOM(opts.busy_poll == 0 || opts.uring == 0, "-p and -u are exclusive\n");
+    ENFORCE_CUSTOM(opts.capture == NULL || (opts.batch == 0 && opts.uring == 0 && opts.threads == 0),
+                   "-P excludes -b, -u and -t\n");
+    ENFORCE_CUSTOM(opts.capture != NULL || !opts.hardware, "-H needs -P\n");
+    ENFORCE_CUSTOM(opts.capture == NULL || !opts.gro, "-P excludes -g\n");
+    ENFORCE_CUSTOM(!opts.perf || (opts.capture == NULL && opts.uring == 0), "-C excludes -P and -u\n");
+    if(opts.slot == 0) {
+        /* a coalesced packet is up to 64k, a short slot would truncate it */
+        opts.slot = opts.gro ? DGRAM_MAX_SIZE : BATCH_SLOT_DEFAULT;
+    }
+    ENFORCE_CUSTOM(opts.busy_poll >= 0, "invalid busy poll: %d\n", opts.busy_poll);
+    ENFORCE_CUSTOM(opts.slot > 0 && opts.slot <= DGRAM_MAX_SIZE, "invalid slot size: %zd\n", opts.slot);
+    ENFORCE_CUSTOM(opts.threads <= THREADS_MAX, "too many threads: %zd\n", opts.threads);
+    ENFORCE_CUSTOM(opts.first_cpu >= 0, "invalid cpu: %d\n", opts.first_cpu);
+
+    struct tsc clock;
+    if(opts.tsc) {
+        int err = tsc_init(&clock);
+        ENFORCE_CUSTOM(err == 0, "-K: no invariant %s on this cpu\n", TSC_NAME);
+    } else {
+        tsc_init_realtime(&clock);
+    }
+    tsc_print_overhead(&clock);
+
+    struct metrics* m = opts.metrics != NULL ? metrics_create(opts.metrics) : NULL;
+
+    printf("Waitng for incoming DGRAMS\n");
+    if(opts.threads > 0) {
+        receive_threads(&opts, &clock, m);
+        return 0;
+    }
+
+    int udp = opts.capture != NULL ? open_capture(&opts) : open_socket(&opts, -1);
+    struct stats* st = stats_create(NULL, &clock);
+    st->metrics = m;
+    if(opts.trace != NULL) {
+        st->trace = trace_create(opts.trace);
+    }
+    if(opts.perf) {
+        perf_create(st, 1);
+    }
+    receive(udp, st, &opts);
+
+    if(st->perf.kind != PERF_NONE) {
+        perf_close(&st->perf);
+    }
+    if(st->trace != NULL) {
+        trace_close(st->trace);
+        free(st->trace);
+    }
+    free(st);
+    if(m != NULL) {
+        metrics_close(m);
+        free(m);
+    }
     ENFORCE_ERRNO(close(udp), "close: udp");
     return 0;
 }
@@ -0,0 +1,209 @@
+#ifndef URING_H
+#define URING_H
+
+/*
+ * Minimal io_uring wrapper on top of the raw syscalls, just enough for a
+ * multishot receive with a provided buffer ring (Linux 6.0+). Functions
+ * return 0 or -errno and never exit, callers decide how to fail.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+struct uring {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned sqe_tail; /* next sqe to hand out, published on submit */
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+};
+
+/* provided buffers: count buffers of size bytes each, ids are indexes */
+struct uring_buf_ring {
+    struct io_uring_buf_ring* ring;
+    size_t ring_size;
+    char* base;
+    size_t size;
+    unsigned count;
+    unsigned short bgid;
+};
+
+static inline int uring_init(struct uring* r, unsigned entries, unsigned cq_entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = cq_entries;
+
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if(r->fd < 0) {
+        return -errno;
+    }
+
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(r->cq_size > r->sq_size) {
+            r->sq_size = r->cq_size;
+        }
+        r->cq_size = r->sq_size;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if(r->sq_ptr == MAP_FAILED) {
+        return -errno;
+    }
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         r->fd, IORING_OFF_CQ_RING);
+        if(r->cq_ptr == MAP_FAILED) {
+            return -errno;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED) {
+        return -errno;
+    }
+
+    char* sq = r->sq_ptr;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->sqe_tail = *r->sq_tail;
+
+    char* cq = r->cq_ptr;
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+static inline void uring_exit(struct uring* r) {
+    munmap(r->sqes, r->sqes_size);
+    if(r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_size);
+    }
+    munmap(r->sq_ptr, r->sq_size);
+    close(r->fd);
+}
+
+/* NULL if the submission queue is full */
+static inline struct io_uring_sqe* uring_get_sqe(struct uring* r) {
+    unsigned head = atomic_load_explicit((_Atomic unsigned*)r->sq_head, memory_order_acquire);
+    if(r->sqe_tail - head > *r->sq_mask) {
+        return NULL;
+    }
+    unsigned idx = r->sqe_tail++ & *r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    return sqe;
+}
+
+static inline int uring_submit_and_wait(struct uring* r, unsigned wait_nr) {
+    unsigned tail = *r->sq_tail;
+    unsigned submit = r->sqe_tail - tail;
+    atomic_store_explicit((_Atomic unsigned*)r->sq_tail, r->sqe_tail, memory_order_release);
+    int ret = syscall(__NR_io_uring_enter, r->fd, submit, wait_nr,
+                      wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    return ret < 0 ? -errno : ret;
+}
+
+/* NULL if the completion queue is empty */
+static inline struct io_uring_cqe* uring_peek_cqe(struct uring* r) {
+    unsigned head = *r->cq_head;
+    unsigned tail = atomic_load_explicit((_Atomic unsigned*)r->cq_tail, memory_order_acquire);
+    return head == tail ? NULL : &r->cqes[head & *r->cq_mask];
+}
+
+/* completions already posted */
+static inline unsigned uring_cq_ready(struct uring* r) {
+    return atomic_load_explicit((_Atomic unsigned*)r->cq_tail, memory_order_acquire) - *r->cq_head;
+}
+
+static inline void uring_cqe_seen(struct uring* r) {
+    atomic_store_explicit((_Atomic unsigned*)r->cq_head, *r->cq_head + 1, memory_order_release);
+}
+
+static inline char* uring_buf(const struct uring_buf_ring* b, unsigned short bid) {
+    return b->base + (size_t)bid * b->size;
+}
+
+/* hands buffer bid (back) to the kernel */
+static inline void uring_buf_ring_add(struct uring_buf_ring* b, unsigned short bid) {
+    unsigned short tail = b->ring->tail;
+    struct io_uring_buf* buf = &b->ring->bufs[tail & (b->count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buf(b, bid);
+    buf->len = b->size;
+    buf->bid = bid;
+    atomic_store_explicit((_Atomic unsigned short*)&b->ring->tail, tail + 1, memory_order_release);
+}
+
+/* count must be a power of two */
+static inline int uring_buf_ring_setup(struct uring* r, struct uring_buf_ring* b,
+                                       unsigned count, size_t size, unsigned short bgid) {
+    memset(b, 0, sizeof(*b));
+    b->count = count;
+    b->size = size;
+    b->bgid = bgid;
+    b->ring_size = count * sizeof(struct io_uring_buf);
+    b->ring = mmap(NULL, b->ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(b->ring == MAP_FAILED) {
+        return -errno;
+    }
+    b->base = mmap(NULL, count * size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if(b->base == MAP_FAILED) {
+        return -errno;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)b->ring;
+    reg.ring_entries = count;
+    reg.bgid = bgid;
+    if(syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return -errno;
+    }
+    for(unsigned i = 0; i < count; ++i) {
+        uring_buf_ring_add(b, i);
+    }
+    return 0;
+}
+
+static inline void uring_buf_ring_free(struct uring* r, struct uring_buf_ring* b) {
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = b->bgid;
+    syscall(__NR_io_uring_register, r->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(b->base, b->count * b->size);
+    munmap(b->ring, b->ring_size);
+}
+
+#endif